@@ -0,0 +1,514 @@
+// load generator for twmailer-server: many connections replay a mix of commands, latency is reported per command
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <unistd.h> // for close()
+#include <netinet/in.h> // for sockaddr_in
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <arpa/inet.h> // for inet_pton
+#include <sys/socket.h> // for socket functions
+#include <sys/types.h>
+#include <sys/resource.h> // for the descriptor limit
+#include <getopt.h> // for command line options
+#include <thread> // for the load threads
+#include <mutex>
+#include <condition_variable> // for the start barrier
+#include <chrono> // for latencies
+#include <random> // for the command mix and sizes
+#include <atomic>
+#include <memory> // for unique_ptr
+#include <iomanip> // for the report
+#include "twmailer-common.h" // for InputBuffer and the v2 frames
+
+#define SUB_BUCKET_BITS 6 // 64 linear steps per power of two, values are kept with about 3% precision
+#define SUB_BUCKET_HALF (1 << (SUB_BUCKET_BITS - 1))
+#define HISTOGRAM_MAGNITUDES 40 // latencies up to 2^40 microseconds
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAGNITUDES + 2) * SUB_BUCKET_HALF)
+
+using namespace std;
+
+// commands the load mix is made of
+enum BenchCommand {
+    CMD_LOGIN,
+    CMD_SEND,
+    CMD_LIST,
+    CMD_READ,
+    CMD_DEL,
+    CMD_COUNT
+};
+const char* command_names[CMD_COUNT] = {"LOGIN", "SEND", "LIST", "READ", "DEL"};
+
+// latency histogram in the style of HdrHistogram: log-linear buckets, fixed memory, mergeable
+class LatencyHistogram {
+public:
+    void record(uint64_t us);
+    void merge(const LatencyHistogram& other);
+    uint64_t percentile(double p) const; // upper bound of the bucket holding the p-th percentile
+    uint64_t count() const { return total; }
+    uint64_t max() const { return largest; }
+
+private:
+    static size_t bucket(uint64_t us);
+    static uint64_t bucket_limit(size_t index);
+
+    vector<uint64_t> counts = vector<uint64_t>(HISTOGRAM_BUCKETS); // samples per bucket
+    uint64_t total = 0; // samples recorded
+    uint64_t largest = 0; // exact maximum
+};
+
+// one closed-loop client connection, its user's mailbox is only written by this connection
+struct BenchConnection {
+    int sock; // server socket
+    InputBuffer in; // buffered responses
+    string user; // mailbox, unique per connection and run
+    unsigned long first_id = 1; // oldest message not deleted yet
+    unsigned long next_id = 1; // id the next SEND gets, the mailbox starts empty
+
+    BenchConnection(int sock, const string& user) : sock(sock), in(sock), user(user) {}
+};
+
+// what one load thread measured
+struct BenchResults {
+    LatencyHistogram latency[CMD_COUNT];
+    uint64_t errors[CMD_COUNT] = {};
+    uint64_t bytes_sent = 0; // request bytes
+    uint64_t bytes_received = 0; // message and listing bytes
+};
+
+// global variables
+string server_ip = "127.0.0.1"; // server to load
+int server_port = 0; // its port
+int connection_count = 100; // connections opened and kept for the whole run
+int thread_count = 8; // load threads, each drives connection_count / thread_count connections
+double duration = 10; // seconds of load after all connections logged in
+string user_prefix; // mailbox names are <prefix><connection>
+string password = "bench"; // accepted by the stub backend without a users file
+int mix[CMD_COUNT] = {1, 5, 2, 2, 1}; // relative weights of LOGIN, SEND, LIST, READ, DEL
+size_t body_min = 100, body_max = 2000; // message body sizes, uniform
+size_t attachment_min = 1000, attachment_max = 100000; // attachment sizes, uniform
+int attachment_percent = 10; // SENDs with an attachment
+string payload_kind = "random"; // random letters, or text that compresses like mail
+string payload; // printable bytes, bodies and attachments are slices of it
+atomic<bool> failed{false}; // a connection was lost, the run is not valid
+mutex start_mutex; // the load starts once every thread has logged in its connections
+condition_variable start_changed;
+int threads_ready = 0; // threads done with their setup
+bool load_started = false; // deadline is set
+chrono::steady_clock::time_point deadline; // end of the load
+
+// function declarations
+void print_usage();
+bool parse_range(const char* text, size_t& min_value, size_t& max_value);
+bool parse_mix(const char* text);
+int connect_to_server();
+bool send_all(int sock, const string& data);
+string request(const string& command, const vector<string>& args, const string& body = "", size_t attachment = 0);
+bool read_status(BenchConnection& conn, string& status);
+bool skip_frames(BenchConnection& conn, uint8_t type, uint64_t count, uint64_t& bytes);
+bool run_command(BenchConnection& conn, BenchCommand command, mt19937_64& rng, BenchResults& results, bool& ok);
+void run_load_thread(int index, BenchResults& results);
+void wait_for_start();
+void print_report(const BenchResults& results, double seconds);
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-bench [options] <ip> <port>" << endl;
+    cerr << "  --connections <n>        connections kept open, each with its own mailbox (default: 100)" << endl;
+    cerr << "  --threads <n>            load threads, one request in flight each (default: 8)" << endl;
+    cerr << "  --duration <s>           seconds of load after all connections logged in (default: 10)" << endl;
+    cerr << "  --mix <l,s,li,r,d>       weights of LOGIN, SEND, LIST, READ and DEL (default: 1,5,2,2,1)" << endl;
+    cerr << "  --body-size <min-max>    message body bytes (default: 100-2000)" << endl;
+    cerr << "  --attachment-size <min-max>  attachment bytes (default: 1000-100000)" << endl;
+    cerr << "  --attachments <percent>  SENDs with an attachment (default: 10)" << endl;
+    cerr << "  --payload <random|text>  random letters or lines of words, to compare server compression (default: random)" << endl;
+    cerr << "  --user-prefix <name>     mailbox name prefix (default: bench<pid>_, fresh mailboxes every run)" << endl;
+    cerr << "  --password <password>    password of every user (default: bench)" << endl;
+    cerr << "The server has to run with --auth stub (or know the users) and limits that allow the connections." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"connections", required_argument, nullptr, 'c'},
+        {"threads", required_argument, nullptr, 't'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"mix", required_argument, nullptr, 'm'},
+        {"body-size", required_argument, nullptr, 'b'},
+        {"attachment-size", required_argument, nullptr, 'a'},
+        {"attachments", required_argument, nullptr, 'p'},
+        {"payload", required_argument, nullptr, 'P'},
+        {"user-prefix", required_argument, nullptr, 'u'},
+        {"password", required_argument, nullptr, 'w'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    bool valid = true;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'c':
+                connection_count = atoi(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'm':
+                valid = valid && parse_mix(optarg);
+                break;
+            case 'b':
+                valid = valid && parse_range(optarg, body_min, body_max);
+                break;
+            case 'a':
+                valid = valid && parse_range(optarg, attachment_min, attachment_max);
+                break;
+            case 'p':
+                attachment_percent = atoi(optarg);
+                break;
+            case 'P':
+                payload_kind = optarg;
+                break;
+            case 'u':
+                user_prefix = optarg;
+                break;
+            case 'w':
+                password = optarg;
+                break;
+            default:
+                valid = false;
+        }
+    }
+    if (!valid || argc - optind != 2 || connection_count <= 0 || thread_count <= 0 || duration <= 0
+        || attachment_percent < 0 || attachment_percent > 100 || (payload_kind != "random" && payload_kind != "text") || body_max >= MAX_DATA_FRAME || attachment_max >= MAX_DATA_FRAME) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    server_ip = argv[optind];
+    server_port = atoi(argv[optind + 1]);
+    thread_count = min(thread_count, connection_count);
+    if (user_prefix.empty()) {
+        user_prefix = "bench" + to_string(getpid()) + "_";
+    }
+
+    // thousands of connections need more descriptors than the usual soft limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // printable, so the same bytes work as message bodies
+    mt19937_64 rng(42);
+    size_t payload_size = max(body_max, attachment_max);
+    if (payload_kind == "text") {
+        static const char* words[] = {"the", "message", "meeting", "tomorrow", "please", "attached", "report", "and",
+                                      "regards", "server", "we", "will", "send", "you", "a", "new", "version", "of", "it"};
+        while (payload.length() < payload_size) {
+            payload += words[rng() % (sizeof(words) / sizeof(words[0]))];
+            payload += rng() % 12 == 0 ? '\n' : ' ';
+        }
+        payload.resize(payload_size);
+    } else {
+        payload.resize(payload_size);
+        for (char& c : payload) c = 'a' + rng() % 26;
+    }
+
+    cout << "Connecting " << connection_count << " connection(s) from " << thread_count << " thread(s) to "
+         << server_ip << ":" << server_port << ", " << duration << "s of load" << endl;
+    vector<BenchResults> results(thread_count);
+    vector<thread> threads;
+    for (int i = 0; i < thread_count; i++) {
+        threads.emplace_back(run_load_thread, i, ref(results[i]));
+    }
+    chrono::steady_clock::time_point start;
+    {
+        unique_lock<mutex> lock(start_mutex);
+        start_changed.wait(lock, [] { return threads_ready == thread_count; });
+        start = chrono::steady_clock::now();
+        deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(duration));
+        load_started = true;
+    }
+    start_changed.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    BenchResults total;
+    for (const auto& r : results) {
+        for (int c = 0; c < CMD_COUNT; c++) {
+            total.latency[c].merge(r.latency[c]);
+            total.errors[c] += r.errors[c];
+        }
+        total.bytes_sent += r.bytes_sent;
+        total.bytes_received += r.bytes_received;
+    }
+    print_report(total, seconds);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// "<min>-<max>" or a single size
+bool parse_range(const char* text, size_t& min_value, size_t& max_value) {
+    char* end;
+    min_value = strtoull(text, &end, 10);
+    max_value = *end == '-' ? strtoull(end + 1, &end, 10) : min_value;
+    return *end == '\0' && min_value <= max_value;
+}
+
+bool parse_mix(const char* text) {
+    int total = 0;
+    for (int c = 0; c < CMD_COUNT; c++) {
+        char* end;
+        mix[c] = strtol(text, &end, 10);
+        if (mix[c] < 0 || (c < CMD_COUNT - 1 && *end != ',') || (c == CMD_COUNT - 1 && *end != '\0')) return false;
+        total += mix[c];
+        text = end + 1;
+    }
+    return total > 0;
+}
+
+int connect_to_server() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket");
+        return -1;
+    }
+    struct sockaddr_in server_addr{}; // server address
+    server_addr.sin_family = AF_INET; // ipv4
+    server_addr.sin_port = htons(server_port); // port number
+    if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0 || connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection Failed");
+        close(sock);
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); // a request is written in one piece, don't wait for acks
+    return sock;
+}
+
+bool send_all(int sock, const string& data) {
+    size_t total_sent = 0;
+    while (total_sent < data.length()) {
+        ssize_t sent = send(sock, data.data() + total_sent, data.length() - total_sent, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return false;
+        }
+        total_sent += sent;
+    }
+    return true;
+}
+
+// a complete v2 request, the attachment is the first bytes of the payload
+string request(const string& command, const vector<string>& args, const string& body, size_t attachment) {
+    string frames = make_frame(FRAME_COMMAND, command);
+    for (const auto& arg : args) {
+        frames += make_frame(FRAME_ARG, arg);
+    }
+    if (!body.empty()) {
+        frames += make_frame(FRAME_BODY, body);
+    }
+    if (attachment > 0) {
+        frames += frame_header(FRAME_FILE, attachment);
+        frames.append(payload, 0, attachment);
+    }
+    frames += frame_header(FRAME_END, 0);
+    return frames;
+}
+
+bool read_status(BenchConnection& conn, string& status) {
+    uint8_t type;
+    uint32_t length;
+    status.clear();
+    return conn.in.read_frame_header(type, length) && type == FRAME_STATUS && conn.in.read_bytes(length, status);
+}
+
+// reads and drops count ITEM frames, or DATA frames until count bytes arrived
+bool skip_frames(BenchConnection& conn, uint8_t type, uint64_t count, uint64_t& bytes) {
+    while (count > 0) {
+        uint8_t frame_type;
+        uint32_t length;
+        if (!conn.in.read_frame_header(frame_type, length) || frame_type != type) return false;
+        bytes += length;
+        count -= type == FRAME_ITEM ? 1 : min<uint64_t>(length, count);
+        while (length > 0) {
+            if (conn.in.size() == 0 && conn.in.fill() <= 0) return false;
+            size_t take = min<size_t>(length, conn.in.size());
+            conn.in.consume(take);
+            length -= take;
+        }
+    }
+    return true;
+}
+
+// one request and its complete response, false if the connection is unusable
+bool run_command(BenchConnection& conn, BenchCommand command, mt19937_64& rng, BenchResults& results, bool& ok) {
+    string frames;
+    switch (command) {
+        case CMD_LOGIN:
+            frames = request("LOGIN", {conn.user, password});
+            break;
+        case CMD_SEND: {
+            size_t body = body_min + rng() % (body_max - body_min + 1);
+            size_t attachment = (int)(rng() % 100) < attachment_percent ? attachment_min + rng() % (attachment_max - attachment_min + 1) : 0;
+            frames = request("SEND", {conn.user, "bench message " + to_string(conn.next_id), attachment > 0 ? "bench.bin" : ""},
+                             payload.substr(payload.length() - body), attachment);
+            break;
+        }
+        case CMD_LIST:
+            frames = request("LIST", {});
+            break;
+        case CMD_READ:
+            frames = request("FETCH", {to_string(conn.first_id + rng() % (conn.next_id - conn.first_id))});
+            break;
+        case CMD_DEL:
+            frames = request("DEL", {to_string(conn.first_id)}); // oldest first, the live ids stay contiguous
+            break;
+        default:
+            return false;
+    }
+    if (!send_all(conn.sock, frames)) return false;
+    results.bytes_sent += frames.length();
+
+    string status;
+    if (!read_status(conn, status)) return false;
+    ok = status.compare(0, 2, "OK") == 0;
+    if (!ok) return true;
+
+    if (command == CMD_SEND) {
+        conn.next_id++;
+    } else if (command == CMD_DEL) {
+        conn.first_id++;
+    } else if (command == CMD_LIST || command == CMD_READ) {
+        uint64_t count = status.length() > 3 ? stoull(status.substr(3)) : 0; // "OK <items or bytes>"
+        return skip_frames(conn, command == CMD_LIST ? FRAME_ITEM : FRAME_DATA, count, results.bytes_received);
+    }
+    return true;
+}
+
+void run_load_thread(int index, BenchResults& results) {
+    mt19937_64 rng(index + 1);
+    vector<unique_ptr<BenchConnection>> connections;
+
+    // open and log in this thread's share of the connections, this setup is not part of the measurement
+    for (int c = index; c < connection_count; c += thread_count) {
+        int sock = connect_to_server();
+        if (sock < 0) {
+            failed = true;
+            break;
+        }
+        connections.emplace_back(new BenchConnection(sock, user_prefix + to_string(c)));
+        BenchConnection& conn = *connections.back();
+        string_view line;
+        bool ok = false;
+        if (!send_all(sock, PROTOCOL_V2_HELLO "\n") || !conn.in.read_line(line) || line != "OK v2"
+            || !run_command(conn, CMD_LOGIN, rng, results, ok) || !ok) {
+            cerr << "Connection " << c << " could not negotiate v2 and log in" << (line == "ERR busy" ? " (server busy)" : "") << endl;
+            failed = true;
+            break;
+        }
+    }
+    wait_for_start();
+
+    int total_weight = 0;
+    for (int w : mix) total_weight += w;
+
+    // closed loop: the connections take turns, each with one request in flight
+    size_t next = 0;
+    while (chrono::steady_clock::now() < deadline && !failed) {
+        BenchConnection& conn = *connections[next];
+        next = (next + 1) % connections.size();
+
+        int pick = rng() % total_weight;
+        int command = 0;
+        while (pick >= mix[command]) pick -= mix[command++];
+        if ((command == CMD_READ || command == CMD_DEL) && conn.first_id == conn.next_id) {
+            command = CMD_SEND; // nothing to read or delete yet
+        }
+
+        auto begin = chrono::steady_clock::now();
+        bool ok = false;
+        if (!run_command(conn, (BenchCommand)command, rng, results, ok)) {
+            cerr << "Connection to the server lost during " << command_names[command] << endl;
+            failed = true;
+            break;
+        }
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin);
+        results.latency[command].record(elapsed.count());
+        if (!ok) results.errors[command]++;
+    }
+
+    for (auto& conn : connections) {
+        send_all(conn->sock, request("QUIT", {}));
+        close(conn->sock);
+    }
+}
+
+// counts this thread as ready and blocks until every thread is
+void wait_for_start() {
+    unique_lock<mutex> lock(start_mutex);
+    threads_ready++;
+    start_changed.notify_all();
+    start_changed.wait(lock, [] { return load_started; });
+}
+
+void print_report(const BenchResults& results, double seconds) {
+    LatencyHistogram all;
+    uint64_t errors = 0;
+    cout << left << setw(8) << "command" << right << setw(10) << "count" << setw(8) << "errors" << setw(11) << "ops/s"
+         << setw(10) << "p50_ms" << setw(10) << "p99_ms" << setw(10) << "p999_ms" << setw(10) << "max_ms" << "\n";
+    auto row = [&](const string& name, const LatencyHistogram& h, uint64_t errs) {
+        cout << left << setw(8) << name << right << setw(10) << h.count() << setw(8) << errs
+             << setw(11) << fixed << setprecision(1) << h.count() / seconds << setprecision(3)
+             << setw(10) << h.percentile(50) / 1000.0 << setw(10) << h.percentile(99) / 1000.0
+             << setw(10) << h.percentile(99.9) / 1000.0 << setw(10) << h.max() / 1000.0 << "\n";
+    };
+    for (int c = 0; c < CMD_COUNT; c++) {
+        row(command_names[c], results.latency[c], results.errors[c]);
+        all.merge(results.latency[c]);
+        errors += results.errors[c];
+    }
+    row("total", all, errors);
+    cout << setprecision(1) << "sent " << results.bytes_sent / 1048576.0 << " MB, received " << results.bytes_received / 1048576.0
+         << " MB in " << seconds << "s" << endl;
+}
+
+void LatencyHistogram::record(uint64_t us) {
+    us = min<uint64_t>(us, (1ULL << HISTOGRAM_MAGNITUDES) - 1);
+    counts[bucket(us)]++;
+    total++;
+    largest = std::max(largest, us);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    largest = std::max(largest, other.largest);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= std::max<uint64_t>(rank, 1)) return std::min(bucket_limit(i), largest);
+    }
+    return largest;
+}
+
+// values below 2^SUB_BUCKET_BITS are exact, above that each power of two is split into SUB_BUCKET_HALF steps
+size_t LatencyHistogram::bucket(uint64_t us) {
+    int msb = 63 - __builtin_clzll(us | 1);
+    int shift = std::max(0, msb - (SUB_BUCKET_BITS - 1));
+    return (size_t)shift * SUB_BUCKET_HALF + (us >> shift);
+}
+
+uint64_t LatencyHistogram::bucket_limit(size_t index) {
+    if (index < 2 * SUB_BUCKET_HALF) return index;
+    size_t shift = index / SUB_BUCKET_HALF - 1;
+    uint64_t sub = index - shift * SUB_BUCKET_HALF;
+    return ((sub + 1) << shift) - 1;
+}
@@ -2,31 +2,140 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <vector>
 #include <unistd.h> // for close()
 #include <netinet/in.h> // for sockaddr_in
 #include <arpa/inet.h> // for inet_pton
 #include <sys/socket.h> // for socket functions
 #include <sys/types.h>
+#include <getopt.h> // for command line options
 #include <fstream>
 #include <sstream>
+#include <deque> // for the commands in flight
+#include <thread> // for the batch response reader
+#include <mutex>
+#include <condition_variable>
+#include "twmailer-common.h" // for InputBuffer and the v2 frames
 
 #define BUFFER_SIZE 1024 // define buffer size
+#define FILE_CHUNK_SIZE 65536 // attachment bytes read and sent at a time
+#define BATCH_WINDOW 1024 // default number of batch commands sent ahead of their responses
 
 using namespace std;
 
-void send_command(int sock, const string& command);
-string read_line(int sock);
-void interactive_mode(int sock);
+// one server connection, the protocol is chosen once right after connecting
+struct Connection {
+    int sock; // server socket
+    InputBuffer in; // buffered responses of this connection
+    bool v2 = false; // framed protocol negotiated
+    bool buffered = false; // collect requests in pending and send them in large writes (batch mode)
+    string pending; // requests not yet sent
+
+    explicit Connection(int sock) : sock(sock), in(sock) {}
+};
+
+// one script command whose response hasn't been read yet, responses arrive in the order of the commands
+struct BatchCommand {
+    size_t line_number; // line in the script, for the report
+    string command; // LOGIN, SEND, LIST, SEARCH, READ, GETFILE or DEL
+    string argument; // message selector of READ, GETFILE and DEL, paging arguments of LIST, query of SEARCH
+    string output_path; // where READ and GETFILE store the content, empty = stdout
+};
+
+// commands sent but not answered yet, shared by the sending and the reading thread
+struct BatchQueue {
+    mutex queue_mutex;
+    condition_variable changed; // a command was queued or answered
+    deque<BatchCommand> in_flight; // oldest first
+    bool done = false; // the whole script was sent
+    bool broken = false; // connection lost, remaining commands fail without a response
+    size_t failed = 0; // commands answered with an error or never answered
+};
+
+void send_command(Connection& conn, const string& command);
+void flush_commands(Connection& conn);
+void send_frame(Connection& conn, uint8_t type, const string& payload);
+string read_line(InputBuffer& in);
+string read_status(Connection& conn);
+void interactive_mode(Connection& conn);
+bool negotiate_v2(Connection& conn);
+bool do_login(Connection& conn, const string& username, const string& password);
+string do_send(Connection& conn, const string& receiver, const string& subject, const string& filename, const string& message, ifstream& file);
+bool do_list(Connection& conn, const string& page, vector<string>& subjects, size_t& total);
+bool do_search(Connection& conn, const string& query, vector<string>& matches, size_t& total);
+bool do_read(Connection& conn, const string& command, const string& msg_num, ostream& out, size_t& length);
+bool do_read_list(Connection& conn, const string& msg_list, ostream& out, ostream& labels, size_t& count);
+string do_del(Connection& conn, const string& msg_num);
+void do_quit(Connection& conn);
+void request_login(Connection& conn, const string& username, const string& password);
+void request_send(Connection& conn, const string& receiver, const string& subject, const string& filename, const string& message, ifstream& file);
+void request_list(Connection& conn, const string& page);
+void request_search(Connection& conn, const string& query);
+void request_read(Connection& conn, const string& command, const string& msg_num);
+void request_stats(Connection& conn);
+void request_del(Connection& conn, const string& msg_num);
+bool read_list(Connection& conn, vector<string>& subjects, size_t& total);
+bool parse_list_count(const Connection& conn, const string& status, size_t& count, size_t& total);
+bool read_items(Connection& conn, size_t count, vector<string>& subjects);
+bool read_content(Connection& conn, ostream& out, size_t& length);
+bool read_message_list(Connection& conn, const string& status, ostream& out, ostream& labels, size_t& count);
+size_t run_batch(Connection& conn, istream& script, size_t window);
+bool queue_batch_command(Connection& conn, BatchQueue& queue, size_t window, size_t line_number, const string& line);
+void read_batch_responses(Connection& conn, BatchQueue& queue);
+void send_attachment(Connection& conn, ifstream& file);
+bool receive_file(Connection& conn, size_t length, ostream& out);
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-client [--legacy] [--batch <script|->] [--window <n>] <ip> <port>" << endl;
+    cerr << "  --legacy          stay with the line protocol" << endl;
+    cerr << "  --batch <script>  run the commands of a script (- = stdin) on one connection without waiting for each response" << endl;
+    cerr << "  --window <n>      batch commands sent ahead of their responses (default: " << BATCH_WINDOW << ")" << endl;
+    cerr << "Script lines, one command each, fields separated by single spaces, # starts a comment:" << endl;
+    cerr << "  LOGIN <username> <password>" << endl;
+    cerr << "  SEND <receiver>[,<receiver>...] <body-file|-> <attachment-file|-> <subject>" << endl;
+    cerr << "  LIST [<offset> <limit> [newest] [long]]" << endl;
+    cerr << "  SEARCH <word>..." << endl;
+    cerr << "  READ <messages> [<output-file>]" << endl;
+    cerr << "  GETFILE <message-number>[:<first>-[<last>]] <output-file>" << endl;
+    cerr << "  DEL <messages>" << endl;
+    cerr << "<messages> is a message number, numbers and ranges like 1-5,9, or <message-number>:<first>-[<last>] for a byte range;" << endl;
+    cerr << "a byte range is appended to the output file, to resume an interrupted download;" << endl;
+    cerr << "SEARCH finds the messages containing every word, from:, subject: or body: in front of a word limits it to that field" << endl;
+}
 
 int main(int argc, char *argv[]) {
+    bool legacy = false; // stay with the line protocol
+    string batch; // script of the batch mode, empty = interactive
+    int window = BATCH_WINDOW; // commands in flight in batch mode
+
+    static struct option long_options[] = {
+        {"legacy", no_argument, nullptr, 'l'},
+        {"batch", required_argument, nullptr, 'b'},
+        {"window", required_argument, nullptr, 'w'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        if (opt == 'l') {
+            legacy = true;
+        } else if (opt == 'b') {
+            batch = optarg;
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            window = atoi(optarg);
+        } else {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // check if correct number of arguments is provided
-    if (argc != 3) {
-        cerr << "Usage: ./twmailer-client <ip> <port>" << endl;
+    if (argc - optind != 2) {
+        print_usage();
         exit(EXIT_FAILURE);
     }
 
-    const char *ip = argv[1]; // get server ip
-    int port = atoi(argv[2]); // get port number
+    const char *ip = argv[optind]; // get server ip
+    int port = atoi(argv[optind + 1]); // get port number
 
     int client_sock;
     struct sockaddr_in server_addr{}; // server address
@@ -52,16 +161,37 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    Connection conn(client_sock);
+    if (!batch.empty()) {
+        // stdout only carries the results, the script decides what to do
+        ifstream script_file;
+        if (batch != "-") {
+            script_file.open(batch);
+            if (!script_file.is_open()) {
+                cerr << "Failed to open script: " << batch << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (!legacy) negotiate_v2(conn);
+        size_t failed = run_batch(conn, batch == "-" ? cin : script_file, window);
+        close(client_sock); // close socket
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     cout << "Connected to server." << endl;
 
-    interactive_mode(client_sock); // start interactive mode
+    if (!legacy && negotiate_v2(conn)) {
+        cout << "Using protocol v2." << endl;
+    }
+
+    interactive_mode(conn); // start interactive mode
 
     close(client_sock); // close socket
     cout << "Disconnected from server." << endl;
     return 0;
 }
 
-void interactive_mode(int sock) {
+void interactive_mode(Connection& conn) {
     string input;
     bool logged_in = false;
     string username;
@@ -70,42 +200,35 @@ void interactive_mode(int sock) {
         if (!logged_in) {
             cout << "Please login first." << endl;
             cout << "Enter command (LOGIN or QUIT): ";
-            getline(cin, input);
+            if (!getline(cin, input)) input = "QUIT"; // end of input
 
             if (input == "LOGIN") {
-                send_command(sock, "LOGIN\n"); // send login command
                 cout << "Username: ";
                 getline(cin, username); // get username
                 cout << "Password: ";
                 string password;
                 getline(cin, password); // get password
 
-                send_command(sock, username + "\n"); // send username
-                send_command(sock, password + "\n"); // send password
-
-                string response = read_line(sock); // read response
-                if (response == "OK\n") {
+                if (do_login(conn, username, password)) {
                     logged_in = true; // set logged in
                     cout << "Login successful." << endl;
                 } else {
                     cout << "Login failed." << endl;
                 }
             } else if (input == "QUIT") {
-                send_command(sock, "QUIT\n"); // send quit command
+                do_quit(conn); // send quit command
                 break;
             } else {
                 cout << "Unknown command." << endl;
             }
         } else {
-            cout << "Enter command (SEND, LIST, READ, DEL, QUIT): ";
-            getline(cin, input);
+            cout << "Enter command (SEND, LIST, SEARCH, READ, GETFILE, DEL, STATS, QUIT): ";
+            if (!getline(cin, input)) input = "QUIT"; // end of input
 
             if (input == "SEND") {
-                send_command(sock, "SEND\n"); // send send command
-
-                string receiver, subject, message, line, fileask, filename, filepath, file;
-                cout << "Receiver: ";
-                getline(cin, receiver); // get receiver
+                string receiver, subject, message, line, fileask, filename, filepath;
+                cout << "Receiver(s), comma separated: ";
+                getline(cin, receiver); // get receivers
                 cout << "Subject: ";
                 getline(cin, subject); // get subject
                 if (subject.length() > 80) {
@@ -120,81 +243,103 @@ void interactive_mode(int sock) {
 
                 cout << "Do you want to send a file?[y|n]";
             getline(cin, fileask);
+            ifstream inputFile;
             if(fileask == "y" || fileask == "Y"){
                 cout << "Filepath:";
                 getline(cin, filepath);
                 cout << "Filename:";
                 getline(cin, filename);
 
-                ifstream inputFile(filepath + "/" + filename, std::ios::in);
+                inputFile.open(filepath + "/" + filename, std::ios::in | std::ios::binary);
                 if (inputFile.is_open())
                 {
                     cout << "File opened!" << endl;
                 }
                 else
                     cerr << "File could not be opened!" << endl;
-
-                std::ostringstream ss;
-                std::string line;
-                while (std::getline(inputFile, line)) {
-                    ss << line << std::endl;
-                }
-                file = ss.str();
-                inputFile.close();
             }
 
-                send_command(sock, receiver + "\n"); // send receiver
-                send_command(sock, subject + "\n"); // send subject
-                send_command(sock, filename + "\n");
-                send_command(sock, message); // send message body
-                send_command(sock, ".\n"); // indicate end of message
-                send_command(sock, file);
-                send_command(sock, "6943\n");
-
-                string response = read_line(sock); // read response
-                cout << response;
+                cout << do_send(conn, receiver, subject, filename, message, inputFile); // read response
             } else if (input == "LIST") {
-                send_command(sock, "LIST\n"); // send list command
+                string page;
+                cout << "Page (<offset> <limit> [newest] [long], empty for all): ";
+                getline(cin, page); // get paging arguments
 
-                string count_str = read_line(sock); // read number of messages
-                if (count_str.empty()) {
+                vector<string> subjects;
+                size_t total;
+                if (!do_list(conn, page, subjects, total)) {
                     cout << "Error: No response from server." << endl;
                     break;
                 }
-                cout << "Number of messages: " << count_str;
-                int num = stoi(count_str);
-                for (int i = 0; i < num; ++i) {
-                    string subject = read_line(sock); // read each subject
-                    cout << subject;
+                if (page.empty()) {
+                    cout << "Number of messages: " << subjects.size() << endl;
+                } else {
+                    cout << "Showing " << subjects.size() << " of " << total << " messages (<number> [<sender> <size>] <subject>):" << endl;
+                }
+                for (const auto& subject : subjects) {
+                    cout << subject << endl; // print each subject
+                }
+            } else if (input == "SEARCH") {
+                string query;
+                cout << "Search terms (from:, subject:, body: to qualify): ";
+                getline(cin, query); // get search words
+
+                vector<string> matches;
+                size_t total;
+                if (!do_search(conn, query, matches, total)) {
+                    cout << "Error: Nothing to search for." << endl;
+                    continue;
+                }
+                cout << "Showing " << matches.size() << " of " << total << " matches (<number> <sender> <size> <subject>):" << endl;
+                for (const auto& match : matches) {
+                    cout << match << endl; // print each match
                 }
             } else if (input == "READ") {
-                send_command(sock, "READ\n"); // send read command
                 string msg_num;
+                cout << "Message Number(s): ";
+                getline(cin, msg_num); // get message number, list or range
+
+                size_t length;
+                if (is_message_list(msg_num)) {
+                    if (!do_read_list(conn, msg_num, cout, cout, length)) {
+                        cout << "Error reading messages." << endl;
+                    }
+                } else if (!do_read(conn, "FETCH", msg_num, cout, length)) { // read with a length-prefixed response
+                    cout << "Error reading message." << endl;
+                }
+            } else if (input == "GETFILE") {
+                string msg_num, save_as;
                 cout << "Message Number: ";
                 getline(cin, msg_num); // get message number
-                send_command(sock, msg_num + "\n"); // send message number
-
-                string response = read_line(sock); // read response
-                if (response == "OK\n") {
-                    while (true) {
-                        response = read_line(sock); // read message content
-                        if (response == ".\n" || response.empty()) break; // end of message
-                        cout << response;
-                    }
+                cout << "Save as: ";
+                getline(cin, save_as); // get target file
+
+                // a byte range resumes an interrupted download, it is appended to what arrived before
+                bool resume = msg_num.find(':') != string::npos;
+                ofstream outputFile(save_as, std::ios::out | std::ios::binary | (resume ? std::ios::app : std::ios::trunc));
+                if (!outputFile.is_open()) {
+                    cerr << "File could not be opened!" << endl; // the bytes are still read and dropped
+                }
+                size_t length;
+                if (do_read(conn, "GETFILE", msg_num, outputFile, length)) {
+                    cout << "Saved " << length << " bytes." << endl;
                 } else {
-                    cout << "Error reading message." << endl;
+                    cout << "Error reading attachment." << endl;
                 }
             } else if (input == "DEL") {
-                send_command(sock, "DEL\n"); // send delete command
                 string msg_num;
-                cout << "Message Number: ";
-                getline(cin, msg_num); // get message number
-                send_command(sock, msg_num + "\n"); // send message number
-
-                string response = read_line(sock); // read response
-                cout << response;
+                cout << "Message Number(s): ";
+                getline(cin, msg_num); // get message number, list or range
+
+                cout << do_del(conn, msg_num); // read response, "OK <count>" for a list
+            } else if (input == "STATS") {
+                request_stats(conn);
+                size_t length;
+                if (!read_content(conn, cout, length)) { // same response as FETCH
+                    cout << "Error: STATS is only available to admins." << endl;
+                }
             } else if (input == "QUIT") {
-                send_command(sock, "QUIT\n"); // send quit command
+                do_quit(conn); // send quit command
                 break;
             } else {
                 cout << "Unknown command." << endl;
@@ -203,36 +348,505 @@ void interactive_mode(int sock) {
     }
 }
 
-void send_command(int sock, const string& command) {
-    const char* data = command.c_str(); // get c string
+// asks for the framed protocol, servers without v2 answer ERR and the line protocol stays in use
+bool negotiate_v2(Connection& conn) {
+    send_command(conn, PROTOCOL_V2_HELLO "\n");
+    string reply = read_line(conn.in);
+    if (reply == "ERR busy\n") {
+        cerr << "Server is busy, try again later." << endl; // turned away by the server's connection limits
+        exit(EXIT_FAILURE);
+    }
+    conn.v2 = reply == "OK v2\n";
+    return conn.v2;
+}
+
+bool do_login(Connection& conn, const string& username, const string& password) {
+    request_login(conn, username, password);
+    return read_status(conn) == "OK\n"; // read response
+}
+
+// returns the server's response line
+string do_send(Connection& conn, const string& receiver, const string& subject, const string& filename, const string& message, ifstream& file) {
+    request_send(conn, receiver, subject, filename, message, file);
+    return read_status(conn);
+}
+
+// returns false if the server didn't answer; page is empty or "<offset> <limit> [newest] [long]"
+bool do_list(Connection& conn, const string& page, vector<string>& subjects, size_t& total) {
+    request_list(conn, page);
+    return read_list(conn, subjects, total);
+}
+
+// returns false if the server didn't answer or refused the query; matches are answered like a long LIST page
+bool do_search(Connection& conn, const string& query, vector<string>& matches, size_t& total) {
+    request_search(conn, query);
+    return read_list(conn, matches, total);
+}
+
+// FETCH or GETFILE: copies the announced number of bytes to out
+bool do_read(Connection& conn, const string& command, const string& msg_num, ostream& out, size_t& length) {
+    request_read(conn, command, msg_num);
+    return read_content(conn, out, length);
+}
+
+// FETCH of a list or range: every message to out, each announced on labels
+bool do_read_list(Connection& conn, const string& msg_list, ostream& out, ostream& labels, size_t& count) {
+    request_read(conn, "FETCH", msg_list);
+    return read_message_list(conn, read_status(conn), out, labels, count);
+}
+
+string do_del(Connection& conn, const string& msg_num) {
+    request_del(conn, msg_num);
+    return read_status(conn); // read response
+}
+
+void do_quit(Connection& conn) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "QUIT");
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "QUIT\n"); // send quit command
+    }
+    flush_commands(conn);
+}
+
+void request_login(Connection& conn, const string& username, const string& password) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "LOGIN");
+        send_frame(conn, FRAME_ARG, username); // send username
+        send_frame(conn, FRAME_ARG, password); // send password
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "LOGIN\n"); // send login command
+        send_command(conn, username + "\n"); // send username
+        send_command(conn, password + "\n"); // send password
+    }
+}
+
+void request_send(Connection& conn, const string& receiver, const string& subject, const string& filename, const string& message, ifstream& file) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "SEND");
+        send_frame(conn, FRAME_ARG, receiver); // send receiver
+        send_frame(conn, FRAME_ARG, subject); // send subject
+        send_frame(conn, FRAME_ARG, filename);
+        send_frame(conn, FRAME_BODY, message); // send message body
+        send_attachment(conn, file); // streamed, never held in memory
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "SEND\n"); // send send command
+        send_command(conn, receiver + "\n"); // send receiver
+        send_command(conn, subject + "\n"); // send subject
+        send_command(conn, filename + "\n");
+        send_command(conn, message); // send message body
+        send_command(conn, ".\n"); // indicate end of message
+        send_attachment(conn, file); // streamed, never held in memory
+        send_command(conn, "6943\n");
+    }
+}
+
+// paging arguments are separate ARG frames in v2 and follow the command on its line otherwise
+void request_list(Connection& conn, const string& page) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "LIST");
+        istringstream args(page);
+        string arg;
+        while (args >> arg) {
+            send_frame(conn, FRAME_ARG, arg);
+        }
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, page.empty() ? "LIST\n" : "LIST " + page + "\n"); // send list command
+    }
+}
+
+// the words are separate ARG frames in v2 and follow the command on its line otherwise, like the paging arguments of LIST
+void request_search(Connection& conn, const string& query) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "SEARCH");
+        istringstream words(query);
+        string word;
+        while (words >> word) {
+            send_frame(conn, FRAME_ARG, word);
+        }
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "SEARCH " + query + "\n");
+    }
+}
+
+// FETCH or GETFILE, both answered with "OK <length>" and the content
+void request_read(Connection& conn, const string& command, const string& msg_num) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, command);
+        send_frame(conn, FRAME_ARG, msg_num); // send message number
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, command + "\n"); // send read command
+        send_command(conn, msg_num + "\n"); // send message number
+    }
+}
+
+// STATS, answered with "OK <length>" and the server metrics
+void request_stats(Connection& conn) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "STATS");
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "STATS\n");
+    }
+}
+
+void request_del(Connection& conn, const string& msg_num) {
+    if (conn.v2) {
+        send_frame(conn, FRAME_COMMAND, "DEL");
+        send_frame(conn, FRAME_ARG, msg_num); // send message number
+        send_frame(conn, FRAME_END, "");
+    } else {
+        send_command(conn, "DEL\n"); // send delete command
+        send_command(conn, msg_num + "\n"); // send message number
+    }
+}
+
+// returns false if the server didn't answer or refused
+bool read_list(Connection& conn, vector<string>& subjects, size_t& total) {
+    size_t count;
+    return parse_list_count(conn, read_status(conn), count, total) && read_items(conn, count, subjects);
+}
+
+// first response line of LIST: "<count>", "OK <count>" in v2; a page adds the total number of messages
+bool parse_list_count(const Connection& conn, const string& status, size_t& count, size_t& total) {
+    string count_str = status;
+    if (conn.v2) {
+        if (count_str.compare(0, 3, "OK ") != 0) return false;
+        count_str = count_str.substr(3);
+    }
+    if (count_str.empty() || !isdigit((unsigned char)count_str[0])) return false; // closed, or ERR
+    size_t end;
+    count = stoul(count_str, &end);
+    total = end < count_str.length() && count_str[end] == ' ' ? stoul(count_str.substr(end + 1)) : count;
+    return true;
+}
+
+bool read_items(Connection& conn, size_t count, vector<string>& subjects) {
+    for (size_t i = 0; i < count; ++i) {
+        string subject;
+        if (conn.v2) {
+            uint8_t type;
+            uint32_t length;
+            if (!conn.in.read_frame_header(type, length) || type != FRAME_ITEM || !conn.in.read_bytes(length, subject)) return false;
+        } else {
+            subject = read_line(conn.in); // read each subject
+            if (subject.empty()) return false;
+            subject.pop_back(); // newline
+        }
+        subjects.push_back(subject);
+    }
+    return true;
+}
+
+// response of FETCH or GETFILE: copies the announced number of bytes to out
+bool read_content(Connection& conn, ostream& out, size_t& length) {
+    string response = read_status(conn); // read response, "OK <length>"
+    if (response.compare(0, 3, "OK ") != 0) return false;
+    length = stoull(response.substr(3));
+    return receive_file(conn, length, out);
+}
+
+// response of FETCH for a list after its status "OK <count>": count times "OK <length> <id>" and the message
+bool read_message_list(Connection& conn, const string& status, ostream& out, ostream& labels, size_t& count) {
+    if (status.compare(0, 3, "OK ") != 0) return false;
+    count = stoul(status.substr(3));
+    for (size_t i = 0; i < count; i++) {
+        istringstream message_status(read_status(conn));
+        string ok;
+        size_t length;
+        unsigned long id;
+        if (!(message_status >> ok >> length >> id) || ok != "OK") return false;
+        labels << "Message " << id << " (" << length << " bytes):" << endl;
+        if (!receive_file(conn, length, out)) return false;
+    }
+    return true;
+}
+
+// runs a script on one connection: commands are sent while a second thread reads the responses,
+// so a long script costs bandwidth instead of one round trip per command; returns the number of failed commands
+size_t run_batch(Connection& conn, istream& script, size_t window) {
+    BatchQueue queue;
+    conn.buffered = true;
+    thread reader(read_batch_responses, ref(conn), ref(queue));
+
+    string line;
+    size_t line_number = 0;
+    size_t rejected = 0; // lines that couldn't be sent
+    while (getline(script, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') continue;
+        {
+            lock_guard<mutex> lock(queue.queue_mutex);
+            if (queue.broken) break;
+        }
+        if (!queue_batch_command(conn, queue, window, line_number, line)) {
+            rejected++;
+        }
+    }
+
+    do_quit(conn); // answered after every earlier command, the server closes once all responses are out
+    {
+        lock_guard<mutex> lock(queue.queue_mutex);
+        queue.done = true;
+    }
+    queue.changed.notify_all();
+    reader.join();
+
+    size_t failed = queue.failed + rejected;
+    cerr << line_number << " script line(s), " << failed << " command(s) failed" << endl;
+    return failed;
+}
+
+// sends one script line, waiting while window commands are unanswered; false if the line is invalid
+bool queue_batch_command(Connection& conn, BatchQueue& queue, size_t window, size_t line_number, const string& line) {
+    // fields separated by single spaces, the subject of SEND is the rest of the line
+    vector<string> fields;
+    size_t start = 0;
+    while (start <= line.length()) {
+        size_t end = line.find(' ', start);
+        bool last = end == string::npos || (fields.size() == 4 && fields[0] == "SEND");
+        if (last) end = line.length();
+        fields.push_back(line.substr(start, end - start));
+        start = end + 1;
+    }
+
+    BatchCommand command;
+    command.line_number = line_number;
+    command.command = fields[0];
+    const string& name = command.command;
+    bool valid = (name == "LOGIN" && fields.size() == 3) || (name == "SEND" && fields.size() == 5)
+        || (name == "LIST" && (fields.size() == 1 || (fields.size() >= 3 && fields.size() <= 5))) || (name == "SEARCH" && fields.size() >= 2)
+        || (name == "READ" && (fields.size() == 2 || fields.size() == 3)) || (name == "GETFILE" && fields.size() == 3)
+        || (name == "DEL" && fields.size() == 2);
+    if (!valid) {
+        cerr << line_number << ": invalid command: " << line << endl;
+        return false;
+    }
+
+    string message, filename;
+    ifstream attachment;
+    if (name == "SEND") {
+        if (fields[2] != "-") {
+            ifstream body(fields[2], ios::in | ios::binary);
+            if (!body.is_open()) {
+                cerr << line_number << ": failed to open " << fields[2] << endl;
+                return false;
+            }
+            stringstream content;
+            content << body.rdbuf();
+            message = content.str();
+            if (!message.empty() && message.back() != '\n') message += '\n';
+        }
+        if (fields[3] != "-") {
+            attachment.open(fields[3], ios::in | ios::binary);
+            if (!attachment.is_open()) {
+                cerr << line_number << ": failed to open " << fields[3] << endl;
+                return false;
+            }
+            filename = fields[3].substr(fields[3].rfind('/') + 1); // stored under its base name
+        }
+    } else if (name == "READ" || name == "GETFILE" || name == "DEL") {
+        command.argument = fields[1];
+        if (fields.size() == 3) command.output_path = fields[2];
+    } else if (name == "LIST" && fields.size() > 1) {
+        command.argument = line.substr(5); // paging arguments
+    } else if (name == "SEARCH") {
+        command.argument = line.substr(7); // query
+    }
+
+    // the requests waiting in pending have to go out before their responses can be waited for
+    unique_lock<mutex> lock(queue.queue_mutex);
+    if (queue.in_flight.size() >= window) {
+        lock.unlock();
+        flush_commands(conn);
+        lock.lock();
+        queue.changed.wait(lock, [&] { return queue.in_flight.size() < window || queue.broken; });
+    }
+    queue.in_flight.push_back(command);
+    lock.unlock();
+    queue.changed.notify_all();
+
+    if (name == "LOGIN") {
+        request_login(conn, fields[1], fields[2]);
+    } else if (name == "SEND") {
+        request_send(conn, fields[1], fields[4], filename, message, attachment);
+    } else if (name == "LIST") {
+        request_list(conn, command.argument);
+    } else if (name == "SEARCH") {
+        request_search(conn, command.argument);
+    } else if (name == "READ") {
+        request_read(conn, "FETCH", command.argument); // length-prefixed, the content can be copied as is
+    } else if (name == "GETFILE") {
+        request_read(conn, "GETFILE", command.argument);
+    } else {
+        request_del(conn, command.argument);
+    }
+    return true;
+}
+
+// reads the responses of the queued commands in order and reports one line per command on stdout
+void read_batch_responses(Connection& conn, BatchQueue& queue) {
+    while (true) {
+        BatchCommand command;
+        {
+            unique_lock<mutex> lock(queue.queue_mutex);
+            queue.changed.wait(lock, [&] { return !queue.in_flight.empty() || queue.done; });
+            if (queue.in_flight.empty()) return; // done and everything answered
+            command = queue.in_flight.front();
+        }
+
+        bool ok = false;
+        bool answered = true; // false if the connection is gone
+        string status;
+        cout << command.line_number << ": " << command.command << (command.argument.empty() ? "" : " " + command.argument) << " ";
+        status = read_status(conn);
+        answered = !status.empty();
+        if (command.command == "LIST" || command.command == "SEARCH") {
+            size_t count, total;
+            vector<string> subjects;
+            ok = parse_list_count(conn, status, count, total);
+            if (ok) {
+                ok = answered = read_items(conn, count, subjects);
+            }
+            string counts = to_string(subjects.size()) + (command.argument.empty() ? "" : " " + to_string(total));
+            cout << (ok ? "OK " + counts : "ERR") << "\n";
+            for (const auto& subject : subjects) cout << subject << "\n";
+        } else {
+            ok = status.compare(0, 2, "OK") == 0;
+            cout << (answered ? status : "ERR\n");
+        }
+
+        // READ and GETFILE: the announced content follows the status, a byte range is appended to the output file
+        if (ok && (command.command == "READ" || command.command == "GETFILE")) {
+            ofstream file;
+            if (!command.output_path.empty()) {
+                bool resume = command.argument.find(':') != string::npos;
+                file.open(command.output_path, ios::out | ios::binary | (resume ? ios::app : ios::trunc));
+                if (!file.is_open()) cerr << command.line_number << ": failed to open " << command.output_path << endl; // bytes are still read and dropped
+            }
+            ostream& out = command.output_path.empty() ? cout : file;
+            if (command.command == "READ" && is_message_list(command.argument)) {
+                size_t count;
+                answered = read_message_list(conn, status, out, cout, count); // every message with its own status
+            } else {
+                size_t length = stoull(status.substr(3)); // "OK <length>"
+                answered = receive_file(conn, length, out);
+            }
+            ok = answered && (command.output_path.empty() || file.good());
+        }
+
+        lock_guard<mutex> lock(queue.queue_mutex);
+        queue.in_flight.pop_front();
+        if (!ok) queue.failed++;
+        if (!answered && !queue.broken) {
+            queue.broken = true; // every other command fails as well, the script stops
+            cerr << command.line_number << ": connection lost" << endl;
+        }
+        if (queue.broken) {
+            queue.failed += queue.in_flight.size();
+            queue.in_flight.clear();
+        }
+        queue.changed.notify_all();
+    }
+}
+
+// sends the attachment in chunks: FILE frames in v2, attachment lines with a terminated last line otherwise
+void send_attachment(Connection& conn, ifstream& file) {
+    if (!file.is_open()) return;
+    char buffer[FILE_CHUNK_SIZE];
+    char last = '\n';
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        if (conn.v2) {
+            send_frame(conn, FRAME_FILE, string(buffer, file.gcount())); // binary safe, sent as is
+        } else {
+            send_command(conn, string(buffer, file.gcount()));
+        }
+        last = buffer[file.gcount() - 1];
+    }
+    if (!conn.v2 && last != '\n') {
+        send_command(conn, "\n");
+    }
+}
+
+// copies exactly length bytes of a response into out, returns false if the connection closed first
+bool receive_file(Connection& conn, size_t length, ostream& out) {
+    while (length > 0) {
+        size_t part = length; // whole rest, or the current DATA frame in v2
+        if (conn.v2) {
+            uint8_t type;
+            uint32_t frame_length;
+            if (!conn.in.read_frame_header(type, frame_length) || type != FRAME_DATA || frame_length > length) return false;
+            part = frame_length;
+        }
+        length -= part;
+        while (part > 0) {
+            if (conn.in.size() == 0 && conn.in.fill() <= 0) return false;
+            size_t take = min(part, conn.in.size());
+            out.write(conn.in.data(), take);
+            conn.in.consume(take);
+            part -= take;
+        }
+    }
+    return true;
+}
+
+// sends right away, or collects up to FILE_CHUNK_SIZE bytes first if the connection is buffered
+void send_command(Connection& conn, const string& command) {
+    if (!conn.buffered) {
+        conn.pending = command;
+        flush_commands(conn);
+        return;
+    }
+    conn.pending += command;
+    if (conn.pending.length() >= FILE_CHUNK_SIZE) {
+        flush_commands(conn);
+    }
+}
+
+void flush_commands(Connection& conn) {
+    const char* data = conn.pending.c_str(); // get c string
     size_t total_sent = 0;
-    size_t data_len = command.length();
+    size_t data_len = conn.pending.length();
 
     while(total_sent < data_len) {
-        ssize_t sent = send(sock, data + total_sent, data_len - total_sent, 0); // send data
+        ssize_t sent = send(conn.sock, data + total_sent, data_len - total_sent, MSG_NOSIGNAL); // send data
         if (sent <= 0) {
             perror("send"); // error in sending
             break;
         }
         total_sent += sent; // update total sent
     }
+    conn.pending.clear();
 }
 
-string read_line(int sock) {
-    static string buffer;
-    while (true) {
-        size_t pos = buffer.find('\n'); // find newline
-        if (pos != string::npos) {
-            string line = buffer.substr(0, pos + 1); // get line
-            buffer.erase(0, pos + 1); // remove from buffer
-            return line; // return line
-        }
-        char temp[1];
-        int valread = recv(sock, temp, 1, 0); // read one character
-        if (valread <= 0) {
-            return ""; // connection closed or error
-        }
-        buffer += temp[0]; // append to buffer
+void send_frame(Connection& conn, uint8_t type, const string& payload) {
+    send_command(conn, make_frame(type, payload));
+}
+
+string read_line(InputBuffer& in) {
+    string_view line;
+    if (!in.read_line(line)) {
+        return ""; // connection closed or error
     }
+    return string(line) + "\n"; // return line with its newline
 }
 
+// a response status as a line with newline, from a STATUS frame in v2
+string read_status(Connection& conn) {
+    if (!conn.v2) {
+        return read_line(conn.in);
+    }
+    uint8_t type;
+    uint32_t length;
+    string status;
+    if (!conn.in.read_frame_header(type, length) || type != FRAME_STATUS || !conn.in.read_bytes(length, status)) {
+        return ""; // connection closed or protocol error
+    }
+    return status + "\n";
+}
@@ -0,0 +1,73 @@
+// placement of mailboxes in a cluster of servers, shared by twmailer-server and twmailer-rebalance
+#ifndef TWMAILER_CLUSTER_H
+#define TWMAILER_CLUSTER_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// every node owns the mailboxes whose hash falls on one of its points of a hash ring; a node that joins takes over
+// about 1/n of the mailboxes, spread over all other nodes, and none move between the nodes that stay
+#define CLUSTER_VNODES 128 // points of one node on the ring, more points spread the mailboxes more evenly
+
+// one server of the cluster as given by "<name>=<host>:<port>"
+struct ClusterNode {
+    std::string name; // places the node on the ring, the same on every node and in every configuration
+    std::string host; // ipv4 address clients and the other nodes connect to
+    int port = 0;
+};
+
+inline bool parse_cluster_node(const std::string& text, ClusterNode& node) {
+    size_t equals = text.find('=');
+    size_t colon = text.rfind(':');
+    if (equals == std::string::npos || equals == 0 || colon == std::string::npos || colon < equals + 2 || colon + 1 == text.length()) {
+        return false;
+    }
+    node.name = text.substr(0, equals);
+    node.host = text.substr(equals + 1, colon - equals - 1);
+    char* end;
+    long port = strtol(text.c_str() + colon + 1, &end, 10);
+    node.port = (int)port;
+    return *end == '\0' && port > 0 && port <= 65535;
+}
+
+// 64 bit FNV-1a followed by the splitmix64 finalizer, close keys like "node#1" and "node#2" land far apart
+inline uint64_t cluster_hash(const std::string& key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    return hash ^ (hash >> 31);
+}
+
+// the ring of all nodes: sorted points, each naming the index of its node
+struct HashRing {
+    std::vector<ClusterNode> nodes;
+    std::vector<std::pair<uint64_t, size_t>> points;
+
+    void build(const std::vector<ClusterNode>& cluster) {
+        nodes = cluster;
+        points.clear();
+        for (size_t i = 0; i < nodes.size(); i++) {
+            for (int v = 0; v < CLUSTER_VNODES; v++) {
+                points.emplace_back(cluster_hash(nodes[i].name + "#" + std::to_string(v)), i);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    // the node owning a mailbox: the first point at or after the mailbox's hash, wrapping around
+    const ClusterNode& owner(const std::string& mailbox) const {
+        auto point = std::lower_bound(points.begin(), points.end(), std::make_pair(cluster_hash(mailbox), (size_t)0));
+        return nodes[(point == points.end() ? points.front() : *point).second];
+    }
+};
+
+#endif
@@ -0,0 +1,171 @@
+// code shared by twmailer-server and twmailer-client
+#ifndef TWMAILER_COMMON_H
+#define TWMAILER_COMMON_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h> // for recv()
+#include <sys/types.h>
+
+#define INPUT_BUFFER_SIZE 16384 // initial receive buffer per socket, grows for longer lines
+
+// protocol v2, negotiated with "HELLO v2": every unit is a frame of a 1 byte type and a 4 byte big-endian length
+#define PROTOCOL_V2_HELLO "HELLO v2" // sent as a line, answered with "OK v2" by servers that speak v2
+#define FRAME_HEADER_SIZE 5 // type + length
+#define MAX_FIELD_FRAME 65536 // command, argument, status and item frames are buffered whole
+#define MAX_DATA_FRAME 0xFFFFFFFFu // larger bodies, attachments and messages are split into several frames
+
+enum FrameType : uint8_t {
+    // client to server, a request is COMMAND, ARG*, BODY*, FILE*, END
+    FRAME_COMMAND = 'C', // command name
+    FRAME_ARG = 'A', // one argument, e.g. username, receiver or message id
+    FRAME_BODY = 'B', // part of the message body
+    FRAME_FILE = 'F', // part of the attachment
+    FRAME_END = 'E', // end of the request, empty
+    // server to client, a response is STATUS followed by as many ITEM or DATA frames as the status announces
+    FRAME_STATUS = 'S', // "OK", "ERR" or "OK <count or length>"
+    FRAME_ITEM = 'I', // one LIST entry
+    FRAME_DATA = 'D' // part of a message or attachment
+};
+
+// message selectors of READ, FETCH, GETFILE and DEL: "<id>", a list of ids and ranges like "1-5,9" (READ, FETCH and DEL),
+// answered with "OK <count>" and one response per stored message, or "<id>:<first>-[<last>]", bytes of one message (FETCH and GETFILE)
+#define MAX_MESSAGE_LIST 100 // messages one list selector reaches at most, the lowest ids win
+
+inline bool is_message_list(std::string_view selector) {
+    return selector.find(':') == std::string_view::npos && selector.find_first_of(",-") != std::string_view::npos;
+}
+
+inline bool is_field_frame(uint8_t type) {
+    return type == FRAME_COMMAND || type == FRAME_ARG || type == FRAME_STATUS || type == FRAME_ITEM;
+}
+
+inline bool is_known_frame(uint8_t type) {
+    return is_field_frame(type) || type == FRAME_BODY || type == FRAME_FILE || type == FRAME_END || type == FRAME_DATA;
+}
+
+inline std::string frame_header(uint8_t type, uint32_t length) {
+    char header[FRAME_HEADER_SIZE] = {
+        (char)type, (char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length
+    };
+    return std::string(header, FRAME_HEADER_SIZE);
+}
+
+inline std::string make_frame(uint8_t type, const std::string& payload) {
+    return frame_header(type, payload.length()) + payload;
+}
+
+// decodes a frame header from the first FRAME_HEADER_SIZE bytes of data
+inline void parse_frame_header(const char* data, uint8_t& type, uint32_t& length) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    type = bytes[0];
+    length = (uint32_t)bytes[1] << 24 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 8 | bytes[4];
+}
+
+// receive buffer of one socket: reads in large chunks and hands out lines as views into the buffer
+class InputBuffer {
+public:
+    explicit InputBuffer(int sock) : sock(sock) {}
+
+    // next complete line without its '\n', the view stays valid until the next fill()
+    bool next_line(std::string_view& line) {
+        const char* start = buffer.data() + head;
+        const char* end = static_cast<const char*>(memchr(start + scanned, '\n', tail - head - scanned));
+        if (end == nullptr) {
+            scanned = tail - head; // don't scan these bytes again after the next fill()
+            return false;
+        }
+        line = std::string_view(start, end - start);
+        head += line.length() + 1;
+        scanned = 0;
+        return true;
+    }
+
+    // one recv() into the free space, returns bytes read, 0 on eof, -1 on error (errno is set)
+    ssize_t fill() {
+        make_room();
+        ssize_t n;
+        do {
+            n = recv(sock, buffer.data() + tail, buffer.size() - tail, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) tail += n;
+        return n;
+    }
+
+    // blocking read of the next line, returns false once the connection is closed
+    bool read_line(std::string_view& line) {
+        while (!next_line(line)) {
+            if (fill() <= 0) return false;
+        }
+        return true;
+    }
+
+    // blocking read of exactly n raw bytes appended to out, returns false if the connection closed first
+    bool read_bytes(size_t n, std::string& out) {
+        while (n > 0) {
+            if (size() == 0 && fill() <= 0) return false;
+            size_t take = n < size() ? n : size();
+            out.append(data(), take);
+            consume(take);
+            n -= take;
+        }
+        return true;
+    }
+
+    // blocking read of the next frame header
+    bool read_frame_header(uint8_t& type, uint32_t& length) {
+        while (size() < FRAME_HEADER_SIZE) {
+            if (fill() <= 0) return false;
+        }
+        parse_frame_header(data(), type, length);
+        consume(FRAME_HEADER_SIZE);
+        return true;
+    }
+
+    // unparsed bytes
+    const char* data() const { return buffer.data() + head; }
+    size_t size() const { return tail - head; }
+
+    // drops n unparsed bytes, e.g. after copying them out as raw payload
+    void consume(size_t n) {
+        head += n;
+        scanned = scanned > n ? scanned - n : 0;
+    }
+
+    // socket the buffer reads from
+    int socket() const { return sock; }
+
+private:
+    // ensures there is free space at the end, moving unparsed bytes to the front or growing the buffer
+    void make_room() {
+        if (head == tail) {
+            head = tail = scanned = 0;
+            if (buffer.size() > INPUT_BUFFER_SIZE) {
+                std::vector<char>().swap(buffer); // give memory of a huge line back
+            }
+        }
+        if (buffer.empty()) {
+            buffer.resize(INPUT_BUFFER_SIZE); // allocated on first use, idle sockets cost nothing
+        }
+        if (tail < buffer.size()) return;
+        if (head > 0) {
+            memmove(buffer.data(), buffer.data() + head, tail - head);
+            tail -= head;
+            head = 0;
+            return;
+        }
+        buffer.resize(buffer.size() * 2); // a single line fills the whole buffer
+    }
+
+    int sock; // socket to read from
+    std::vector<char> buffer; // received bytes
+    size_t head = 0; // start of the unparsed bytes
+    size_t tail = 0; // end of the received bytes
+    size_t scanned = 0; // unparsed bytes already known to contain no '\n'
+};
+
+#endif
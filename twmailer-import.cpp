@@ -0,0 +1,199 @@
+// converts mailboxes of the files store (<id>.txt, <id>.att, either may end in .gz) into segments of the segment store
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm> // for sort
+#include <dirent.h> // for directory operations
+#include <sys/stat.h> // for stat
+#include <getopt.h> // for command line options
+#include <zlib.h> // for the header lines of compressed messages
+#include "twmailer-segment.h" // for the segment format
+
+using namespace std;
+
+#define NEXT_ID_FILENAME ".nextid" // per-mailbox id counter of the files store
+#define INDEX_FILENAME ".index" // per-mailbox message index of the files store
+#define MESSAGE_HEADER_LINES 4 // From, To, Subject and Filename lines at the start of a message file
+#define COMPRESSED_SUFFIX ".gz" // name suffix of a message or attachment stored as a gzip stream
+
+// function declarations
+bool import_mailbox(const string& user_dir, bool remove_files);
+bool append_message(int fd, off_t& offset, const string& user_dir, unsigned long id);
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-import [options] <mail-spool-directoryname> [mailbox...]" << endl;
+    cerr << "Converts the given mailboxes, or all of them, to the segment store of twmailer-server --store segment." << endl;
+    cerr << "Run it while the server is stopped, mailboxes that already have a segment are skipped." << endl;
+    cerr << "  --remove                delete the message files, attachments, index and id counter once converted" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    bool remove_files = false; // delete the converted files
+
+    static struct option long_options[] = {
+        {"remove", no_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'r':
+                remove_files = true;
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 1) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    string mail_spool_dir = argv[optind];
+
+    // mailboxes named on the command line, or every directory of the spool
+    vector<string> mailboxes(argv + optind + 1, argv + argc);
+    if (mailboxes.empty()) {
+        DIR *dir;
+        struct dirent *ent;
+        if ((dir = opendir(mail_spool_dir.c_str())) == NULL) {
+            perror("Failed to open mail spool directory");
+            exit(EXIT_FAILURE);
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_type == DT_DIR && ent->d_name[0] != '.') mailboxes.push_back(ent->d_name); // not .tmp
+        }
+        closedir(dir);
+        sort(mailboxes.begin(), mailboxes.end());
+    }
+
+    int failed = 0;
+    for (const auto& mailbox : mailboxes) {
+        if (!import_mailbox(mail_spool_dir + "/" + mailbox, remove_files)) failed++;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// writes the segment under a temporary name and renames it into place once it is complete
+bool import_mailbox(const string& user_dir, bool remove_files) {
+    string path = user_dir + "/" SEGMENT_FILENAME;
+    string tmp_path = path + ".import";
+    if (access(path.c_str(), F_OK) == 0) {
+        cout << user_dir << ": already has a segment, skipped" << endl;
+        return true;
+    }
+
+    // message files <id>.txt or <id>.txt.gz in id order
+    vector<unsigned long> ids;
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(user_dir.c_str())) == NULL) {
+        perror(user_dir.c_str());
+        return false;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        char* end;
+        unsigned long id = strtoul(ent->d_name, &end, 10);
+        if (ent->d_type == DT_REG && end != ent->d_name && (strcmp(end, ".txt") == 0 || strcmp(end, ".txt" COMPRESSED_SUFFIX) == 0)) {
+            ids.push_back(id);
+        }
+    }
+    closedir(dir);
+    sort(ids.begin(), ids.end());
+
+    // ids of deleted messages are never handed out again, the counter may be ahead of the newest file
+    uint64_t next_id = ids.empty() ? 1 : ids.back() + 1;
+    ifstream counter(user_dir + "/" NEXT_ID_FILENAME);
+    uint64_t stored_id;
+    if (counter >> stored_id) next_id = max(next_id, stored_id);
+
+    string header = format_segment_header(next_id);
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool ok = fd >= 0 && pwrite_all(fd, header.data(), header.length(), 0);
+    off_t offset = SEGMENT_HEADER_SIZE;
+    for (size_t i = 0; ok && i < ids.size(); i++) {
+        ok = append_message(fd, offset, user_dir, ids[i]);
+    }
+    ok = ok && fdatasync(fd) == 0 && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok) {
+        perror(user_dir.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    if (remove_files) {
+        for (unsigned long id : ids) {
+            for (const char* suffix : {".txt", ".txt" COMPRESSED_SUFFIX, ".att", ".att" COMPRESSED_SUFFIX}) {
+                unlink((user_dir + "/" + to_string(id) + suffix).c_str()); // attachment, if there is one
+            }
+        }
+        unlink((user_dir + "/" INDEX_FILENAME).c_str());
+        unlink((user_dir + "/" NEXT_ID_FILENAME).c_str());
+    }
+    cout << user_dir << ": " << ids.size() << " message(s), " << offset << " bytes" << endl;
+    return true;
+}
+
+// opens <path> or, if there is none, <path>.gz, compressed says which one
+int open_stored(const string& path, bool& compressed) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    compressed = fd < 0 && errno == ENOENT;
+    if (compressed) fd = open((path + COMPRESSED_SUFFIX).c_str(), O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+// appends the record of one message file and its attachment at offset, which is advanced past it;
+// gzip streams are copied as they are into a compressed record
+bool append_message(int fd, off_t& offset, const string& user_dir, unsigned long id) {
+    bool message_compressed, attachment_compressed;
+    struct stat st, att_st{};
+    int msg_fd = open_stored(user_dir + "/" + to_string(id) + ".txt", message_compressed);
+    if (msg_fd < 0 || fstat(msg_fd, &st) != 0) {
+        if (msg_fd >= 0) close(msg_fd);
+        return false;
+    }
+    int att_fd = open_stored(user_dir + "/" + to_string(id) + ".att", attachment_compressed);
+    if (att_fd >= 0 && fstat(att_fd, &att_st) != 0) {
+        close(att_fd);
+        att_fd = -1;
+    }
+
+    // the header lines carry what LIST and GETFILE need, gzdopen() reads uncompressed files as they are
+    string sender, attachment, subject, line;
+    gzFile msg_file = gzdopen(dup(msg_fd), "rb");
+    char buffer[4096];
+    for (int i = 0; msg_file != NULL && i < MESSAGE_HEADER_LINES && gzgets(msg_file, buffer, sizeof(buffer)) != NULL;) {
+        line += buffer;
+        if (line.back() != '\n') continue; // longer than the buffer
+        line.pop_back();
+        if (line.find("From: ") == 0) sender = line.substr(6);
+        else if (line.find("Subject: ") == 0) subject = line.substr(9);
+        else if (line.find("Filename: ") == 0) attachment = line.substr(10);
+        line.clear();
+        i++;
+    }
+    if (msg_file != NULL) gzclose(msg_file);
+
+    uint8_t compression = (message_compressed ? RECORD_MESSAGE_GZIP : 0) | (att_fd >= 0 && attachment_compressed ? RECORD_ATTACHMENT_GZIP : 0);
+    RecordHeader record;
+    record.type = compression ? RECORD_COMPRESSED : RECORD_MESSAGE;
+    record.id = id;
+    record.timestamp = st.st_mtime;
+    string meta = encode_segment_meta(sender, attachment, subject);
+    if (compression) meta.push_back((char)compression);
+    record.meta_length = meta.length();
+    record.message_length = st.st_size; // stored as is, READ returns the same bytes as before
+    record.attachment_length = att_fd >= 0 ? att_st.st_size : 0;
+    string head = encode_record_header(record) + meta;
+
+    bool ok = pwrite_all(fd, head.data(), head.length(), offset)
+        && copy_range(msg_fd, 0, fd, offset + head.length(), record.message_length)
+        && (att_fd < 0 || copy_range(att_fd, 0, fd, offset + head.length() + record.message_length, record.attachment_length));
+    close(msg_fd);
+    if (att_fd >= 0) close(att_fd);
+    offset += record.record_length();
+    return ok;
+}
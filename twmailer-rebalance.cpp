@@ -0,0 +1,212 @@
+// moves mailboxes between the spools of a cluster's nodes after nodes were added or removed, so that every mailbox
+// lives on the node the hash ring of the new configuration assigns it to
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm> // for sort
+#include <dirent.h> // for directory operations
+#include <sys/stat.h> // for mkdir
+#include <getopt.h> // for command line options
+#include "twmailer-segment.h" // for pwrite_all()
+#include "twmailer-cluster.h" // for the hash ring
+
+using namespace std;
+
+#define JOURNAL_DIRNAME ".journal" // write-ahead journal of twmailer-server --journal, directly below the spool directory
+#define COPY_BUFFER_SIZE 65536 // buffer of copy_file() where a mailbox moves to another file system
+
+// function declarations
+bool checkpoint_spool(const string& spool_dir);
+bool move_mailbox(const string& from_spool, const string& to_spool, const string& name);
+bool copy_file(const string& from, const string& to);
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-rebalance [options] <node>=<mail-spool-directoryname>..." << endl;
+    cerr << "Moves every mailbox to the spool of the node owning it in the given cluster, e.g. after a node was added." << endl;
+    cerr << "Every node of the cluster needs its spool, a spool of a node no longer in the cluster is emptied." << endl;
+    cerr << "Run it while all servers are stopped; after a crash start each server once first, its journal is dropped here." << endl;
+    cerr << "  --cluster-node <name>=<ip>:<port>  a node of the new cluster, repeated for every node as for twmailer-server" << endl;
+    cerr << "  --dry-run                          only report which mailboxes would move" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    vector<ClusterNode> cluster_nodes; // the cluster after the change
+    bool dry_run = false; // report only
+
+    static struct option long_options[] = {
+        {"cluster-node", required_argument, nullptr, 'N'},
+        {"dry-run", no_argument, nullptr, 'd'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'N':
+                cluster_nodes.emplace_back();
+                if (!parse_cluster_node(optarg, cluster_nodes.back())) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                dry_run = true;
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // node name -> spool directory, one for every node of the cluster
+    map<string, string> spools;
+    for (int i = optind; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        if (equals == string::npos || equals == 0 || equals + 1 == arg.length() || !spools.emplace(arg.substr(0, equals), arg.substr(equals + 1)).second) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (const auto& node : cluster_nodes) {
+        if (spools.count(node.name) == 0) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cluster_nodes.empty()) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    HashRing ring;
+    ring.build(cluster_nodes);
+
+    // a journal would redo deliveries into mailboxes that moved away, the spools are synced and their journals dropped
+    if (!dry_run) {
+        for (const auto& spool : spools) {
+            if (!checkpoint_spool(spool.second)) {
+                perror(spool.second.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // every spool is listed before anything moves, a mailbox is looked at once
+    vector<pair<string, string>> mailboxes; // node, mailbox
+    for (const auto& spool : spools) {
+        DIR *dir;
+        struct dirent *ent;
+        if ((dir = opendir(spool.second.c_str())) == NULL) {
+            if (errno == ENOENT) continue; // a new node without a spool yet
+            perror(spool.second.c_str());
+            exit(EXIT_FAILURE);
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_type == DT_DIR && ent->d_name[0] != '.') mailboxes.emplace_back(spool.first, ent->d_name); // not .tmp, .blobs or .journal
+        }
+        closedir(dir);
+    }
+    sort(mailboxes.begin(), mailboxes.end());
+
+    size_t moved = 0;
+    int failed = 0;
+    for (const auto& mailbox : mailboxes) {
+        const ClusterNode& owner = ring.owner(mailbox.second);
+        if (owner.name == mailbox.first) continue;
+        const string& to_spool = spools[owner.name];
+        cout << mailbox.second << ": " << mailbox.first << " -> " << owner.name << endl;
+        if (dry_run) {
+            moved++;
+            continue;
+        }
+        mkdir(to_spool.c_str(), 0777);
+        if (move_mailbox(spools[mailbox.first], to_spool, mailbox.second)) {
+            moved++;
+        } else {
+            perror(mailbox.second.c_str());
+            failed++;
+        }
+    }
+    cout << moved << " of " << mailboxes.size() << " mailbox(es) " << (dry_run ? "to move" : "moved");
+    if (!mailboxes.empty()) cout << " (" << moved * 100 / mailboxes.size() << "%)";
+    cout << endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// what a journal checkpoint of the server does: everything the journal protects is synced, then its files are removed
+bool checkpoint_spool(const string& spool_dir) {
+    string journal_dir = spool_dir + "/" JOURNAL_DIRNAME;
+    DIR *dir = opendir(journal_dir.c_str());
+    if (dir == NULL) return errno == ENOENT; // no journal
+    int spool_fd = open(spool_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = spool_fd >= 0 && syncfs(spool_fd) == 0;
+    if (spool_fd >= 0) close(spool_fd);
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != NULL) {
+        size_t length = strlen(ent->d_name);
+        if (length > 4 && strcmp(ent->d_name + length - 4, ".wal") == 0) {
+            ok = unlink((journal_dir + "/" + ent->d_name).c_str()) == 0;
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+// renames the mailbox directory, or copies its files where the spools are on different file systems; a mailbox that
+// already exists on the owning node is left alone, its ids would collide
+bool move_mailbox(const string& from_spool, const string& to_spool, const string& name) {
+    string from_dir = from_spool + "/" + name;
+    string to_dir = to_spool + "/" + name;
+    if (access(to_dir.c_str(), F_OK) == 0) {
+        errno = EEXIST;
+        return false;
+    }
+    if (rename(from_dir.c_str(), to_dir.c_str()) == 0) return true;
+    if (errno != EXDEV) return false;
+
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(from_dir.c_str())) == NULL) return false;
+    vector<string> files;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_type == DT_REG) files.push_back(ent->d_name); // a mailbox holds only files
+    }
+    closedir(dir);
+
+    // the copy is complete and on disk before any source file is removed, until then it is hidden like .tmp
+    string tmp_dir = to_spool + "/.rebalance." + name;
+    bool ok = mkdir(tmp_dir.c_str(), 0777) == 0;
+    for (size_t i = 0; ok && i < files.size(); i++) {
+        ok = copy_file(from_dir + "/" + files[i], tmp_dir + "/" + files[i]);
+    }
+    ok = ok && rename(tmp_dir.c_str(), to_dir.c_str()) == 0;
+    if (!ok) {
+        int saved_errno = errno;
+        for (const auto& file : files) unlink((tmp_dir + "/" + file).c_str());
+        rmdir(tmp_dir.c_str());
+        errno = saved_errno;
+        return false;
+    }
+    for (const auto& file : files) unlink((from_dir + "/" + file).c_str());
+    return rmdir(from_dir.c_str()) == 0;
+}
+
+bool copy_file(const string& from, const string& to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    bool ok = in >= 0 && out >= 0;
+    char buffer[COPY_BUFFER_SIZE];
+    for (off_t offset = 0; ok;) {
+        ssize_t n = pread(in, buffer, sizeof(buffer), offset);
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        ok = pwrite_all(out, buffer, n, offset);
+        offset += n;
+    }
+    ok = ok && fsync(out) == 0;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    return ok;
+}
@@ -0,0 +1,187 @@
+// rebuilds the search index of mailboxes from their messages, in the files store as well as the segment store
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm> // for sort
+#include <dirent.h> // for directory operations
+#include <sys/stat.h> // for fstat
+#include <getopt.h> // for command line options
+#include <zlib.h> // for compressed messages
+#include "twmailer-segment.h" // for the segment format
+#include "twmailer-search.h" // for the search index format
+
+using namespace std;
+
+#define COMPRESSED_SUFFIX ".gz" // name suffix of a message stored as a gzip stream in the files store
+#define MESSAGE_READ_SIZE (2 * SEARCH_BODY_BYTES) // message bytes read, the header lines and the indexed part of the body
+
+// function declarations
+bool reindex_mailbox(const string& user_dir);
+bool read_segment(const string& path, map<unsigned long, string>& messages);
+bool read_message_files(const string& user_dir, map<unsigned long, string>& messages);
+bool inflate_message(const string& in, string& out);
+string message_terms(const string& message);
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-reindex <mail-spool-directoryname> [mailbox...]" << endl;
+    cerr << "Rebuilds the search index of the given mailboxes, or all of them, from their stored messages." << endl;
+    cerr << "Run it while the server is stopped, the server itself only adds messages missing from an index." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {nullptr, 0, nullptr, 0}
+    };
+    if (getopt_long(argc, argv, "", long_options, nullptr) != -1 || argc - optind < 1) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    string mail_spool_dir = argv[optind];
+
+    // mailboxes named on the command line, or every directory of the spool
+    vector<string> mailboxes(argv + optind + 1, argv + argc);
+    if (mailboxes.empty()) {
+        DIR *dir;
+        struct dirent *ent;
+        if ((dir = opendir(mail_spool_dir.c_str())) == NULL) {
+            perror("Failed to open mail spool directory");
+            exit(EXIT_FAILURE);
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_type == DT_DIR && ent->d_name[0] != '.') mailboxes.push_back(ent->d_name); // not .tmp, .blobs or .journal
+        }
+        closedir(dir);
+        sort(mailboxes.begin(), mailboxes.end());
+    }
+
+    int failed = 0;
+    for (const auto& mailbox : mailboxes) {
+        if (!reindex_mailbox(mail_spool_dir + "/" + mailbox)) failed++;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// writes the index under a temporary name and renames it into place once it is complete
+bool reindex_mailbox(const string& user_dir) {
+    map<unsigned long, string> messages; // id -> terms
+    string segment_path = user_dir + "/" SEGMENT_FILENAME;
+    bool ok = access(segment_path.c_str(), F_OK) == 0 ? read_segment(segment_path, messages) : read_message_files(user_dir, messages);
+    if (!ok) {
+        perror(user_dir.c_str());
+        return false;
+    }
+
+    string content = SEARCH_MAGIC;
+    size_t terms = 0;
+    for (const auto& message : messages) {
+        content += format_search_entry(message.first, message.second);
+        terms += count(message.second.begin(), message.second.end(), ' ');
+    }
+    string path = user_dir + "/" SEARCH_FILENAME;
+    string tmp_path = path + ".reindex";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    ok = fd >= 0 && pwrite_all(fd, content.data(), content.length(), 0) && fdatasync(fd) == 0 && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok) {
+        perror(user_dir.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    cout << user_dir << ": " << messages.size() << " message(s), " << terms << " term(s)" << endl;
+    return true;
+}
+
+// the messages of a segment in record order, a tombstone removes the message it names; stops at a torn tail
+bool read_segment(const string& path, map<unsigned long, string>& messages) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    char header[RECORD_HEADER_SIZE];
+    uint64_t next_id;
+    if (fstat(fd, &st) != 0 || pread(fd, header, SEGMENT_HEADER_SIZE, 0) != SEGMENT_HEADER_SIZE || !parse_segment_header(header, next_id)) {
+        close(fd);
+        errno = EINVAL; // not a segment
+        return false;
+    }
+
+    off_t offset = SEGMENT_HEADER_SIZE;
+    RecordHeader record;
+    while (offset + RECORD_HEADER_SIZE <= st.st_size && pread(fd, header, RECORD_HEADER_SIZE, offset) == RECORD_HEADER_SIZE
+           && parse_record_header(header, record) && offset + (off_t)record.record_length() <= st.st_size) {
+        if (record.type == RECORD_TOMBSTONE) {
+            messages.erase(record.id);
+            offset += record.record_length();
+            continue;
+        }
+
+        // the message follows the meta, whose last byte holds the flags of a compressed record
+        off_t message_offset = offset + RECORD_HEADER_SIZE + record.meta_length;
+        char flags = 0;
+        if (record.type == RECORD_COMPRESSED && pread(fd, &flags, 1, message_offset - 1) != 1) break;
+        bool gzip = flags & RECORD_MESSAGE_GZIP;
+        string message(gzip ? record.message_length : min<uint64_t>(record.message_length, MESSAGE_READ_SIZE), '\0');
+        if (pread(fd, &message[0], message.length(), message_offset) != (ssize_t)message.length()) break;
+        string inflated;
+        if (gzip && !inflate_message(message, inflated)) break;
+        messages[record.id] = message_terms(gzip ? inflated : message);
+        offset += record.record_length();
+    }
+    close(fd);
+    return true;
+}
+
+// the message files <id>.txt or <id>.txt.gz of the files store, gzopen() reads uncompressed files as they are
+bool read_message_files(const string& user_dir, map<unsigned long, string>& messages) {
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(user_dir.c_str())) == NULL) return false;
+    while ((ent = readdir(dir)) != NULL) {
+        char* end;
+        unsigned long id = strtoul(ent->d_name, &end, 10);
+        if (ent->d_type != DT_REG || end == ent->d_name || (strcmp(end, ".txt") != 0 && strcmp(end, ".txt" COMPRESSED_SUFFIX) != 0)) continue;
+
+        gzFile msg_file = gzopen((user_dir + "/" + ent->d_name).c_str(), "rb");
+        if (msg_file == NULL) continue;
+        string message(MESSAGE_READ_SIZE, '\0');
+        int n = gzread(msg_file, &message[0], message.length());
+        gzclose(msg_file);
+        if (n < 0) continue;
+        message.resize(n);
+        messages[id] = message_terms(message);
+    }
+    closedir(dir);
+    return true;
+}
+
+bool inflate_message(const string& in, string& out) {
+    z_stream stream{};
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) return false;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = in.length();
+    char chunk[65536];
+    int rc;
+    do {
+        stream.next_out = reinterpret_cast<Bytef*>(chunk);
+        stream.avail_out = sizeof(chunk);
+        rc = inflate(&stream, Z_NO_FLUSH);
+        out.append(chunk, sizeof(chunk) - stream.avail_out);
+    } while (rc == Z_OK);
+    inflateEnd(&stream);
+    return rc == Z_STREAM_END;
+}
+
+// terms of a message from its From and Subject header lines and its body, the same the server indexes
+string message_terms(const string& message) {
+    string sender, subject;
+    size_t body = message_body_offset(message);
+    for (size_t start = 0; start < body;) {
+        size_t end = min(message.find('\n', start), body);
+        string line = message.substr(start, end - start);
+        if (line.find("From: ") == 0) sender = line.substr(6);
+        else if (line.find("Subject: ") == 0) subject = line.substr(9);
+        start = end + 1;
+    }
+    return format_search_terms(sender, subject, message.substr(body));
+}
@@ -0,0 +1,110 @@
+// search index of a mailbox, shared by twmailer-server and twmailer-reindex
+#ifndef TWMAILER_SEARCH_H
+#define TWMAILER_SEARCH_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <algorithm> // for sort
+#include <cctype> // for isalnum() and tolower()
+
+// the index is one text file per mailbox: a magic line, then "+<id> <term>..." for every indexed message and "-<id>"
+// for every deleted one; a term is a field letter, a colon and a word, e.g. "s:meeting"
+#define SEARCH_FILENAME ".search" // lives in the mailbox directory
+#define SEARCH_MAGIC "TWSEARCH1\n" // first line, written only with a complete index
+#define SEARCH_MIN_TERM 2 // shorter words are not indexed
+#define SEARCH_MAX_TERM 32 // longer words are cut to this length
+#define SEARCH_BODY_BYTES 65536 // body bytes indexed per message
+#define MESSAGE_HEADER_LINES 4 // From, To, Subject and Filename lines at the start of a stored message
+
+// fields of a term, the query qualifiers from:, subject: and body: select one
+#define SEARCH_FIELD_SENDER 'f'
+#define SEARCH_FIELD_SUBJECT 's'
+#define SEARCH_FIELD_BODY 'b'
+
+// calls emit with every word of text: runs of letters, digits and non-ASCII bytes, lowercased
+template <typename Emit>
+inline void for_each_search_word(std::string_view text, Emit emit) {
+    char word[SEARCH_MAX_TERM];
+    size_t length = 0;
+    for (size_t i = 0; i <= text.length(); i++) {
+        unsigned char c = i < text.length() ? (unsigned char)text[i] : ' ';
+        if (isalnum(c) || c >= 0x80) {
+            if (length < SEARCH_MAX_TERM) word[length++] = (char)tolower(c);
+        } else {
+            if (length >= SEARCH_MIN_TERM) emit(std::string_view(word, length));
+            length = 0;
+        }
+    }
+}
+
+// words of text as terms of field
+inline void add_search_terms(std::set<std::string>& terms, char field, const std::string& text) {
+    for_each_search_word(text, [&terms, field](std::string_view word) {
+        terms.insert(std::string(1, field) + ":" + std::string(word));
+    });
+}
+
+// terms of one message in formatted, sorted and each once and preceded by a space; body is the text after the header
+// lines; the words are collected in buffers the thread keeps for the next message
+inline void format_search_terms(std::string_view sender, std::string_view subject, std::string_view body, std::string& formatted) {
+    thread_local std::string collected; // " <field>:<word>" for every word
+    thread_local std::vector<std::string_view> terms;
+    collected.clear();
+    for (auto field : {std::make_pair(SEARCH_FIELD_SENDER, sender), std::make_pair(SEARCH_FIELD_SUBJECT, subject),
+                       std::make_pair(SEARCH_FIELD_BODY, body.substr(0, SEARCH_BODY_BYTES))}) {
+        for_each_search_word(field.second, [field](std::string_view word) {
+            collected += ' ';
+            collected += field.first;
+            collected += ':';
+            collected += word;
+        });
+    }
+    terms.clear();
+    std::string_view rest = collected;
+    while (!rest.empty()) {
+        size_t end = rest.find(' ', 1);
+        if (end == std::string_view::npos) end = rest.length();
+        terms.push_back(rest.substr(0, end));
+        rest.remove_prefix(end);
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+    formatted.clear();
+    for (const auto& term : terms) {
+        formatted += term;
+    }
+}
+
+inline std::string format_search_terms(std::string_view sender, std::string_view subject, std::string_view body) {
+    std::string formatted;
+    format_search_terms(sender, subject, body, formatted);
+    return formatted;
+}
+
+// index line of one message, appended to out
+inline void format_search_entry(unsigned long id, std::string_view terms, std::string& out) {
+    out += '+';
+    out += std::to_string(id);
+    out += terms;
+    out += '\n';
+}
+
+inline std::string format_search_entry(unsigned long id, const std::string& terms) {
+    std::string entry;
+    format_search_entry(id, terms, entry);
+    return entry;
+}
+
+// start of the body in a stored message, after its header lines
+inline size_t message_body_offset(const std::string& message) {
+    size_t offset = 0;
+    for (int i = 0; i < MESSAGE_HEADER_LINES && offset < message.length(); i++) {
+        size_t newline = message.find('\n', offset);
+        offset = newline == std::string::npos ? message.length() : newline + 1;
+    }
+    return offset;
+}
+
+#endif
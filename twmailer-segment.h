@@ -0,0 +1,169 @@
+// on-disk format of the segment store, shared by twmailer-server and twmailer-import
+#ifndef TWMAILER_SEGMENT_H
+#define TWMAILER_SEGMENT_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h> // for pread() and pwrite()
+#include <fcntl.h>
+
+// a mailbox is one append-only file: a text header followed by records, each a fixed binary header and its payload;
+// DEL appends a tombstone, the space of deleted messages is reclaimed by rewriting the file
+#define SEGMENT_FILENAME "mailbox.seg" // lives in the mailbox directory
+#define SEGMENT_MAGIC "TWSEG1 " // first bytes of a segment, followed by the next message id
+#define SEGMENT_HEADER_SIZE 28 // magic + 20 digit id + newline
+#define RECORD_MAGIC "TWR" // first bytes of every record, anything else marks a torn tail
+#define RECORD_HEADER_SIZE 40 // magic, type, id, timestamp and the lengths of meta, message and attachment
+#define SEGMENT_COPY_SIZE 65536 // buffer of copy_range() where copy_file_range() is not supported
+
+enum RecordType : uint8_t {
+    RECORD_MESSAGE = 'M', // meta, message and attachment of one message
+    RECORD_COMPRESSED = 'C', // same, the last meta byte holds the RECORD_ flags below
+    RECORD_TOMBSTONE = 'T' // the message with this id was deleted, no payload
+};
+
+// flags in the last meta byte of a RECORD_COMPRESSED record
+#define RECORD_MESSAGE_GZIP 1
+#define RECORD_ATTACHMENT_GZIP 2
+#define RECORD_ATTACHMENT_LINKED 4 // the attachment is not in the record but the file <id>.att(.gz) next to the segment
+
+// fixed part of a record, stored big-endian
+struct RecordHeader {
+    uint8_t type = RECORD_MESSAGE;
+    uint64_t id = 0; // message number
+    int64_t timestamp = 0; // time the message was stored or deleted
+    uint32_t meta_length = 0; // sender, attachment name and subject, see encode_segment_meta()
+    uint64_t message_length = 0; // the message as READ returns it, headers included, or its gzip stream
+    uint64_t attachment_length = 0; // the attachment as GETFILE returns it, or its gzip stream
+
+    uint64_t record_length() const { return RECORD_HEADER_SIZE + meta_length + message_length + attachment_length; }
+};
+
+inline void put_be(char* out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+inline uint64_t get_be(const char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = value << 8 | (unsigned char)in[i];
+    }
+    return value;
+}
+
+inline void encode_record_header(const RecordHeader& record, char* header) {
+    memcpy(header, RECORD_MAGIC, 3);
+    header[3] = (char)record.type;
+    put_be(header + 4, record.id, 8);
+    put_be(header + 12, (uint64_t)record.timestamp, 8);
+    put_be(header + 20, record.meta_length, 4);
+    put_be(header + 24, record.message_length, 8);
+    put_be(header + 32, record.attachment_length, 8);
+}
+
+inline std::string encode_record_header(const RecordHeader& record) {
+    char header[RECORD_HEADER_SIZE];
+    encode_record_header(record, header);
+    return std::string(header, RECORD_HEADER_SIZE);
+}
+
+// decodes RECORD_HEADER_SIZE bytes, false if they are not a record header
+inline bool parse_record_header(const char* data, RecordHeader& record) {
+    if (memcmp(data, RECORD_MAGIC, 3) != 0) return false;
+    record.type = (uint8_t)data[3];
+    record.id = get_be(data + 4, 8);
+    record.timestamp = (int64_t)get_be(data + 12, 8);
+    record.meta_length = (uint32_t)get_be(data + 20, 4);
+    record.message_length = get_be(data + 24, 8);
+    record.attachment_length = get_be(data + 32, 8);
+    if (record.type == RECORD_TOMBSTONE) {
+        return record.meta_length == 0 && record.message_length == 0 && record.attachment_length == 0;
+    }
+    return record.type == RECORD_MESSAGE || (record.type == RECORD_COMPRESSED && record.meta_length > 0);
+}
+
+// meta of a message record: sender, attachment name and subject, each with a 4 byte length
+inline void encode_segment_meta(const std::string& sender, const std::string& attachment, const std::string& subject, std::string& meta) {
+    for (const std::string* field : {&sender, &attachment, &subject}) {
+        char length[4];
+        put_be(length, field->length(), 4);
+        meta.append(length, 4);
+        meta += *field;
+    }
+}
+
+inline std::string encode_segment_meta(const std::string& sender, const std::string& attachment, const std::string& subject) {
+    std::string meta;
+    encode_segment_meta(sender, attachment, subject, meta);
+    return meta;
+}
+
+inline bool parse_segment_meta(const char* data, size_t length, std::string& sender, std::string& attachment, std::string& subject) {
+    for (std::string* field : {&sender, &attachment, &subject}) {
+        if (length < 4) return false;
+        size_t field_length = get_be(data, 4);
+        if (length - 4 < field_length) return false;
+        field->assign(data + 4, field_length);
+        data += 4 + field_length;
+        length -= 4 + field_length;
+    }
+    return length == 0;
+}
+
+// the header is text like the mailbox index, the next id survives compaction even if the newest messages were deleted
+inline std::string format_segment_header(uint64_t next_id) {
+    char header[SEGMENT_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), SEGMENT_MAGIC "%020llu\n", (unsigned long long)next_id);
+    return std::string(header, SEGMENT_HEADER_SIZE);
+}
+
+inline bool parse_segment_header(const char* data, uint64_t& next_id) {
+    if (memcmp(data, SEGMENT_MAGIC, strlen(SEGMENT_MAGIC)) != 0 || data[SEGMENT_HEADER_SIZE - 1] != '\n') return false;
+    next_id = strtoull(data + strlen(SEGMENT_MAGIC), nullptr, 10);
+    return true;
+}
+
+inline bool pwrite_all(int fd, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// copies length bytes between two files inside the kernel, with a buffer where the filesystems don't support that
+inline bool copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t length) {
+    while (length > 0) {
+        loff_t in = in_offset, out = out_offset;
+        ssize_t copied = copy_file_range(in_fd, &in, out_fd, &out, length, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) break;
+        if (copied <= 0) return false; // error, or the source is shorter than announced
+        in_offset += copied;
+        out_offset += copied;
+        length -= copied;
+    }
+    char buffer[SEGMENT_COPY_SIZE];
+    while (length > 0) {
+        ssize_t n = pread(in_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), in_offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !pwrite_all(out_fd, buffer, n, out_offset)) return false;
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <algorithm> // for sort
 #include <unistd.h> // for close()
 #include <netinet/in.h> // for sockaddr_in
 #include <sys/socket.h> // for socket functions
@@ -13,64 +14,1134 @@
 #include <dirent.h> // for directory operations
 #include <arpa/inet.h> // for inet_ntoa
 #include <sys/stat.h> // for mkdir
+#include <sys/epoll.h> // for the reactor event loops
+#include <poll.h> // for the idle timeout of threaded mode
+#include <fcntl.h> // for non-blocking sockets
+#include <getopt.h> // for command line options
+#include <cerrno> // for errno
 #include <ctime> // for time()
 #include <mutex> // for mutexes
+#include <shared_mutex> // for mailbox reader/writer locks
+#include <atomic> // for lock statistics
+#include <chrono> // for lock wait times
+#include <csignal> // for the statistics signal
+#include <cstdarg> // for the log record formatting
+#include <memory> // for unique_ptr
+#include <sys/mman.h> // for mapping the mailbox index
+#include <sys/sendfile.h> // for zero-copy READ
+#include <sys/uio.h> // for gathered socket writes
+#include <sys/eventfd.h> // for waking event loops after a journal commit
+#include <sys/syscall.h> // for the io_uring system calls
+#include <linux/io_uring.h> // for batched spool file operations
+#include <deque> // for the output queue
+#include <charconv> // for parsing and formatting numbers without temporary strings
 #include <thread> // for threading
 #include <unordered_map> // for blacklist
+#include <unordered_set> // for the deleted messages of a search index
+#include <set> // for the admin users
 #include <ldap.h> // for ldap functions
+#include <crypt.h> // for the salted hashes of the credential cache
+#include <condition_variable> // for the ldap connection pool
+#include <zlib.h> // for compressed messages and attachments
+#include <openssl/evp.h> // for the content hashes of the blob store
+#include <openssl/crypto.h> // for comparing the cluster secret in constant time
+#include "twmailer-common.h" // for InputBuffer
+#include "twmailer-segment.h" // for the segment store format
+#include "twmailer-search.h" // for the search index format
+#include "twmailer-cluster.h" // for the placement of mailboxes on cluster nodes
 
 #define BUFFER_SIZE 1024 // define buffer size
+#define MAX_PENDING_OUTPUT (1024 * 1024) // stop parsing input while this much output is queued
+#define OUTPUT_CHUNK_SIZE 65536 // responses are appended to one queued buffer up to this size
+#define ARENA_STRING_MAX 65536 // capacity a string of the request arena keeps, a larger one is freed on its next use
+#define LOG_RING_SIZE 512 // log records per thread waiting for the log thread, more are dropped
+#define LOG_RECORD_SIZE 240 // formatted bytes of a log record, longer ones are cut
+#define LOG_DRAIN_MS 20 // interval in which the log thread writes what the threads logged
+#define MAX_OUTPUT_IOVECS 64 // queued buffers handed to one sendmsg()
+#define MAX_EPOLL_EVENTS 256 // events fetched per epoll_wait()
+#define INDEX_FILENAME ".index" // per-mailbox message index, lives in the mailbox directory
+#define INDEX_MAGIC "TWIDX1 " // first bytes of an index file, followed by the directory stamp
+#define INDEX_HEADER_SIZE 28 // magic + 20 digit stamp + newline
+#define UPLOAD_DIRNAME ".tmp" // attachments in transfer, directly below the spool directory
+#define BLOB_DIRNAME ".blobs" // content-addressed messages and attachments, directly below the spool directory
+#define MAX_RECIPIENTS 100 // comma separated receivers of one SEND
+#define UPLOAD_CHUNK_SIZE 65536 // attachment bytes buffered before they are written to disk
+#define UPLOAD_PARTIAL_LINE 4096 // unterminated attachment bytes streamed before the line is complete
+#define NEXT_ID_FILENAME ".nextid" // per-mailbox id counter, lives in the mailbox directory
+#define MAILBOX_LOCK_SHARDS 64 // shards of the mailbox lock table
+#define COMPRESSED_SUFFIX ".gz" // files store: name suffix of a message or attachment stored as a gzip stream
+#define COMPRESS_MIN_SIZE 512 // default size below which messages and attachments are stored verbatim
+#define COMPRESS_MIN_SAVING 10 // percent a gzip stream must save, otherwise the verbatim bytes are stored
+#define COMPRESS_CHUNK_SIZE 65536 // buffers of streaming compression and decompression
+#define SEGMENT_SCAN_PREFETCH 512 // meta bytes read together with a record header when a segment is loaded
+#define SEGMENT_COMPACT_INTERVAL 10 // seconds between two runs of the segment compactor
+#define SEGMENT_COMPACT_MIN_BYTES (1024 * 1024) // deleted bytes before a segment is worth rewriting
+#define SEARCH_COMPACT_MIN 1000 // deleted messages before a search index is worth rewriting
+#define MAX_SEARCH_WORDS 16 // words of one SEARCH query
+#define MAX_SEARCH_RESULTS 100 // matches one SEARCH returns, the newest win
+#define JOURNAL_DIRNAME ".journal" // write-ahead journal files <generation>.wal, directly below the spool directory
+#define JOURNAL_MAGIC "TWJ" // first bytes of every journal record, anything else marks a torn tail
+#define JOURNAL_HEADER_SIZE 20 // magic, type, lsn, payload length and crc32 of type, lsn and payload
+#define JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024) // journal bytes after which the spool is synced and a new file started
+#define COMMIT_BATCH 64 // default records that start a commit before the commit interval is over
+#define FILE_RING_ENTRIES 64 // submission queue entries of a thread's io_uring, larger batches are submitted in parts
+#define FILE_RING_BUFFER_SIZE (1024 * 1024) // registered read buffer of a thread's io_uring, allocated on first use
+#define SEARCH_READ_SIZE (2 * SEARCH_BODY_BYTES) // stored bytes of a message read for the search index
+#define CLUSTER_TIMEOUT 10 // seconds a node waits for another node before the command fails
+#define BLACKLIST_FILENAME "blacklist.txt" // append-only log of blocked ips, relative to the working directory
+#define MAX_LOGIN_FAILURES 3 // failed logins from one ip before it is blocked
+#define BLACKLIST_SECONDS 60 // how long an ip stays blocked, failures are forgotten after the same time
+#define LIMITER_SHARDS 64 // shards of the login limiter table
+#define TIMER_WHEEL_SLOTS 64 // one slot per second, later expiries go around the wheel again
+#define BLACKLIST_COMPACT_LINES 4096 // the log is rewritten with the live entries once it has this many lines
+#define LATENCY_SAMPLES 4096 // most recent login durations kept for the percentiles
+#define ACCEPT_RETRY_MS 100 // pause after an accept() error that retrying right away won't fix
+#define METRICS_INTERVAL 10 // default seconds between two writes of the metrics file
+#define MAX_READS_PER_EVENT 16 // recv() calls per readiness event, keeps one busy client from starving the loop
+#define IDLE_TIMEOUT 300 // default seconds a silent client keeps its worker in threaded mode
+#define IDLE_TIMEOUT_BUSY 10 // ... while other connections wait for a worker
+#define QUEUE_TIMEOUT 5 // default seconds a connection waits for a worker before it gets "ERR busy"
+#define IDLE_POLL_MS 1000 // interval in which a worker waiting for input and the acceptor look at the queue
 #define LDAP_DEPRECATED 1 // allow deprecated ldap functions
 
 using namespace std;
 
+// states of the per-connection command parser, a command can be split across any number of reads
+enum class SessionState {
+    COMMAND, // waiting for the next command
+    LOGIN_USERNAME, // LOGIN: waiting for username
+    LOGIN_PASSWORD, // LOGIN: waiting for password
+    SEND_RECEIVER, // SEND: waiting for receiver
+    SEND_SUBJECT, // SEND: waiting for subject
+    SEND_FILENAME, // SEND: waiting for attachment filename
+    SEND_MESSAGE, // SEND: reading body until "."
+    SEND_FILE, // SEND: reading attachment until "6943"
+    READ_NUMBER, // READ: waiting for message number
+    GETFILE_NUMBER, // GETFILE: waiting for message number
+    FETCH_NUMBER, // FETCH: waiting for message number
+    DEL_NUMBER, // DEL: waiting for message number
+    CLOSED // connection closes once pending output is flushed
+};
+
+// one piece of queued output: bytes, or a range of an open file that is sent with sendfile()
+struct OutputChunk {
+    string data; // bytes to send if fd < 0
+    int fd = -1; // file to send from, owned by the chunk
+    off_t offset = 0; // next file offset to send
+    size_t length = 0; // file bytes left to send
+};
+
+// everything known about one client connection
+struct Session {
+    int sock; // client socket
+    string client_ip; // client ip
+    string username; // username after login
+    bool authenticated = false; // authentication status
+    SessionState state = SessionState::COMMAND; // parser state
+    string password, receiver, subject, filename, message; // fields of the command in progress
+    int upload_fd = -1; // temporary file receiving the attachment
+    string upload_path; // path of that file
+    string upload_buffer; // attachment bytes not yet written, at most UPLOAD_CHUNK_SIZE
+    bool upload_midline = false; // part of the current attachment line was already streamed
+    bool upload_failed = false; // writing the attachment failed, SEND answers ERR
+    bool command_failed = false; // the command in progress answered ERR, see CommandTimer
+    bool v2 = false; // framed protocol negotiated with HELLO v2
+    bool proxied = false; // logged in with NODE by another node of the cluster, its commands are never forwarded again
+    string v2_command; // v2: command of the request in progress
+    vector<string> v2_args; // v2: its arguments, the first v2_argc slots; the slots keep their buffers for the next request
+    size_t v2_argc = 0;
+    vector<string_view> args; // arguments of the command being run, views of the command line or of v2_args
+    uint8_t frame_type = 0; // v2: type of the body/file frame being received
+    uint32_t frame_remaining = 0; // v2: payload bytes of that frame still to come, 0 = at a frame header
+    string close_reason; // logged when the connection is closed, "quit" or why the server closed it
+    InputBuffer input; // received bytes not yet parsed
+    deque<OutputChunk> output; // responses not yet written to the socket
+    size_t output_sent = 0; // bytes of the first data chunk already written
+    size_t output_pending = 0; // bytes queued but not yet written
+    uint32_t events = 0; // epoll events currently registered (reactor mode)
+    uint64_t commit_lsn = 0; // journal record the queued responses wait for, see --journal
+    bool commit_waiting = false; // reactor: in the loop's list of sessions waiting for a commit
+    bool login_pending = false; // reactor: LOGIN waiting for an auth thread, nothing else is parsed meanwhile
+    uint64_t request_allocations = 0; // thread_allocations when the command in progress started, see COUNT_ALLOCATIONS
+
+    Session(int sock, const string& client_ip) : sock(sock), client_ip(client_ip), input(sock) {}
+    ~Session();
+};
+
+// one message as recorded in the mailbox index
+struct IndexEntry {
+    unsigned long id = 0; // message number, file <id>.txt
+    size_t size = 0; // size of the message file
+    time_t timestamp = 0; // time the message was stored
+    string sender; // From: header
+    string attachment; // Filename: header
+    string subject; // Subject: header
+    off_t record_offset = 0; // segment store: start of the message's record
+    off_t message_offset = 0; // segment store: start of the message bytes
+    off_t attachment_offset = 0; // segment store: start of the attachment bytes, the record ends after them
+    size_t attachment_size = 0; // segment store: length of the attachment
+    uint8_t compression = 0; // segment store: RECORD_MESSAGE_GZIP and RECORD_ATTACHMENT_GZIP flags
+};
+
+// segment store: offset index of one mailbox file
+struct SegmentIndex {
+    vector<IndexEntry> entries; // live messages sorted by id
+    unsigned long next_id = 1; // next message id, higher than every id ever stored
+    uint64_t live_bytes = 0; // record bytes of live messages
+    uint64_t dead_bytes = 0; // record bytes of deleted messages and tombstones, reclaimed by compaction
+};
+
+// segment store: the open mailbox file, loaded on first use and then guarded by the mailbox lock
+struct SegmentMailbox {
+    mutex load_mutex; // readers share the mailbox lock, only one of them loads the file
+    atomic<bool> loaded{false}; // the file was read, the fields below are valid
+    bool damaged = false; // the file is not a segment, the mailbox refuses changes
+    int fd = -1; // open segment, -1 = no message was ever stored
+    off_t end = 0; // end of the last complete record, the next append goes here
+    SegmentIndex index;
+};
+
+// inverted index of a mailbox for SEARCH, loaded on the first SEARCH and then kept up to date by SEND and DEL
+struct SearchIndex {
+    mutex load_mutex; // readers share the mailbox lock, only one of them loads the index
+    atomic<bool> loaded{false}; // the file was read, the fields below are valid and only change under the exclusive lock
+    unordered_map<string, vector<unsigned long>> postings; // term -> ids of the messages containing it, ascending
+    unordered_set<unsigned long> deleted; // ids still in the postings whose message is gone
+    size_t messages = 0; // indexed messages, deleted ones included
+};
+
+// reader/writer lock of one mailbox with its contention counters
+struct MailboxLock {
+    shared_mutex lock; // shared for LIST/READ, exclusive for SEND/DEL
+    atomic<uint64_t> acquisitions{0}; // times the lock was taken
+    atomic<uint64_t> contended{0}; // times the lock was not immediately available
+    atomic<uint64_t> wait_ns{0}; // total time spent waiting for the lock
+    unsigned long next_id = 0; // next message id, 0 = not loaded yet, guarded by the exclusive lock
+    SegmentMailbox segment; // segment store: the mailbox file and its offset index
+    SearchIndex search; // terms of the stored messages
+};
+
+// one shard of the mailbox lock table, the shard mutex is only held for the lookup
+struct MailboxLockShard {
+    mutex table_mutex;
+    unordered_map<string, unique_ptr<MailboxLock>> locks; // mailbox name -> lock, never shrinks
+};
+
+// holds a mailbox lock for the lifetime of the guard, records how long acquiring it took
+class MailboxGuard {
+public:
+    MailboxGuard(const string& mailbox, bool exclusive);
+    ~MailboxGuard();
+    MailboxGuard(const MailboxGuard&) = delete;
+    MailboxGuard& operator=(const MailboxGuard&) = delete;
+    MailboxLock& mailbox() { return mailbox_lock; }
+
+private:
+    MailboxLock& mailbox_lock;
+    bool exclusive;
+};
+
+// verifies credentials, implementations are called from many threads at once
+class AuthBackend {
+public:
+    virtual ~AuthBackend() {}
+    virtual bool authenticate(const string& username, const string& password) = 0;
+};
+
+// binds as the user on one of a pool of connections that already negotiated TLS
+class LdapAuthBackend : public AuthBackend {
+public:
+    LdapAuthBackend(const string& uri, const string& base_dn, size_t pool_size);
+    ~LdapAuthBackend();
+    bool authenticate(const string& username, const string& password) override;
+    void warm_up(); // opens the whole pool ahead of the first logins
+
+private:
+    LDAP* connect();
+    LDAP* acquire();
+    void release(LDAP* ld, bool broken); // broken connections are closed instead of reused
+
+    string uri; // directory uri
+    string base_dn; // users are uid=<name>,<base_dn>
+    size_t pool_size; // connections kept open
+    mutex pool_mutex;
+    condition_variable pool_available;
+    vector<LDAP*> idle; // connected and ready for a bind
+    size_t open_connections = 0; // idle and in use
+};
+
+// in-process users for tests and benchmarks: a file of "<username> <password>" lines, or everyone if none is given
+class StubAuthBackend : public AuthBackend {
+public:
+    explicit StubAuthBackend(const string& users_file);
+    bool authenticate(const string& username, const string& password) override;
+
+private:
+    bool accept_all; // no users file
+    unordered_map<string, string> users; // username -> password
+};
+
+// recently successful logins, only salted hashes of the passwords are kept
+struct CachedCredential {
+    string hash; // crypt() result, contains its salt
+    time_t expires; // entry is ignored after this time
+};
+
+// reactor: a LOGIN checked by an auth thread, the directory bind must not stall the event loop
+struct LoginJob {
+    Session* session; // parked until the job comes back, see destroy_session()
+    string username, password;
+    int wake_fd; // eventfd of the session's loop
+    chrono::steady_clock::time_point start; // the LOGIN arrived, for its latency metric
+    bool valid = false; // result of the check
+};
+
+// reactor: LOGINs waiting for an auth thread and the finished ones of every loop
+struct LoginQueue {
+    mutex queue_mutex;
+    condition_variable job_added;
+    deque<LoginJob> jobs;
+    unordered_map<int, vector<LoginJob>> done; // wake fd of a loop -> its finished LOGINs
+};
+
+// ring of recent durations for percentiles
+struct LatencySamples {
+    mutex samples_mutex;
+    vector<double> samples; // milliseconds, at most LATENCY_SAMPLES
+    size_t next = 0; // slot overwritten next once the ring is full
+    uint64_t count = 0; // samples recorded in total
+};
+
+// failed logins of one client ip, kept across its connections
+struct LimiterEntry {
+    int failures = 0; // failed logins since the entry was created
+    time_t blocked_since = 0; // time the ip was blocked, 0 = not blocked
+    time_t expires = 0; // entry is dropped at this time
+};
+
+// one shard of the login limiter table
+struct LimiterShard {
+    mutex shard_mutex;
+    unordered_map<string, LimiterEntry> entries; // client ip -> failures
+};
+
+// per-ip login failure counts and blocks, expired by a timer wheel and persisted through an append-only log
+class LoginLimiter {
+public:
+    void load(); // replays the log, before start()
+    void start(); // starts the thread that expires entries and writes the log
+    bool is_blocked(const string& ip);
+    bool record_failure(const string& ip); // true if the ip is blocked from now on
+    void record_success(const string& ip);
+    void print_stats(ostream& out);
+
+private:
+    LimiterShard& shard(const string& ip);
+    void schedule(const string& ip, time_t when); // caller holds the shard lock of ip
+    void expire(time_t now);
+    void flush();
+    void run();
+
+    LimiterShard shards[LIMITER_SHARDS];
+    mutex wheel_mutex;
+    vector<string> wheel[TIMER_WHEEL_SLOTS]; // ips to look at in the second of their slot
+    time_t wheel_time = 0; // last second the wheel was advanced to
+    mutex log_mutex;
+    condition_variable log_ready;
+    string pending_log; // blocks not yet appended to the file
+    size_t log_lines = 0; // lines in the file, triggers compaction
+};
+
+// an accepted connection waiting for a worker
+struct QueuedClient {
+    int sock;
+    string ip;
+    chrono::steady_clock::time_point deadline; // turned away with "ERR busy" if no worker took it until then
+};
+
+// fixed set of threads serving accepted connections, waiting connections are held in a bounded queue
+class WorkerPool {
+public:
+    WorkerPool(size_t workers, size_t queue_limit);
+    bool submit(int client_sock, const string& client_ip); // false if the queue is full
+    void expire(); // turns away the connections that waited longer than --queue-timeout
+
+private:
+    void run();
+
+    mutex queue_mutex;
+    condition_variable queue_ready;
+    deque<QueuedClient> queue; // oldest first
+    size_t queue_limit; // connections allowed to wait for a worker
+    size_t idle_workers = 0; // workers waiting for a connection, they take one without queueing
+    vector<thread> workers;
+};
+
+// open connections counted for admission control
+struct ConnectionLimits {
+    mutex limits_mutex;
+    unordered_map<string, int> per_ip; // client ip -> open connections
+    int total = 0; // open connections of all clients
+    int max_total = 1024; // further connections are answered with "ERR busy"
+    int max_per_ip = 32; // same, per client ip
+    atomic<uint64_t> rejected{0}; // connections turned away since startup
+};
+
+// severity of a log record, records below --log-level are not even formatted
+enum class LogLevel {
+    DEBUG, // every command with its duration
+    INFO, // connections, startup
+    WARN, // damaged files that were repaired, lost log records
+    ERROR // failed system calls
+};
+const char* log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+// one formatted log record, "key=value" pairs after the timestamp and level the log thread adds
+struct LogRecord {
+    int64_t time_us; // wall clock, microseconds since the epoch
+    LogLevel level;
+    uint16_t length; // bytes of text
+    char text[LOG_RECORD_SIZE];
+};
+
+// records of one thread waiting for the log thread: only the owning thread advances head and only the log thread tail,
+// so neither ever waits for the other; a full ring drops the record and counts it
+struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    atomic<uint64_t> head{0}; // next record the owning thread writes
+    atomic<uint64_t> tail{0}; // next record the log thread reads
+    atomic<uint64_t> dropped{0}; // records lost to a full ring
+    uint64_t reported = 0; // drops the log thread already reported
+    unsigned thread = 0; // number in the log output
+};
+
+// what the metrics count and time
+enum MetricId {
+    METRIC_LOGIN,
+    METRIC_SEND,
+    METRIC_LIST,
+    METRIC_READ, // READ and FETCH
+    METRIC_GETFILE,
+    METRIC_DEL,
+    METRIC_STATS,
+    METRIC_SEARCH,
+    METRIC_LDAP_BIND, // one bind on a pooled directory connection
+    METRIC_COUNT
+};
+const char* metric_names[METRIC_COUNT] = {"LOGIN", "SEND", "LIST", "READ", "GETFILE", "DEL", "STATS", "SEARCH", "LDAP_BIND"};
+
+// upper bounds of the latency histogram buckets in microseconds, one more bucket counts everything above
+const uint64_t latency_bounds_us[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000};
+#define LATENCY_BUCKETS (sizeof(latency_bounds_us) / sizeof(latency_bounds_us[0]))
+
+// counters of one thread: only that thread writes them, so no atomic read-modify-write is needed on the hot path;
+// readers sum all threads on demand
+struct ThreadMetrics {
+    atomic<uint64_t> count[METRIC_COUNT] = {}; // commands handled
+    atomic<uint64_t> errors[METRIC_COUNT] = {}; // of those answered with ERR
+    atomic<uint64_t> latency_sum_us[METRIC_COUNT] = {}; // total time spent
+    atomic<uint64_t> latency_buckets[METRIC_COUNT][LATENCY_BUCKETS + 1] = {}; // non-cumulative histogram
+    atomic<uint64_t> bytes_in{0}; // bytes received from clients
+    atomic<uint64_t> bytes_out{0}; // bytes written to clients
+    atomic<uint64_t> output_writes{0}; // sendmsg() and sendfile() calls that wrote output
+    atomic<uint64_t> compress_in{0}; // bytes offered to compression
+    atomic<uint64_t> compress_out{0}; // bytes stored for them, compressed or verbatim
+    atomic<uint64_t> compress_us{0}; // time spent deflating
+    atomic<uint64_t> decompress_us{0}; // time spent inflating
+    atomic<uint64_t> blobs_stored{0}; // messages and attachments written to the blob store
+    atomic<uint64_t> blobs_reused{0}; // found there and linked again
+    atomic<uint64_t> file_batches{0}; // FileBatch runs
+    atomic<uint64_t> file_ops{0}; // operations they ran
+    atomic<uint64_t> proxied{0}; // commands forwarded to the node owning the mailbox
+    atomic<uint64_t> allocations[METRIC_COUNT] = {}; // heap allocations of the commands, COUNT_ALLOCATIONS builds only
+};
+
+// content of a SEND shared by its mailboxes: a private hard link to the blob, the mailboxes are linked to it in turn;
+// the link count of a blob is its reference count, a blob only the store links to is removed by sweep_blobs()
+struct BlobRef {
+    string path; // below UPLOAD_DIRNAME, removed when the SEND is done
+    string blob; // name below BLOB_DIRNAME
+    bool deflated = false; // a gzip stream, the names in the mailboxes get COMPRESSED_SUFFIX
+    size_t size = 0; // stored bytes
+
+    void clear() { path.clear(); blob.clear(); deflated = false; size = 0; } // keeps the buffers for the next SEND
+};
+
+// group-committed write-ahead journal: a SEND or DEL is applied to the spool, then its record is appended here
+// and the response waits until one fdatasync() made it durable together with the records of concurrent requests;
+// replay after a crash redoes what the spool lost, a checkpoint syncs the spool and starts a new file
+struct Journal {
+    mutex journal_mutex;
+    condition_variable pending_changed; // records were appended, wakes the committer
+    condition_variable committed; // durable_lsn advanced, wakes waiting workers
+    string pending; // encoded records not yet written
+    size_t pending_records = 0;
+    uint64_t appended_lsn = 0; // records appended so far, the lsn of a record is its number
+    atomic<uint64_t> durable_lsn{0}; // records written and synced, written under journal_mutex
+    bool blobs_dirty = false; // a record names a blob, the blob directory is synced with the commit
+    set<int> wake_fds; // reactor: eventfds of loops with sessions waiting for the next commit
+    int fd = -1; // current journal file, only the committer writes it
+    int blob_dir_fd = -1;
+    uint64_t generation = 0; // number of the current file
+    off_t size = 0; // bytes in the current file
+    atomic<uint64_t> commits{0}; // fdatasync() calls
+    atomic<uint64_t> records{0}; // records they made durable
+    atomic<uint64_t> sync_us{0}; // time spent writing and syncing
+};
+
+// a SEND as the journal records it, enough to deliver it again
+struct JournalMessage {
+    IndexEntry entry; // timestamp, sender, attachment name and subject
+    string header, body;
+    string blob; // attachment below BLOB_DIRNAME, empty if there is none
+    vector<pair<string, unsigned long>> deliveries; // mailbox and id of every receiver that got it
+};
+
+// one spool file operation of a FileBatch
+struct FileOp {
+    uint8_t opcode = 0; // IORING_OP_OPENAT, READ, WRITE, FSYNC, UNLINKAT or CLOSE
+    int fd = -1;
+    string path; // OPENAT and UNLINKAT
+    char* buffer = nullptr; // READ: target, WRITE: source
+    size_t length = 0;
+    off_t offset = 0; // -1 = the file position
+    int flags = 0; // open flags, or IORING_FSYNC_DATASYNC
+    mode_t mode = 0;
+    uint8_t link = 0; // IOSQE_IO_LINK or IOSQE_IO_HARDLINK: the next operation starts once this one is done
+    int result = 0; // return value of the system call, -errno on failure, -ECANCELED if a linked operation failed
+};
+
+// file operations run together: with --io-uring one submission on the calling thread's ring, which runs
+// independent operations concurrently; without it, or on kernels without io_uring, one blocking call each
+class FileBatch {
+public:
+    size_t open(const string& path, int flags, mode_t mode = 0);
+    size_t read(int fd, char* buffer, size_t length, off_t offset);
+    size_t write(int fd, const char* data, size_t length, off_t offset);
+    size_t fsync(int fd);
+    size_t datasync(int fd);
+    size_t unlink(const string& path);
+    size_t close(int fd);
+    void then(bool on_success); // the next operation waits for the last one, on_success: and is cancelled if it failed
+    void run(); // returns once every operation is done
+    int result(size_t op) const { return ops[op].result; }
+    static char* buffer(); // FILE_RING_BUFFER_SIZE bytes of the calling thread, reads into them skip the page pinning
+
+private:
+    size_t add(FileOp op);
+    void submit(size_t first, size_t last);
+    void run_blocking(size_t first, size_t last);
+    vector<FileOp> ops;
+};
+
+// io_uring of one thread: its mapped submission and completion queues, set up by the thread's first FileBatch
+struct FileRing {
+    int fd = -1; // -1 = not set up, FileBatch makes blocking calls
+    bool tried = false; // a failed setup is not repeated
+    void* rings = MAP_FAILED;
+    size_t rings_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr, sq_mask = 0;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    char* buffer = nullptr; // see FileBatch::buffer()
+    bool buffer_registered = false; // reads into the buffer are READ_FIXED
+
+    ~FileRing();
+};
+
+// times one command until its response is queued, records it as failed if it answered ERR
+class CommandTimer {
+public:
+    CommandTimer(Session& s, MetricId id, chrono::steady_clock::time_point start = chrono::steady_clock::now());
+    ~CommandTimer();
+
+private:
+    Session& session;
+    MetricId id;
+    chrono::steady_clock::time_point start;
+};
+
+// appends strings and numbers, the numbers in decimal; a char counts as a number, pass "x" for a single character
+template <typename... Parts>
+string& append_parts(string& out, const Parts&... parts) {
+    auto append = [&out](const auto& part) {
+        if constexpr (is_integral_v<decay_t<decltype(part)>>) {
+            char digits[24];
+            out.append(digits, to_chars(digits, digits + sizeof(digits), part).ptr - digits);
+        } else {
+            out += part;
+        }
+    };
+    (append(parts), ...);
+    return out;
+}
+
+template <typename... Parts>
+string& assign_parts(string& out, const Parts&... parts) {
+    out.clear();
+    return append_parts(out, parts...);
+}
+
+// strings a request needs only while one function runs, like paths and formatted lines: every thread keeps a stack
+// of them that hold on to their capacity, so a steady stream of requests builds them without the heap
+struct RequestArena {
+    deque<string> strings; // a deque: taking more never moves the strings already taken
+    size_t used = 0; // strings taken by the open scopes
+};
+
+// takes strings from the thread's arena and returns all of them when it ends, nothing taken may outlive it
+class ArenaScope {
+public:
+    ArenaScope();
+    ~ArenaScope();
+    string& take(); // an empty string
+
+    template <typename... Parts>
+    string& concat(const Parts&... parts) {
+        return append_parts(take(), parts...);
+    }
+
+private:
+    size_t mark; // strings taken before this scope
+};
+
 // global variables
 string mail_spool_dir; // directory for mail spool
-mutex blacklist_mutex; // mutex for blacklist
-unordered_map<string, time_t> blacklist; // ip blacklist
-mutex mail_mutex; // mutex for mail operations
+LoginLimiter login_limiter; // ip blacklist
+MailboxLockShard mailbox_locks[MAILBOX_LOCK_SHARDS]; // per-mailbox locks for mail operations
+unique_ptr<AuthBackend> auth_backend; // ldap or stub
+int auth_cache_ttl = 0; // seconds a successful login is cached, 0 = no cache
+mutex auth_cache_mutex; // mutex for the credential cache
+unordered_map<string, CachedCredential> auth_cache; // username -> cached credential
+LatencySamples login_latency; // durations of LOGIN, cache hits included
+ConnectionLimits connection_limits; // admission control for new connections
+int listen_backlog = SOMAXCONN; // pending connections the kernel queues per listener
+mutex spare_fd_mutex; // mutex for the reserved descriptor
+int spare_fd = -1; // reserved descriptor, freed to shed a connection when the process is out of descriptors
+mutex metrics_mutex; // mutex for the list of per-thread metrics
+vector<unique_ptr<ThreadMetrics>> all_metrics; // one entry per thread that recorded anything, never shrinks
+set<string> admin_users; // users allowed to run STATS
+bool segment_store = false; // one append-only segment per mailbox instead of one file per message
+int compress_level = 0; // gzip level of stored messages and attachments, 0 = stored verbatim
+size_t compress_min = COMPRESS_MIN_SIZE; // smaller messages and attachments are stored verbatim
+LogLevel log_level = LogLevel::INFO; // see --log-level
+mutex log_rings_mutex; // mutex for the list of log rings, only taken when a thread logs for the first time
+vector<unique_ptr<LogRing>> log_rings; // one per thread that logged anything, never shrinks
+atomic<bool> blob_sweep_due{true}; // a DEL may have dropped the last mailbox link of a blob, checked once at startup
+Journal journal; // see --journal
+bool journal_enabled = false; // SEND and DEL are answered once their journal record is durable
+int commit_interval_us = 0; // a commit waits this long for more records, 0 = only for the running fdatasync()
+size_t commit_batch = COMMIT_BATCH; // ... unless this many records are already waiting
+bool io_uring_enabled = false; // FileBatch submits to per-thread io_urings, see --io-uring
+thread_local uint64_t thread_allocations = 0; // operator new calls of this thread, counted in COUNT_ALLOCATIONS builds
+HashRing cluster_ring; // nodes of the cluster and the mailboxes they own, no nodes = not clustered
+string node_name; // this server's name on the ring
+string cluster_secret; // shared by all nodes, logs a node in for any user with NODE
+thread_local FileRing file_ring; // see FileBatch
+thread_local RequestArena request_arena; // see ArenaScope
+thread_local string output_spare; // buffer of an output chunk that went out, reused by the next one this thread queues
+thread_local vector<Session*> commit_waiters; // reactor: sessions of this loop whose output waits for a commit
+int idle_timeout = IDLE_TIMEOUT; // see --idle-timeout, 0 = never
+int queue_timeout = QUEUE_TIMEOUT; // see --queue-timeout
+atomic<size_t> queued_clients{0}; // threaded mode: connections waiting for a worker, idle sessions give way to them
+thread_local int loop_wake_fd = -1; // reactor: eventfd of this loop, written by the committer and the auth threads
+bool async_login = false; // reactor with ldap: LOGIN binds on auth threads, see LoginQueue
+LoginQueue login_queue;
+mutex compaction_mutex; // mutex for the compaction queue
+set<string> compaction_queue; // mailboxes whose segments have enough deleted bytes to be rewritten
+atomic<uint64_t> segment_compactions{0}; // segments rewritten since startup
+atomic<uint64_t> segment_reclaimed_bytes{0}; // bytes those rewrites freed
 
 // function declarations
-void handle_client(int client_sock, sockaddr_in client_addr);
-string read_line(int sock);
-void send_response(int sock, const string& response);
-void process_login(int sock, string& username, sockaddr_in client_addr, bool& authenticated);
-void process_send(int sock, const string& username);
-void process_list(int sock, const string& username);
-void process_read(int sock, const string& username);
-void process_del(int sock, const string& username);
+int create_listen_socket(int port, bool reuse_port);
+void run_threaded(int port, int workers, int queue_limit);
+void run_event_loop(int port);
+void handle_client(int client_sock, const string& client_ip);
+bool wait_for_input(Session& s);
+void set_nonblocking(int sock);
+int accept_client(int listen_sock, string& client_ip, int flags);
+bool admit_connection(const string& ip);
+void release_connection(const string& ip);
+void reject_busy(int client_sock, const string& client_ip);
+void open_session(Session& s);
+void handle_line(Session& s, string_view line);
+void handle_command(Session& s, string_view command);
+void close_session(Session& s, const string& reason);
+void send_response(Session& s, string_view response);
+void send_status(Session& s, string_view status);
+void send_item(Session& s, string_view item);
+void send_data_file(Session& s, int fd, off_t offset, size_t length);
+bool parse_frame(Session& s);
+void handle_request(Session& s);
+bool flush_output(Session& s);
+void send_file(Session& s, int fd, off_t offset, size_t length);
+void process_login(Session& s);
+void finish_login(Session& s, bool valid);
+void run_auth_thread();
+void resume_logins(int epfd);
+void process_send(Session& s);
+void start_upload(Session& s);
+void write_upload(Session& s, const char* data, size_t length);
+bool finish_upload(Session& s);
+void abort_upload(Session& s);
+bool parse_input(Session& s);
+void process_list(Session& s, const vector<string_view>& args);
+void process_read(Session& s, string_view msg_num, bool framed);
+void read_messages(Session& s, string_view msg_list, bool framed);
+void send_message(Session& s, int fd, off_t offset, size_t length, const string& inflated, bool framed, string_view tag);
+void process_del(Session& s, string_view msg_num);
+void process_getfile(Session& s, string_view msg_num);
+void process_search(Session& s, const vector<string_view>& args);
+bool is_cluster_secret(const string& secret);
+bool proxy_command(Session& s, string_view command, const vector<string_view>& args, bool framed);
+bool proxy_command(Session& s, string_view command, string_view arg, bool framed);
+string forward_send(Session& s, const ClusterNode& node, const string& to, const string& subject);
+int node_request(const ClusterNode& node, const string& username, const string& request, const string& attachment_path);
+bool send_to_node(int sock, const char* data, size_t length);
+bool read_node_status(InputBuffer& in, string& status);
+bool read_node_field(InputBuffer& in, uint8_t type, string& payload);
+bool relay_node_data(Session& s, InputBuffer& in, size_t length, bool dot_terminated);
+const vector<IndexEntry>& mailbox_entries(MailboxLock& mailbox, const string& name, vector<IndexEntry>& loaded);
+vector<unsigned long> select_messages(MailboxLock& mailbox, const string& name, const vector<pair<unsigned long, unsigned long>>& ranges);
+vector<unsigned long> remove_message_files(const string& user_dir, const vector<unsigned long>& ids);
+bool open_message(const string& mailbox, unsigned long id, bool attachment, int& fd, off_t& offset, size_t& length, string& inflated);
+bool locate_message(MailboxLock& mailbox, const string& name, unsigned long id, bool attachment, int& fd, off_t& offset, size_t& length, bool& deflated);
+void send_data(Session& s, string_view data);
+void split_receivers(const string& text, vector<string>& receivers);
+void temp_path(string& path);
+void content_hash(EVP_MD_CTX* context, string& hex);
+bool pin_blob(const string& base, BlobRef& ref);
+void publish_blob(BlobRef& ref, const string& base);
+bool store_message_blob(const string& header, const string& body, BlobRef& ref);
+bool store_attachment_blob(string& upload_path, BlobRef& ref);
+bool deliver_message(MailboxLock& mailbox, const string& name, IndexEntry& entry, const BlobRef& message, const BlobRef* attachment);
+void sweep_blobs();
+uint64_t journal_append(char type, const string& payload, bool names_blob = false);
+bool wait_for_commit(uint64_t lsn);
+bool hold_for_commit(Session& s);
+void resume_committed(int epfd);
+void run_committer();
+void checkpoint_journal();
+void open_journal();
+void encode_journal_message(const JournalMessage& message, string& out);
+bool parse_journal_message(const char* data, size_t length, JournalMessage& message);
+void redo_delivery(const JournalMessage& message, const string& mailbox, unsigned long id);
+void redo_delete(const string& mailbox, unsigned long id);
+void persist_next_id(const string& user_dir, unsigned long next_id);
+void put_journal_field(string& out, const string& field);
+void put_journal_number(string& out, uint64_t number);
+bool compress_message(const string& header, const string& body, string& out);
+bool compress_file(int in_fd, size_t length, int out_fd, off_t out_offset, size_t& out_length);
+bool inflate_range(int fd, off_t offset, size_t length, string& out);
+bool inflate_prefix(const char* data, size_t length, string& out);
+bool saved_enough(size_t raw, size_t stored);
+void count_compression(size_t raw, size_t stored);
 bool authenticate_user(const string& username, const string& password);
-bool is_blacklisted(const string& ip);
-void update_blacklist(const string& ip);
-void persist_blacklist();
-void load_blacklist();
+string hash_password(const string& password, const string& setting);
+MailboxLock& get_mailbox_lock(const string& mailbox);
+void print_lock_stats(ostream& out);
+void run_signal_thread();
+void record_latency(LatencySamples& latency, double ms);
+void print_latency(ostream& out, const string& name, LatencySamples& latency);
+ThreadMetrics& metrics();
+void log_event(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void log_errno(LogLevel level, const char* what);
+void drain_log();
+void run_log_writer();
+uint64_t log_dropped();
+void add_metric(atomic<uint64_t>& counter, uint64_t n);
+void record_metric(MetricId id, uint64_t us, bool failed);
+string format_metrics();
+void run_metrics_dump(const string& path, int interval);
+void process_stats(Session& s);
+bool load_index(const string& user_dir, vector<IndexEntry>& entries, bool check_stamp = true);
+bool rebuild_index(const string& user_dir, vector<IndexEntry>& entries);
+bool index_is_fresh(const string& user_dir);
+void append_index_entry(const string& user_dir, const IndexEntry& entry);
+void remove_index_entries(const string& user_dir, const vector<unsigned long>& ids);
+SearchIndex& load_search_index(MailboxLock& mailbox, const string& name);
+vector<pair<unsigned long, string>> message_search_terms(MailboxLock& mailbox, const string& name, const vector<const IndexEntry*>& entries);
+void add_search_entry(SearchIndex& index, unsigned long id, string_view terms);
+void index_message(MailboxLock& mailbox, const string& name, unsigned long id, const string& terms);
+void unindex_message(MailboxLock& mailbox, const string& name, unsigned long id);
+bool search_compaction_due(const SearchIndex& index);
+bool write_search_index(SearchIndex& index, const string& name);
+unsigned long allocate_message_id(MailboxLock& mailbox, const string& user_dir);
+bool parse_message_id(string_view text, unsigned long& id);
+bool parse_message_list(string_view text, vector<pair<unsigned long, unsigned long>>& ranges);
+bool parse_message_selector(string_view text, unsigned long& id, size_t& first, size_t& last);
+bool select_bytes(int fd, off_t& offset, size_t& length, string& inflated, size_t first, size_t last);
+bool parse_count(string_view text, size_t& count);
+SegmentMailbox& load_segment(MailboxLock& mailbox, const string& name);
+off_t scan_segment(int fd, off_t from, off_t size, SegmentIndex& index);
+uint64_t segment_record_length(const IndexEntry& entry);
+bool compaction_due(const SegmentIndex& index);
+bool create_segment(SegmentMailbox& segment, const string& name);
+vector<IndexEntry>::iterator find_segment_entry(SegmentIndex& index, unsigned long id);
+bool append_segment_message(MailboxLock& mailbox, const string& name, IndexEntry& entry, const string& header, const string& message,
+                            const string& compressed, const BlobRef* attachment);
+bool append_segment_tombstone(MailboxLock& mailbox, const string& name, unsigned long id);
+bool compact_segment(const string& name);
+void run_compactor();
+bool write_all(int fd, const char* data, size_t length);
+bool write_all(int fd, const string& data);
+bool open_file_ring(FileRing& ring);
+void close_file_ring(FileRing& ring);
+bool is_valid_mailbox(const string& name);
+
+// debug builds (make server-debug) count every heap allocation, twmailer_command_allocations_total shows how many
+// each command made from its first line or frame until it was answered
+#ifdef COUNT_ALLOCATIONS
+void* operator new(size_t size) {
+    thread_allocations++;
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+#endif
+
+void print_usage() {
+    cerr << "Usage: ./twmailer-server [options] <port> <mail-spool-directoryname>" << endl;
+    cerr << "  --reactor               serve connections from epoll event loops instead of one thread per client" << endl;
+    cerr << "  --loops <n>             number of event loops (implies --reactor, default: one per core)" << endl;
+    cerr << "  --workers <n>           threads serving clients without --reactor (default: 64)" << endl;
+    cerr << "  --queue <n>             connections waiting for a free worker (default: 64)" << endl;
+    cerr << "  --queue-timeout <s>     a connection waiting longer for a worker gets \"ERR busy\" (default: " << QUEUE_TIMEOUT << ")" << endl;
+    cerr << "  --idle-timeout <s>      without --reactor a client silent this long is disconnected, after " << IDLE_TIMEOUT_BUSY << "s already" << endl;
+    cerr << "                          while connections wait for a worker; also bounds a blocked send (default: " << IDLE_TIMEOUT << ", 0 = never)" << endl;
+    cerr << "  --backlog <n>           listen backlog (default: SOMAXCONN)" << endl;
+    cerr << "  --max-connections <n>   open connections before new ones get \"ERR busy\" (default: 1024)" << endl;
+    cerr << "  --max-per-ip <n>        same, per client ip (default: 32)" << endl;
+    cerr << "  --store <files|segment> one file per message, or one append-only segment per mailbox (default: files)," << endl;
+    cerr << "                          an existing spool is converted with twmailer-import" << endl;
+    cerr << "  --compress-level <n>    gzip level 1-9 of stored messages and attachments (default: 0, stored verbatim)" << endl;
+    cerr << "  --compress-min <bytes>  messages and attachments below this size are stored verbatim (default: " << COMPRESS_MIN_SIZE << ")" << endl;
+    cerr << "  --journal               answer SEND and DEL only once a write-ahead journal has them on disk" << endl;
+    cerr << "  --commit-interval <us>  time a journal commit waits for more records (default: 0, only for the running sync)" << endl;
+    cerr << "  --commit-batch <n>      records that start a commit before the interval is over (default: " << COMMIT_BATCH << ")" << endl;
+    cerr << "  --io-uring              batch spool file operations on io_uring, blocking calls where the kernel lacks it" << endl;
+    cerr << "  --cluster-node <name>=<ip>:<port>" << endl;
+    cerr << "                          a node of the cluster, repeated for every node including this one; mailboxes are" << endl;
+    cerr << "                          spread over the nodes by a hash ring, commands for others are forwarded (no --reactor)," << endl;
+    cerr << "                          the nodes connect to each other as clients, mind --max-per-ip" << endl;
+    cerr << "  --node-name <name>      this server's node in the cluster" << endl;
+    cerr << "  --cluster-secret <s>    shared by all nodes, lets them act for users logged in on another node" << endl;
+    cerr << "  --auth <ldap|stub>      authentication backend (default: ldap)" << endl;
+    cerr << "  --auth-users <file>     stub backend: \"<username> <password>\" lines, without it every login succeeds" << endl;
+    cerr << "  --ldap-uri <uri>        directory to bind against (default: ldap://ldap.technikum-wien.at)" << endl;
+    cerr << "  --ldap-base <dn>        users are uid=<name>,<dn> (default: ou=people,dc=technikum-wien,dc=at)" << endl;
+    cerr << "  --ldap-pool <n>         pooled directory connections (default: 4), with --reactor as many threads bind for the loops" << endl;
+    cerr << "  --auth-cache-ttl <s>    cache successful logins as salted hashes for s seconds (default: 0, off)" << endl;
+    cerr << "  --admin <username>      user allowed to run STATS, can be repeated" << endl;
+    cerr << "  --metrics-file <path>   write the metrics in Prometheus text format to this file periodically" << endl;
+    cerr << "  --metrics-interval <s>  seconds between two writes of the metrics file (default: " << METRICS_INTERVAL << ")" << endl;
+    cerr << "  --log-level <level>     debug (every command), info (connections), warn or error (default: info)" << endl;
+}
 
 int main(int argc, char *argv[]) {
+    bool reactor = false; // use epoll event loops
+    int loops = 0; // number of event loops, 0 = one per core
+    string store = "files"; // storage engine
+    string auth = "ldap"; // authentication backend
+    string auth_users; // users file of the stub backend
+    string ldap_uri = "ldap://ldap.technikum-wien.at"; // ldap server uri
+    string ldap_base = "ou=people,dc=technikum-wien,dc=at"; // parent of the user DNs
+    int ldap_pool = 4; // pooled ldap connections
+    int workers = 64; // worker threads in threaded mode
+    int queue_limit = 64; // connections waiting for a worker
+    string metrics_file; // periodic metrics dump, empty = none
+    int metrics_interval = METRICS_INTERVAL; // seconds between dumps
+    string log_level_option = "info"; // least severe level that is logged
+    vector<ClusterNode> cluster_nodes; // all nodes of the cluster, empty = a single server
+
+    static struct option long_options[] = {
+        {"reactor", no_argument, nullptr, 'r'},
+        {"loops", required_argument, nullptr, 'l'},
+        {"store", required_argument, nullptr, 'S'},
+        {"compress-level", required_argument, nullptr, 'z'},
+        {"compress-min", required_argument, nullptr, 'Z'},
+        {"journal", no_argument, nullptr, 'j'},
+        {"commit-interval", required_argument, nullptr, 'J'},
+        {"commit-batch", required_argument, nullptr, 'n'},
+        {"io-uring", no_argument, nullptr, 'O'},
+        {"cluster-node", required_argument, nullptr, 'N'},
+        {"node-name", required_argument, nullptr, 'W'},
+        {"cluster-secret", required_argument, nullptr, 'K'},
+        {"auth", required_argument, nullptr, 'a'},
+        {"auth-users", required_argument, nullptr, 'u'},
+        {"ldap-uri", required_argument, nullptr, 'U'},
+        {"ldap-base", required_argument, nullptr, 'B'},
+        {"ldap-pool", required_argument, nullptr, 'P'},
+        {"auth-cache-ttl", required_argument, nullptr, 'T'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"queue", required_argument, nullptr, 'q'},
+        {"queue-timeout", required_argument, nullptr, 'Q'},
+        {"idle-timeout", required_argument, nullptr, 'X'},
+        {"backlog", required_argument, nullptr, 'b'},
+        {"max-connections", required_argument, nullptr, 'm'},
+        {"max-per-ip", required_argument, nullptr, 'i'},
+        {"admin", required_argument, nullptr, 'A'},
+        {"metrics-file", required_argument, nullptr, 'M'},
+        {"metrics-interval", required_argument, nullptr, 'I'},
+        {"log-level", required_argument, nullptr, 'L'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'r':
+                reactor = true;
+                break;
+            case 'l':
+                reactor = true;
+                loops = atoi(optarg);
+                if (loops <= 0) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                store = optarg;
+                break;
+            case 'z':
+                compress_level = atoi(optarg);
+                break;
+            case 'Z':
+                compress_min = strtoul(optarg, nullptr, 10);
+                break;
+            case 'j':
+                journal_enabled = true;
+                break;
+            case 'J':
+                commit_interval_us = atoi(optarg);
+                break;
+            case 'n':
+                commit_batch = strtoul(optarg, nullptr, 10);
+                break;
+            case 'O':
+                io_uring_enabled = true;
+                break;
+            case 'N':
+                cluster_nodes.emplace_back();
+                if (!parse_cluster_node(optarg, cluster_nodes.back())) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                node_name = optarg;
+                break;
+            case 'K':
+                cluster_secret = optarg;
+                break;
+            case 'a':
+                auth = optarg;
+                break;
+            case 'u':
+                auth_users = optarg;
+                break;
+            case 'U':
+                ldap_uri = optarg;
+                break;
+            case 'B':
+                ldap_base = optarg;
+                break;
+            case 'P':
+                ldap_pool = atoi(optarg);
+                break;
+            case 'T':
+                auth_cache_ttl = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'q':
+                queue_limit = atoi(optarg);
+                break;
+            case 'Q':
+                queue_timeout = atoi(optarg);
+                break;
+            case 'X':
+                idle_timeout = atoi(optarg);
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'm':
+                connection_limits.max_total = atoi(optarg);
+                break;
+            case 'i':
+                connection_limits.max_per_ip = atoi(optarg);
+                break;
+            case 'A':
+                admin_users.insert(optarg);
+                break;
+            case 'M':
+                metrics_file = optarg;
+                break;
+            case 'I':
+                metrics_interval = atoi(optarg);
+                break;
+            case 'L':
+                log_level_option = optarg;
+                break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    const char* log_level_options[] = {"debug", "info", "warn", "error"}; // in LogLevel order
+    auto level = find(begin(log_level_options), end(log_level_options), log_level_option);
+    if (level == end(log_level_options) || (store != "files" && store != "segment") || compress_level < 0 || compress_level > 9 || (auth != "ldap" && auth != "stub") || ldap_pool <= 0 || auth_cache_ttl < 0 || workers <= 0 || queue_limit < 0
+        || queue_timeout <= 0 || idle_timeout < 0
+        || listen_backlog <= 0 || connection_limits.max_total <= 0 || connection_limits.max_per_ip <= 0 || metrics_interval <= 0
+        || commit_interval_us < 0 || commit_batch == 0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // every node knows all nodes by unique names and addresses, and its own name; forwarding blocks, so no event loops
+    set<string> node_names;
+    bool self_listed = false;
+    for (const auto& node : cluster_nodes) {
+        struct in_addr addr;
+        if (!node_names.insert(node.name).second || inet_pton(AF_INET, node.host.c_str(), &addr) != 1) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        self_listed = self_listed || node.name == node_name;
+    }
+    if (cluster_nodes.empty() ? !node_name.empty() || !cluster_secret.empty() : !self_listed || cluster_secret.empty() || reactor) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    cluster_ring.build(cluster_nodes);
+
     // check if correct number of arguments is provided
-    if (argc != 3) {
-        cerr << "Usage: ./twmailer-server <port> <mail-spool-directoryname>" << endl;
+    if (argc - optind != 2) {
+        print_usage();
         exit(EXIT_FAILURE);
     }
 
-    int port = atoi(argv[1]); // get port number
-    mail_spool_dir = argv[2]; // get mail spool directory name
+    int port = atoi(argv[optind]); // get port number
+    mail_spool_dir = argv[optind + 1]; // get mail spool directory name
+    segment_store = store == "segment";
+    log_level = (LogLevel)(level - begin(log_level_options));
+
+    // SIGUSR1 prints the mailbox lock statistics, blocked before any thread is started so only the signal thread receives it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    thread(run_signal_thread).detach();
+    thread(run_log_writer).detach(); // everything logged from here on is written by this thread
+
+    if (!cluster_ring.nodes.empty()) {
+        log_event(LogLevel::INFO, "event=cluster node=%s nodes=%zu", node_name.c_str(), cluster_ring.nodes.size());
+    }
+
+    // every thread sets up its own ring, this one only finds out whether the kernel can
+    if (io_uring_enabled) {
+        FileRing probe;
+        io_uring_enabled = open_file_ring(probe);
+        if (!io_uring_enabled) log_event(LogLevel::WARN, "event=io_uring_unavailable fallback=blocking");
+    }
 
     // load the blacklist from file
-    load_blacklist();
+    login_limiter.load();
+
+    if (auth == "stub") {
+        auth_backend.reset(new StubAuthBackend(auth_users));
+    } else {
+        LdapAuthBackend* ldap = new LdapAuthBackend(ldap_uri, ldap_base, ldap_pool);
+        auth_backend.reset(ldap);
+        thread(&LdapAuthBackend::warm_up, ldap).detach(); // connect and negotiate TLS before the first LOGIN
+
+        // the event loops hand their binds to threads that may wait for the directory, one per pooled connection
+        async_login = reactor;
+        for (int i = 0; async_login && i < ldap_pool; i++) {
+            thread(run_auth_thread).detach();
+        }
+    }
 
     // create mail spool directory if it doesn't exist
     mkdir(mail_spool_dir.c_str(), 0777);
 
-    int server_sock, client_sock; // socket descriptors
-    struct sockaddr_in server_addr{}, client_addr{}; // addresses
-    socklen_t client_len = sizeof(client_addr); // client address length
+    // directory for attachments in transfer, left over uploads of a previous run are dropped
+    string upload_dir = mail_spool_dir + "/" UPLOAD_DIRNAME;
+    mkdir(upload_dir.c_str(), 0777);
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(upload_dir.c_str())) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] != '.') unlink((upload_dir + "/" + ent->d_name).c_str());
+        }
+        closedir(dir);
+    }
+
+    mkdir((mail_spool_dir + "/" BLOB_DIRNAME).c_str(), 0777); // blobs without links are swept once the server runs
+    if (journal_enabled) {
+        open_journal(); // replays what an unclean shutdown left, before any client or the blob sweep
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // see accept_client()
+    login_limiter.start();
+    if (!metrics_file.empty()) {
+        thread(run_metrics_dump, metrics_file, metrics_interval).detach();
+    }
+    thread(run_compactor).detach();
+
+    if (!reactor) {
+        run_threaded(port, workers, queue_limit);
+        return 0;
+    }
+
+    if (loops == 0) {
+        loops = max(1u, thread::hardware_concurrency()); // one loop per core
+    }
+
+    // every loop binds its own SO_REUSEPORT listener, the kernel spreads new connections across them
+    vector<thread> event_loops;
+    for (int i = 1; i < loops; i++) {
+        event_loops.emplace_back(run_event_loop, port);
+    }
+    log_event(LogLevel::INFO, "event=listen port=%d loops=%d", port, loops);
+    run_event_loop(port);
+
+    for (auto& t : event_loops) {
+        t.join();
+    }
+    return 0;
+}
+
+int create_listen_socket(int port, bool reuse_port) {
+    int server_sock; // socket descriptor
+    struct sockaddr_in server_addr{}; // address
 
     // create socket
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("Socket failed");
         exit(EXIT_FAILURE);
     }
 
+    int enable = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)); // allow quick restarts
+    if (reuse_port && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+
     // bind socket to server address
     server_addr.sin_family = AF_INET; // ipv4
     server_addr.sin_addr.s_addr = INADDR_ANY; // any incoming interface
@@ -81,358 +1152,4410 @@ int main(int argc, char *argv[]) {
     }
 
     // listen for incoming connections
-    if (listen(server_sock, 10) < 0) {
+    if (listen(server_sock, listen_backlog) < 0) {
         perror("Listen");
         exit(EXIT_FAILURE);
     }
+    return server_sock;
+}
 
-    cout << "Server is listening on port " << port << endl;
+void run_threaded(int port, int workers, int queue_limit) {
+    int server_sock = create_listen_socket(port, false);
+    set_nonblocking(server_sock); // accept() never blocks the queue checks below
+    WorkerPool pool(workers, queue_limit);
+
+    log_event(LogLevel::INFO, "event=listen port=%d workers=%d", port, workers);
 
     while (true) {
+        // the acceptor looks at the queue at least every IDLE_POLL_MS, also while nobody connects
+        pool.expire();
+        pollfd listener{server_sock, POLLIN, 0};
+        if (poll(&listener, 1, IDLE_POLL_MS) == 0) continue;
+
         // accept incoming connections
-        if ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_len)) < 0) {
-            perror("Accept");
-            exit(EXIT_FAILURE);
+        string client_ip;
+        int client_sock = accept_client(server_sock, client_ip, 0);
+        if (client_sock < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK && errno != EMFILE && errno != ENFILE) {
+                log_errno(LogLevel::ERROR, "Accept");
+                this_thread::sleep_for(chrono::milliseconds(ACCEPT_RETRY_MS)); // e.g. ENOBUFS, give the kernel time
+            }
+            continue; // the server keeps running whatever accept() reports
+        }
+        log_event(LogLevel::INFO, "event=accept ip=%s", client_ip.c_str());
+
+        if (!admit_connection(client_ip)) {
+            reject_busy(client_sock, client_ip);
+            continue;
         }
-        cout << "Connection accepted" << endl;
+        // hand the client to a worker thread, or turn it away if too many are already waiting
+        if (!pool.submit(client_sock, client_ip)) {
+            release_connection(client_ip);
+            reject_busy(client_sock, client_ip);
+        }
+    }
+}
 
-        // handle client in a new thread
-        thread t(handle_client, client_sock, client_addr);
-        t.detach(); // detach the thread
+WorkerPool::WorkerPool(size_t worker_count, size_t queue_limit) : queue_limit(queue_limit) {
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back(&WorkerPool::run, this);
     }
+}
 
-    return 0;
+bool WorkerPool::submit(int client_sock, const string& client_ip) {
+    lock_guard<mutex> lock(queue_mutex);
+    if (queue.size() >= queue_limit + idle_workers) {
+        return false; // every worker is busy and the queue is full
+    }
+    queue.push_back(QueuedClient{client_sock, client_ip, chrono::steady_clock::now() + chrono::seconds(queue_timeout)});
+    queued_clients++;
+    queue_ready.notify_one();
+    return true;
 }
 
-void handle_client(int client_sock, sockaddr_in client_addr) {
-    string command; // store client command
-    string username; // store username after login
-    bool authenticated = false; // authentication status
-    int login_attempts = 0; // count login attempts
-    string client_ip = inet_ntoa(client_addr.sin_addr); // get client ip
+void WorkerPool::expire() {
+    vector<QueuedClient> expired;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        auto now = chrono::steady_clock::now();
+        while (!queue.empty() && queue.front().deadline <= now) {
+            expired.push_back(move(queue.front()));
+            queue.pop_front();
+            queued_clients--;
+        }
+    }
+    for (const auto& client : expired) {
+        release_connection(client.ip);
+        reject_busy(client.sock, client.ip);
+    }
+}
 
+void WorkerPool::run() {
     while (true) {
-        // check if client ip is blacklisted
-        if (is_blacklisted(client_ip)) {
-            send_response(client_sock, "ERR\n"); // send error response
-            close(client_sock); // close connection
-            cout << "Connection closed (blacklisted IP)" << endl;
-            return;
+        QueuedClient client;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            idle_workers++;
+            queue_ready.wait(lock, [this] { return !queue.empty(); });
+            idle_workers--;
+            client = move(queue.front());
+            queue.pop_front();
+            queued_clients--;
         }
+        handle_client(client.sock, client.ip);
+    }
+}
 
-        command = read_line(client_sock); // read command from client
+void handle_client(int client_sock, const string& client_ip) {
+    Session s(client_sock, client_ip);
 
-        if (command == "LOGIN") {
-            process_login(client_sock, username, client_addr, authenticated); // process login
-            if (!authenticated) {
-                login_attempts++; // increment login attempts
-                if (login_attempts >= 3) {
-                    update_blacklist(client_ip); // add to blacklist
-                    send_response(client_sock, "ERR\n"); // send error
-                    close(client_sock); // close connection
-                    cout << "Connection closed (too many login attempts)" << endl;
-                    return;
-                }
-            }
-        } else if (command == "SEND") {
-            if (authenticated) {
-                process_send(client_sock, username); // process send
-            } else {
-                send_response(client_sock, "ERR\n"); // send error
-            }
-        } else if (command == "LIST") {
-            if (authenticated) {
-                process_list(client_sock, username); // process list
-            } else {
-                send_response(client_sock, "ERR\n"); // send error
-            }
-        } else if (command == "READ") {
-            if (authenticated) {
-                process_read(client_sock, username); // process read
-            } else {
-                send_response(client_sock, "ERR\n"); // send error
-            }
-        } else if (command == "DEL") {
-            if (authenticated) {
-                process_del(client_sock, username); // process delete
-            } else {
-                send_response(client_sock, "ERR\n"); // send error
-            }
-        } else if (command == "QUIT") {
-            // no response for quit, close connection
+    // a client that stops reading its responses holds the worker for at most the idle timeout
+    struct timeval send_timeout = {idle_timeout, 0};
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    open_session(s);
+    bool parsed = true; // false while the parser stopped at the output limit with input left in the buffer
+    // returns once everything is sent; a SEND or DEL is only answered once it is durable
+    while (wait_for_commit(s.commit_lsn) && flush_output(s) && s.state != SessionState::CLOSED) {
+        if (s.output_pending > 0) {
+            close_session(s, "send timeout"); // the send timeout expired
             break;
-        } else {
-            send_response(client_sock, "ERR\n"); // unknown command
         }
+        if (!parsed) {
+            parsed = parse_input(s); // pipelined commands already buffered, no need to wait for the socket
+            continue;
+        }
+        if (!wait_for_input(s)) break;
+        ssize_t n = s.input.fill();
+        if (n <= 0) break; // connection closed or error
+        add_metric(metrics().bytes_in, n);
+        parsed = parse_input(s); // advance the parser by every complete line
     }
 
     close(client_sock); // close client socket
-    cout << "Connection closed" << endl;
-}
-
-string read_line(int sock) {
-    char c;
-    string line;
-    while (recv(sock, &c, 1, 0) > 0) { // read one character at a time
-        if (c == '\n') break; // end of line
-        line += c; // append character to line
-    }
-    return line; // return the line
+    release_connection(client_ip);
+    log_event(LogLevel::INFO, "event=close ip=%s user=%s reason=\"%s\"", client_ip.c_str(), s.username.c_str(), s.close_reason.c_str());
 }
 
-void send_response(int sock, const string& response) {
-    const char* data = response.c_str(); // get c string
-    size_t total_sent = 0;
-    size_t data_len = response.length();
-
-    while(total_sent < data_len) {
-        ssize_t sent = send(sock, data + total_sent, data_len - total_sent, 0); // send data
-        if (sent <= 0) {
-            perror("send"); // error in sending
-            break;
+// threaded mode: waits for the client's next bytes, false once it was silent for the idle timeout; while connections
+// wait for a worker a client silent for IDLE_TIMEOUT_BUSY gives its worker up to them
+bool wait_for_input(Session& s) {
+    pollfd client{s.sock, POLLIN, 0};
+    for (int idle_ms = 0;; idle_ms += IDLE_POLL_MS) {
+        int rc = poll(&client, 1, IDLE_POLL_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc != 0) return true; // input, hangup or error, fill() finds out which
+        int silent = (idle_ms + IDLE_POLL_MS) / 1000;
+        if ((idle_timeout > 0 && silent >= idle_timeout) || (queued_clients > 0 && silent >= IDLE_TIMEOUT_BUSY)) {
+            close_session(s, "idle timeout");
+            return false;
         }
-        total_sent += sent; // update total sent
     }
 }
 
-void process_login(int sock, string& username, sockaddr_in client_addr, bool& authenticated) {
-    username = read_line(sock); // read username
-    string password = read_line(sock); // read password
-    string client_ip = inet_ntoa(client_addr.sin_addr); // get client ip
+// accept() that survives running out of descriptors: the pending connection is answered and closed
+// on the reserved descriptor, otherwise it would stay in the backlog and be reported again and again
+int accept_client(int listen_sock, string& client_ip, int flags) {
+    struct sockaddr_in client_addr{}; // address
+    socklen_t client_len = sizeof(client_addr); // client address length
+    int client_sock = accept4(listen_sock, (struct sockaddr *)&client_addr, &client_len, flags | SOCK_CLOEXEC);
+    if (client_sock >= 0) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip)); // get client ip
+        client_ip = ip;
+        return client_sock;
+    }
+    if (errno != EMFILE && errno != ENFILE) {
+        return -1;
+    }
 
-    if (authenticate_user(username, password)) { // authenticate user
-        authenticated = true; // set authenticated to true
-        send_response(sock, "OK\n"); // send ok response
+    int saved_errno = errno;
+    log_event(LogLevel::WARN, "event=accept error=\"out of file descriptors, dropping a connection\"");
+    lock_guard<mutex> lock(spare_fd_mutex);
+    if (spare_fd >= 0) {
+        close(spare_fd);
+        int shed_sock = accept4(listen_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (shed_sock >= 0) {
+            connection_limits.rejected++;
+            send(shed_sock, "ERR busy\n", 9, MSG_NOSIGNAL); // best effort, the socket is non-blocking
+            close(shed_sock);
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     } else {
-        authenticated = false; // authentication failed
-        send_response(sock, "ERR\n"); // send error response
+        this_thread::sleep_for(chrono::milliseconds(ACCEPT_RETRY_MS)); // nothing to free, wait for connections to close
     }
+    errno = saved_errno;
+    return -1;
 }
 
-bool authenticate_user(const string& username, const string& password) {
-    LDAP *ld; // ldap connection
-    int rc; // return code
-
-    // LDAP server URI and user DN
-    string ldap_uri = "ldap://ldap.technikum-wien.at"; // ldap server uri
-    string ldap_bind_dn = "uid=" + username + ",ou=people,dc=technikum-wien,dc=at"; // user's DN
-
-    // Initialize LDAP connection
-    rc = ldap_initialize(&ld, ldap_uri.c_str());
-    if (rc != LDAP_SUCCESS) {
-        cerr << "LDAP initialization failed: " << ldap_err2string(rc) << endl;
+// counts a new connection against the global and per-ip limits, false if either is reached
+bool admit_connection(const string& ip) {
+    lock_guard<mutex> lock(connection_limits.limits_mutex);
+    int& open_from_ip = connection_limits.per_ip[ip];
+    if (connection_limits.total >= connection_limits.max_total || open_from_ip >= connection_limits.max_per_ip) {
+        if (open_from_ip == 0) connection_limits.per_ip.erase(ip);
         return false;
     }
+    open_from_ip++;
+    connection_limits.total++;
+    return true;
+}
 
-    // Set LDAP version
-    int version = LDAP_VERSION3; // ldap version 3
-    ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version); // set ldap version
-
-    // Start TLS
-    rc = ldap_start_tls_s(ld, NULL, NULL);
-    if (rc != LDAP_SUCCESS) {
-        ldap_unbind_ext_s(ld, NULL, NULL);
-        cerr << "ldap_start_tls_s() failed: " << ldap_err2string(rc) << endl;
-        return false;
+void release_connection(const string& ip) {
+    lock_guard<mutex> lock(connection_limits.limits_mutex);
+    auto it = connection_limits.per_ip.find(ip);
+    if (it != connection_limits.per_ip.end() && --it->second == 0) {
+        connection_limits.per_ip.erase(it);
     }
+    connection_limits.total--;
+}
 
-    // Prepare credentials
-    struct berval cred;
-    cred.bv_val = (char*)password.c_str();  // set password
-    cred.bv_len = password.length();
-
-    // Attempt to bind using the user's DN and password
-    rc = ldap_sasl_bind_s(ld, ldap_bind_dn.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
-
-    // Clean up
-    ldap_unbind_ext_s(ld, NULL, NULL); // unbind ldap
+// tells a client the server is saturated and closes the connection, never blocks
+void reject_busy(int client_sock, const string& client_ip) {
+    connection_limits.rejected++;
+    send(client_sock, "ERR busy\n", 9, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_sock);
+    log_event(LogLevel::INFO, "event=close ip=%s reason=\"busy\"", client_ip.c_str());
+}
 
-    if (rc == LDAP_SUCCESS) {
-        return true; // authentication successful
-    } else {
-        cerr << "LDAP bind failed: " << ldap_err2string(rc) << endl;
-        return false; // authentication failed
+void open_session(Session& s) {
+    // check if client ip is blacklisted, LOGIN checks again
+    if (login_limiter.is_blocked(s.client_ip)) {
+        send_status(s, "ERR"); // send error response
+        close_session(s, "blacklisted ip");
     }
 }
 
-void process_send(int sock, const string& username) {
-    string receiver = read_line(sock); // read receiver
-    string subject = read_line(sock); // read subject
-    string filename = read_line(sock);
-    string message, line, file;
-
-    // truncate subject if necessary
-    if (subject.length() > 80) {
-        subject = subject.substr(0, 80); // limit to 80 chars
+void handle_line(Session& s, string_view line) {
+    switch (s.state) {
+        case SessionState::COMMAND:
+            handle_command(s, line);
+            break;
+        case SessionState::LOGIN_USERNAME:
+            s.username = line; // read username
+            s.state = SessionState::LOGIN_PASSWORD;
+            break;
+        case SessionState::LOGIN_PASSWORD:
+            s.password = line; // read password
+            s.state = SessionState::COMMAND;
+            process_login(s); // process login
+            break;
+        case SessionState::SEND_RECEIVER:
+            s.receiver = line; // read receiver
+            s.state = SessionState::SEND_SUBJECT;
+            break;
+        case SessionState::SEND_SUBJECT:
+            s.subject = line; // read subject
+            s.state = SessionState::SEND_FILENAME;
+            break;
+        case SessionState::SEND_FILENAME:
+            s.filename = line; // read attachment filename
+            s.state = SessionState::SEND_MESSAGE;
+            break;
+        case SessionState::SEND_MESSAGE:
+            // read message until a single dot '.\n' is encountered
+            if (line == ".") {
+                s.state = SessionState::SEND_FILE;
+                start_upload(s); // the attachment goes straight to disk
+            } else {
+                s.message += line; // append line to message
+                s.message += '\n';
+            }
+            break;
+        case SessionState::SEND_FILE:
+            if (line == "6943" && !s.upload_midline) {
+                s.state = SessionState::COMMAND;
+                process_send(s); // process send
+            } else {
+                write_upload(s, line.data(), line.length());
+                write_upload(s, "\n", 1);
+                s.upload_midline = false;
+            }
+            break;
+        case SessionState::READ_NUMBER:
+            s.state = SessionState::COMMAND;
+            process_read(s, line, false); // process read, dot-terminated
+            break;
+        case SessionState::GETFILE_NUMBER:
+            s.state = SessionState::COMMAND;
+            process_getfile(s, line); // process attachment download
+            break;
+        case SessionState::FETCH_NUMBER:
+            s.state = SessionState::COMMAND;
+            process_read(s, line, true); // process read, length-prefixed
+            break;
+        case SessionState::DEL_NUMBER:
+            s.state = SessionState::COMMAND;
+            process_del(s, line); // process delete
+            break;
+        case SessionState::CLOSED:
+            break; // ignore anything after close
     }
+}
 
-    // read message until a single dot '.\n' is encountered
-    while ((line = read_line(sock)) != ".") {
-        message += line + "\n"; // append line to message
-    }
-    while ((line = read_line(sock)) != "6943") {
-        file += line + "\n"; 
+void handle_command(Session& s, string_view command) {
+    s.request_allocations = thread_allocations;
+    // LIST and SEARCH take their arguments on the command line, the other commands read theirs from the following lines
+    s.args.clear();
+    size_t space = command.find(' ');
+    if (space != string_view::npos && (command.substr(0, space) == "LIST" || command.substr(0, space) == "SEARCH")) {
+        for (size_t start = space + 1; start <= command.length();) {
+            size_t end = min(command.find(' ', start), command.length());
+            s.args.push_back(command.substr(start, end - start));
+            start = end + 1;
+        }
+        command = command.substr(0, space);
     }
 
-    // lock mutex before accessing mail spool
-    mail_mutex.lock();
-
-    // save the message
-    string user_dir = mail_spool_dir + "/" + receiver;
-    mkdir(user_dir.c_str(), 0777); // create user directory if not exists
+    if (command == "QUIT") {
+        // no response for quit, close connection
+        close_session(s, "quit");
+        return;
+    }
 
-    std::ofstream outFile(user_dir + "/" + filename, std::ios::out);
-    if (!outFile && filename != "") {
-        cerr << "Failed to open file: " + filename << endl;
+    if (command == "LOGIN") {
+        s.state = SessionState::LOGIN_USERNAME;
+        return;
     }
-    outFile << file;
-    outFile.close();
 
-    // count existing messages
-    int msg_count = 0;
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(user_dir.c_str())) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            if (ent->d_type == DT_REG) msg_count++; // count files
-        }
-        closedir(dir);
+    if (command == PROTOCOL_V2_HELLO) {
+        send_response(s, "OK v2\n"); // the last line, everything after it is framed
+        s.v2 = true;
+        return;
     }
 
-    string msg_filename = user_dir + "/" + to_string(msg_count + 1) + ".txt"; // message filename
-    ofstream msg_file(msg_filename);
-    if (msg_file.is_open()) {
-        msg_file << "From: " << username << "\n"; // write sender
-        msg_file << "To: " << receiver << "\n"; // write receiver
-        msg_file << "Subject: " << subject << "\n"; // write subject
-        msg_file << "Filename: " << filename << "\n";
-        msg_file << message; // write message body
-        msg_file.close(); // close file
-        send_response(sock, "OK\n"); // send ok response
-    } else {
-        send_response(sock, "ERR\n"); // send error response
+    bool known = command == "SEND" || command == "LIST" || command == "READ" || command == "FETCH" || command == "GETFILE" || command == "DEL" || command == "STATS" || command == "SEARCH";
+    if (!known || !s.authenticated) {
+        send_status(s, "ERR"); // unknown command or not logged in
+        return;
     }
 
-    mail_mutex.unlock(); // unlock mutex
+    if (command == "SEND") {
+        s.receiver.clear();
+        s.subject.clear();
+        s.filename.clear();
+        s.message.clear();
+        s.state = SessionState::SEND_RECEIVER;
+    } else if (command == "LIST") {
+        process_list(s, s.args); // process list
+    } else if (command == "SEARCH") {
+        process_search(s, s.args);
+    } else if (command == "STATS") {
+        process_stats(s);
+    } else if (command == "READ") {
+        s.state = SessionState::READ_NUMBER;
+    } else if (command == "GETFILE") {
+        s.state = SessionState::GETFILE_NUMBER;
+    } else if (command == "FETCH") {
+        s.state = SessionState::FETCH_NUMBER;
+    } else if (command == "DEL") {
+        s.state = SessionState::DEL_NUMBER;
+    }
 }
 
-void process_list(int sock, const string& username) {
-    // lock mutex before accessing mail spool
-    mail_mutex.lock();
-
-    string user_dir = mail_spool_dir + "/" + username;
-    vector<string> subjects;
-    DIR *dir;
-    struct dirent *ent;
-
-    if ((dir = opendir(user_dir.c_str())) != NULL) {
-        // read all files in user directory
-        while ((ent = readdir(dir)) != NULL) {
-            if (ent->d_type == DT_REG) {
-                string filepath = user_dir + "/" + ent->d_name;
-                ifstream msg_file(filepath);
-                string line;
-                while (getline(msg_file, line)) {
-                    if (line.find("Subject: ") == 0) {
-                        subjects.push_back(line.substr(9)); // extract subject
-                        break;
-                    }
-                }
-                msg_file.close();
-            }
+// consumes one v2 frame or part of a body/file frame, returns false if more input is needed
+bool parse_frame(Session& s) {
+    if (s.frame_remaining > 0) {
+        // body and attachment payloads are taken as they arrive, with exact sizes instead of scanning
+        size_t take = min<size_t>(s.frame_remaining, s.input.size());
+        if (take == 0) return false;
+        if (s.frame_type == FRAME_BODY) {
+            s.message.append(s.input.data(), take);
+        } else {
+            write_upload(s, s.input.data(), take);
         }
-        closedir(dir);
+        s.input.consume(take);
+        s.frame_remaining -= take;
+        return true;
     }
 
-    mail_mutex.unlock(); // unlock mutex
+    if (s.input.size() < FRAME_HEADER_SIZE) return false;
+    uint8_t type;
+    uint32_t length;
+    parse_frame_header(s.input.data(), type, length);
 
-    send_response(sock, to_string(subjects.size()) + "\n"); // send number of messages
-    for (const auto& subject : subjects) {
-        send_response(sock, subject + "\n"); // send each subject
+    bool request_frame = type == FRAME_COMMAND || type == FRAME_ARG || type == FRAME_BODY || type == FRAME_FILE || type == FRAME_END;
+    if (!request_frame || (is_field_frame(type) && length > MAX_FIELD_FRAME) || (type == FRAME_END && length != 0)) {
+        send_status(s, "ERR"); // not a valid request, the stream can't be resynchronized
+        close_session(s, "protocol error");
+        return false;
     }
-}
 
-void process_read(int sock, const string& username) {
-    string msg_num = read_line(sock); // read message number
-
-    // lock mutex before accessing mail spool
-    mail_mutex.lock();
+    if (is_field_frame(type)) {
+        if (s.input.size() < FRAME_HEADER_SIZE + length) return false; // small, buffered whole
+        const char* field = s.input.data() + FRAME_HEADER_SIZE;
+        if (type == FRAME_COMMAND) {
+            s.request_allocations = thread_allocations;
+            s.v2_command.assign(field, length);
+            s.v2_argc = 0;
+            s.message.clear();
+        } else {
+            if (s.v2_argc == s.v2_args.size()) s.v2_args.emplace_back();
+            s.v2_args[s.v2_argc++].assign(field, length);
+        }
+        s.input.consume(FRAME_HEADER_SIZE + length);
+        return true;
+    }
 
-    string filepath = mail_spool_dir + "/" + username + "/" + msg_num + ".txt";
+    s.input.consume(FRAME_HEADER_SIZE);
+    if (type == FRAME_END) {
+        handle_request(s);
+        return true;
+    }
 
-    ifstream msg_file(filepath);
-    if (msg_file.is_open()) {
-        send_response(sock, "OK\n"); // send ok response
-        string line;
-        while (getline(msg_file, line)) {
-            send_response(sock, line + "\n"); // send each line of message
+    // the attachment of an authenticated SEND with receiver, subject and filename goes to disk
+    if (type == FRAME_FILE && s.upload_fd < 0 && !s.upload_failed) {
+        if (s.v2_command == "SEND" && s.authenticated && s.v2_argc == 3) {
+            s.filename = s.v2_args[2];
+            start_upload(s);
         }
-        msg_file.close();
-        send_response(sock, ".\n"); // indicate end of message
-    } else {
-        send_response(sock, "ERR\n"); // send error response
     }
-
-    mail_mutex.unlock(); // unlock mutex
+    s.frame_type = type;
+    s.frame_remaining = length;
+    return true;
 }
 
-void process_del(int sock, const string& username) {
-    string msg_num = read_line(sock); // read message number
+// runs a complete v2 request with the same handlers as the line protocol
+void handle_request(Session& s) {
+    const string& command = s.v2_command;
+    vector<string_view>& args = s.args;
+    args.assign(s.v2_args.begin(), s.v2_args.begin() + s.v2_argc);
 
-    // lock mutex before accessing mail spool
-    mail_mutex.lock();
-
-    string filepath = mail_spool_dir + "/" + username + "/" + msg_num + ".txt";
-
-    if (remove(filepath.c_str()) == 0) {
-        send_response(sock, "OK\n"); // send ok response
+    if (command == "QUIT") {
+        close_session(s, "quit"); // no response for quit
+    } else if (command == "LOGIN" && args.size() == 2) {
+        s.username = args[0];
+        s.password = args[1];
+        s.proxied = false;
+        process_login(s);
+    } else if (command == "NODE" && args.size() == 2 && !cluster_ring.nodes.empty()) {
+        // another node acting for a user who logged in there: the cluster secret instead of the user's password
+        s.username = args[1];
+        s.password = args[0];
+        s.proxied = true;
+        process_login(s);
+    } else if (!s.authenticated) {
+        send_status(s, "ERR"); // not logged in
+    } else if (command == "SEND" && args.size() == 3) {
+        s.receiver = args[0];
+        s.subject = args[1];
+        s.filename = args[2];
+        process_send(s);
+    } else if (command == "LIST") {
+        process_list(s, args);
+    } else if (command == "SEARCH") {
+        process_search(s, args);
+    } else if (command == "STATS" && args.empty()) {
+        process_stats(s);
+    } else if ((command == "READ" || command == "FETCH") && args.size() == 1) {
+        process_read(s, args[0], true);
+    } else if (command == "GETFILE" && args.size() == 1) {
+        process_getfile(s, args[0]);
+    } else if (command == "DEL" && args.size() == 1) {
+        process_del(s, args[0]);
     } else {
-        send_response(sock, "ERR\n"); // send error response
+        send_status(s, "ERR"); // unknown command or wrong arguments
     }
+    abort_upload(s); // an attachment nobody asked for
+    s.message.clear();
+    s.v2_command.clear();
+    s.v2_argc = 0;
+}
 
-    mail_mutex.unlock(); // unlock mutex
+void close_session(Session& s, const string& reason) {
+    s.state = SessionState::CLOSED;
+    s.close_reason = reason;
 }
 
-bool is_blacklisted(const string& ip) {
-    lock_guard<mutex> lock(blacklist_mutex); // lock mutex
-    auto it = blacklist.find(ip);
-    if (it != blacklist.end()) {
-        time_t current_time = time(nullptr);
-        if (current_time - it->second < 60) { // check if within 1 minute
-            return true; // ip is blacklisted
-        } else {
-            blacklist.erase(it); // remove from blacklist
-            persist_blacklist(); // update blacklist file
-            return false; // ip is not blacklisted
-        }
+// queues bytes, consecutive responses share a buffer so a whole LIST goes out in a few writes
+void send_response(Session& s, string_view response) {
+    if (response.empty()) return; // an empty buffer would look like a closed socket to flush_output()
+    if (s.output.empty() || s.output.back().fd >= 0 || s.output.back().data.length() >= OUTPUT_CHUNK_SIZE) {
+        s.output.emplace_back();
+        s.output.back().data.swap(output_spare); // a buffer that went out before, if there is one
+        s.output.back().data.reserve(max(response.length(), (size_t)OUTPUT_CHUNK_SIZE));
     }
-    return false; // ip is not blacklisted
+    s.output.back().data += response; // queued, written by flush_output()
+    s.output_pending += response.length();
 }
 
-void update_blacklist(const string& ip) {
-    lock_guard<mutex> lock(blacklist_mutex); // lock mutex
-    blacklist[ip] = time(nullptr); // add ip to blacklist with current time
-    persist_blacklist(); // update blacklist file
+// a status line, or a STATUS frame in v2
+void send_status(Session& s, string_view status) {
+    if (status.compare(0, 3, "ERR") == 0) s.command_failed = true;
+    if (s.v2) {
+        send_response(s, frame_header(FRAME_STATUS, status.length()));
+        send_response(s, status);
+    } else {
+        send_response(s, status);
+        send_response(s, "\n");
+    }
 }
 
-void persist_blacklist() {
-    ofstream blacklist_file("blacklist.txt"); // open blacklist file
-    for (const auto& entry : blacklist) {
-        blacklist_file << entry.first << " " << entry.second << "\n"; // write each entry
+// one line of a listing, or an ITEM frame in v2
+void send_item(Session& s, string_view item) {
+    if (s.v2) {
+        send_response(s, frame_header(FRAME_ITEM, item.length()));
+        send_response(s, item);
+    } else {
+        send_response(s, item);
+        send_response(s, "\n");
     }
-    blacklist_file.close(); // close file
 }
 
-void load_blacklist() {
-    ifstream blacklist_file("blacklist.txt"); // open blacklist file
-    if (!blacklist_file.is_open()) {
-        return; // file not found, return
+// file content announced by a preceding "OK <length>", wrapped in DATA frames in v2
+void send_data_file(Session& s, int fd, off_t offset, size_t length) {
+    if (!s.v2) {
+        send_file(s, fd, offset, length);
+        return;
     }
-    string ip;
+    for (size_t done = 0; done < length;) {
+        uint32_t part = (uint32_t)min<size_t>(length - done, MAX_DATA_FRAME);
+        bool last = done + part == length;
+        int part_fd = last ? fd : dup(fd); // every chunk owns its descriptor
+        if (part_fd < 0) {
+            log_errno(LogLevel::ERROR, "dup");
+            close(fd);
+            close_session(s, "out of file descriptors"); // the length is announced, the client can't tell where it was cut
+            return;
+        }
+        send_response(s, frame_header(FRAME_DATA, part));
+        send_file(s, part_fd, offset + done, part);
+        done += part;
+    }
+    if (length == 0) close(fd);
+}
+
+// bytes announced with "OK <length>", as DATA frames in v2
+void send_data(Session& s, string_view data) {
+    if (!s.v2) {
+        send_response(s, data);
+        return;
+    }
+    for (size_t done = 0; done < data.length();) {
+        uint32_t part = (uint32_t)min<size_t>(data.length() - done, MAX_DATA_FRAME);
+        send_response(s, frame_header(FRAME_DATA, part));
+        send_response(s, data.substr(done, part));
+        done += part;
+    }
+}
+
+// queues length bytes of an open file, the session takes ownership of fd
+void send_file(Session& s, int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        close(fd);
+        return;
+    }
+    OutputChunk chunk;
+    chunk.fd = fd;
+    chunk.offset = offset;
+    chunk.length = length;
+    s.output.push_back(move(chunk));
+    s.output_pending += length;
+}
+
+// writes as much pending output as the socket accepts, returns false on a fatal socket error
+bool flush_output(Session& s) {
+    while (!s.output.empty()) {
+        OutputChunk& chunk = s.output.front();
+        ssize_t sent;
+        if (chunk.fd < 0) {
+            // all queued buffers up to the next file in one call
+            struct iovec iov[MAX_OUTPUT_IOVECS];
+            size_t count = 0;
+            for (auto it = s.output.begin(); it != s.output.end() && it->fd < 0 && count < MAX_OUTPUT_IOVECS; ++it, ++count) {
+                size_t skip = count == 0 ? s.output_sent : 0;
+                iov[count].iov_base = const_cast<char*>(it->data.data()) + skip;
+                iov[count].iov_len = it->data.length() - skip;
+            }
+            struct msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            // a header in front of a file shares its first packet instead of going out alone
+            int flags = MSG_NOSIGNAL | (count < s.output.size() ? MSG_MORE : 0);
+            sent = sendmsg(s.sock, &msg, flags); // send data
+        } else {
+            sent = sendfile(s.sock, chunk.fd, &chunk.offset, chunk.length); // straight from the page cache
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true; // retried on EPOLLOUT
+        if (sent <= 0) {
+            log_errno(LogLevel::ERROR, chunk.fd < 0 ? "sendmsg" : "sendfile"); // error in sending, a file may also have shrunk
+            return false;
+        }
+        ThreadMetrics& m = metrics();
+        add_metric(m.output_writes, 1);
+        add_metric(m.bytes_out, sent);
+        s.output_pending -= sent;
+        if (chunk.fd >= 0) {
+            chunk.length -= sent; // sendfile() advanced the offset
+            if (chunk.length > 0) continue;
+            close(chunk.fd);
+            s.output.pop_front();
+            continue;
+        }
+        // drop the buffers that went out completely
+        size_t remaining = sent;
+        while (remaining > 0) {
+            size_t left = s.output.front().data.length() - s.output_sent;
+            if (remaining < left) {
+                s.output_sent += remaining; // update total sent
+                break;
+            }
+            remaining -= left;
+            s.output_sent = 0;
+            string& sent_data = s.output.front().data;
+            if (sent_data.capacity() <= OUTPUT_CHUNK_SIZE && output_spare.capacity() < sent_data.capacity()) {
+                sent_data.clear();
+                output_spare.swap(sent_data); // kept for the next response, a larger one is freed
+            }
+            s.output.pop_front();
+        }
+    }
+    return true;
+}
+
+void set_nonblocking(int sock) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// registers the events the session currently needs: input while it may parse more, output while some is pending
+void update_events(int epfd, Session& s) {
+    size_t pending = s.output_pending;
+    uint32_t events = 0;
+    if (s.state != SessionState::CLOSED && pending < MAX_PENDING_OUTPUT && !s.login_pending) events |= EPOLLIN | EPOLLRDHUP;
+    if (pending > 0 && !s.commit_waiting) events |= EPOLLOUT; // held output waits for the committer, not the socket
+    if (events == s.events) return;
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = &s;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s.sock, &ev);
+    s.events = events;
+}
+
+// feeds all complete buffered lines to the parser, returns false while too much output is queued or a LOGIN is pending
+bool parse_input(Session& s) {
+    string_view line;
+    while (s.state != SessionState::CLOSED) {
+        if (s.output_pending >= MAX_PENDING_OUTPUT || s.login_pending) return false;
+        if (s.v2) {
+            if (!parse_frame(s)) break; // incomplete frame, wait for more data
+        } else if (s.input.next_line(line)) {
+            handle_line(s, line);
+        } else if (s.state == SessionState::SEND_FILE && s.input.size() >= UPLOAD_PARTIAL_LINE) {
+            // a long attachment line, stream what is there instead of growing the input buffer
+            write_upload(s, s.input.data(), s.input.size());
+            s.input.consume(s.input.size());
+            s.upload_midline = true; // this line can no longer be the terminator
+        } else {
+            break; // incomplete line, wait for more data
+        }
+    }
+    return true;
+}
+
+void destroy_session(int epfd, Session* s) {
+    if (s->commit_waiting) {
+        commit_waiters.erase(find(commit_waiters.begin(), commit_waiters.end(), s));
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->sock, nullptr);
+    close(s->sock); // close client socket
+    release_connection(s->client_ip);
+    log_event(LogLevel::INFO, "event=close ip=%s user=%s reason=\"%s\"", s->client_ip.c_str(), s->username.c_str(), s->close_reason.c_str());
+    if (s->login_pending) {
+        s->sock = -1; // an auth thread still holds it, resume_logins() deletes it
+        return;
+    }
+    delete s;
+}
+
+void accept_connections(int epfd, int listen_sock) {
+    while (true) {
+        string client_ip;
+        int client_sock = accept_client(listen_sock, client_ip, SOCK_NONBLOCK);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EMFILE && errno != ENFILE) log_errno(LogLevel::ERROR, "Accept");
+            return; // backlog drained (or transient error), wait for the next event
+        }
+        log_event(LogLevel::INFO, "event=accept ip=%s", client_ip.c_str());
+
+        if (!admit_connection(client_ip)) {
+            reject_busy(client_sock, client_ip);
+            continue;
+        }
+        Session* s = new Session(client_sock, client_ip);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+            log_errno(LogLevel::ERROR, "epoll_ctl");
+            close(client_sock);
+            release_connection(client_ip);
+            delete s;
+            continue;
+        }
+        s->events = ev.events;
+
+        open_session(*s);
+        if (!flush_output(*s) || (s->state == SessionState::CLOSED && s->output_pending == 0)) {
+            destroy_session(epfd, s);
+            continue;
+        }
+        update_events(epfd, *s);
+    }
+}
+
+// handles readiness of one client, returns false once the session was destroyed
+bool handle_session_event(int epfd, Session* s, uint32_t events) {
+    bool peer_closed = false;
+    bool readable = events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+
+    while (true) {
+        // buffered input first, output may have drained below the limit since the last event
+        bool accepting = parse_input(*s);
+        if (accepting && readable) {
+            for (int i = 0; i < MAX_READS_PER_EVENT && s->state != SessionState::CLOSED; i++) {
+                ssize_t n = s->input.fill();
+                if (n > 0) {
+                    add_metric(metrics().bytes_in, n);
+                    if (!(accepting = parse_input(*s))) break; // too much output queued, leave the rest in the kernel
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break; // socket drained
+                peer_closed = true; // orderly shutdown or error
+                break;
+            }
+        }
+        readable = false; // the socket was read, further rounds only parse what is buffered
+
+        if (s->login_pending && (events & (EPOLLHUP | EPOLLERR))) {
+            peer_closed = true; // reported even without EPOLLIN, the answer to the LOGIN can't be delivered
+        }
+        if (peer_closed && s->state != SessionState::CLOSED) {
+            close_session(*s, "peer closed"); // nothing more will arrive, finish sending and close
+        }
+        if (hold_for_commit(*s)) {
+            update_events(epfd, *s); // the committer resumes it
+            return true;
+        }
+        if (!flush_output(*s)) {
+            destroy_session(epfd, s);
+            return false;
+        }
+
+        if (s->state == SessionState::CLOSED && s->output_pending == 0) {
+            destroy_session(epfd, s);
+            return false;
+        }
+        // stopped at the output limit and the flush drained it: the buffered commands won't raise another event
+        if (accepting || s->login_pending || s->output_pending >= MAX_PENDING_OUTPUT) break;
+    }
+    update_events(epfd, *s);
+    return true;
+}
+
+void run_event_loop(int port) {
+    int listen_sock = create_listen_socket(port, true);
+    set_nonblocking(listen_sock);
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr; // the listener is the only entry without a session
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+
+    // the committer wakes the loop when sessions wait for a journal commit, an auth thread when a LOGIN was checked
+    if (journal_enabled || async_login) {
+        loop_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop_wake_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, loop_wake_fd, &ev);
+    }
+
+    epoll_event events[MAX_EPOLL_EVENTS];
+    while (true) {
+        int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                accept_connections(epfd, listen_sock);
+            } else if (events[i].data.ptr == &loop_wake_fd) {
+                uint64_t count;
+                if (read(loop_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) log_errno(LogLevel::ERROR, "eventfd");
+                resume_committed(epfd);
+                resume_logins(epfd);
+            } else {
+                handle_session_event(epfd, static_cast<Session*>(events[i].data.ptr), events[i].events);
+            }
+        }
+    }
+}
+
+void process_login(Session& s) {
+    // reactor with ldap: an auth thread waits for the directory, the loop serves its other sessions meanwhile
+    if (async_login && !s.proxied && !login_limiter.is_blocked(s.client_ip) && is_valid_mailbox(s.username)) {
+        s.authenticated = false;
+        s.login_pending = true;
+        {
+            lock_guard<mutex> lock(login_queue.queue_mutex);
+            login_queue.jobs.push_back(LoginJob{&s, s.username, s.password, loop_wake_fd, chrono::steady_clock::now()});
+        }
+        login_queue.job_added.notify_one();
+        s.password.clear();
+        return;
+    }
+
+    CommandTimer timer(s, METRIC_LOGIN);
+    // blocked by failures on another connection of the same ip
+    if (login_limiter.is_blocked(s.client_ip)) {
+        s.password.clear();
+        s.authenticated = false;
+        send_status(s, "ERR"); // send error response
+        close_session(s, "blacklisted ip");
+        return;
+    }
+
+    // the username names the mailbox directory, ".." or a path would lead out of the spool whatever the backend says
+    finish_login(s, is_valid_mailbox(s.username) && (s.proxied ? is_cluster_secret(s.password) : authenticate_user(s.username, s.password)));
+}
+
+// answers a LOGIN whose credentials were checked
+void finish_login(Session& s, bool valid) {
+    if (valid) { // authenticate user
+        s.authenticated = true; // set authenticated to true
+        login_limiter.record_success(s.client_ip);
+        send_status(s, "OK"); // send ok response
+    } else {
+        s.authenticated = false; // authentication failed
+        s.proxied = false;
+        send_status(s, "ERR"); // send error response
+        if (login_limiter.record_failure(s.client_ip)) { // MAX_LOGIN_FAILURES reached, the ip is blacklisted
+            send_status(s, "ERR"); // send error
+            close_session(s, "too many login attempts");
+        }
+    }
+    s.password.clear();
+}
+
+// checks the LOGINs of the event loops and wakes the loop of each when its answer is ready
+void run_auth_thread() {
+    while (true) {
+        LoginJob job;
+        {
+            unique_lock<mutex> lock(login_queue.queue_mutex);
+            login_queue.job_added.wait(lock, [] { return !login_queue.jobs.empty(); });
+            job = move(login_queue.jobs.front());
+            login_queue.jobs.pop_front();
+        }
+        job.valid = authenticate_user(job.username, job.password);
+        job.password.clear();
+        int wake_fd = job.wake_fd;
+        {
+            lock_guard<mutex> lock(login_queue.queue_mutex);
+            login_queue.done[wake_fd].push_back(move(job));
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) log_errno(LogLevel::ERROR, "eventfd");
+    }
+}
+
+// reactor: the LOGINs the auth threads finished for this loop are answered, their sessions continue with what
+// arrived meanwhile
+void resume_logins(int epfd) {
+    if (!async_login) return;
+    vector<LoginJob> finished;
+    {
+        lock_guard<mutex> lock(login_queue.queue_mutex);
+        auto it = login_queue.done.find(loop_wake_fd);
+        if (it == login_queue.done.end()) return;
+        finished.swap(it->second);
+    }
+    for (auto& job : finished) {
+        Session* s = job.session;
+        s->login_pending = false;
+        if (s->sock < 0) {
+            delete s; // the connection closed while the LOGIN was checked
+            continue;
+        }
+        {
+            CommandTimer timer(*s, METRIC_LOGIN, job.start);
+            finish_login(*s, job.valid);
+        }
+        handle_session_event(epfd, s, 0);
+    }
+}
+
+bool authenticate_user(const string& username, const string& password) {
+    auto start = chrono::steady_clock::now();
+    bool authenticated = false;
+
+    // a recent successful login with the same password skips the directory
+    string cached_hash;
+    if (auth_cache_ttl > 0) {
+        lock_guard<mutex> lock(auth_cache_mutex);
+        auto it = auth_cache.find(username);
+        if (it != auth_cache.end() && it->second.expires > time(nullptr)) {
+            cached_hash = it->second.hash;
+        }
+    }
+    if (!cached_hash.empty() && hash_password(password, cached_hash) == cached_hash) {
+        authenticated = true;
+    } else if (auth_backend->authenticate(username, password)) {
+        authenticated = true;
+        if (auth_cache_ttl > 0) {
+            CachedCredential credential;
+            credential.hash = hash_password(password, "");
+            credential.expires = time(nullptr) + auth_cache_ttl;
+            lock_guard<mutex> lock(auth_cache_mutex);
+            auth_cache[username] = credential;
+        }
+    }
+
+    auto elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start);
+    record_latency(login_latency, elapsed.count());
+    return authenticated;
+}
+
+// the secret of a NODE login, compared in constant time
+bool is_cluster_secret(const string& secret) {
+    return !cluster_secret.empty() && secret.length() == cluster_secret.length()
+        && CRYPTO_memcmp(secret.data(), cluster_secret.data(), secret.length()) == 0;
+}
+
+// salted SHA-256 crypt of a password, a new random salt if setting is empty
+string hash_password(const string& password, const string& setting) {
+    string salt = setting;
+    if (salt.empty()) {
+        static const char alphabet[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+        unsigned char random[16];
+        ifstream urandom("/dev/urandom", ios::binary);
+        urandom.read(reinterpret_cast<char*>(random), sizeof(random));
+        salt = "$5$rounds=1000$";
+        for (unsigned char c : random) salt += alphabet[c % 64];
+        salt += "$";
+    }
+    unique_ptr<crypt_data> data(new crypt_data()); // large, not kept on the stack
+    const char* hash = crypt_r(password.c_str(), salt.c_str(), data.get());
+    return hash != nullptr && hash[0] != '*' ? string(hash) : string();
+}
+
+LdapAuthBackend::LdapAuthBackend(const string& uri, const string& base_dn, size_t pool_size)
+    : uri(uri), base_dn(base_dn), pool_size(pool_size) {}
+
+LdapAuthBackend::~LdapAuthBackend() {
+    for (LDAP* ld : idle) {
+        ldap_unbind_ext_s(ld, NULL, NULL);
+    }
+}
+
+void LdapAuthBackend::warm_up() {
+    vector<LDAP*> opened;
+    for (size_t i = 0; i < pool_size; i++) {
+        opened.push_back(acquire());
+    }
+    for (LDAP* ld : opened) {
+        release(ld, false);
+    }
+}
+
+// a new connection with TLS already started, nullptr if the directory is unreachable
+LDAP* LdapAuthBackend::connect() {
+    LDAP *ld; // ldap connection
+    int rc; // return code
+
+    // Initialize LDAP connection
+    rc = ldap_initialize(&ld, uri.c_str());
+    if (rc != LDAP_SUCCESS) {
+        log_event(LogLevel::ERROR, "event=ldap error=\"initialization failed: %s\"", ldap_err2string(rc));
+        return nullptr;
+    }
+
+    // Set LDAP version
+    int version = LDAP_VERSION3; // ldap version 3
+    ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version); // set ldap version
+    struct timeval timeout = {5, 0}; // don't let a dead directory hang logins forever
+    ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+    // Start TLS
+    rc = ldap_start_tls_s(ld, NULL, NULL);
+    if (rc != LDAP_SUCCESS) {
+        ldap_unbind_ext_s(ld, NULL, NULL);
+        log_event(LogLevel::ERROR, "event=ldap error=\"ldap_start_tls_s() failed: %s\"", ldap_err2string(rc));
+        return nullptr;
+    }
+    return ld;
+}
+
+// an idle connection, a new one while the pool isn't full, otherwise waits for one to be released
+LDAP* LdapAuthBackend::acquire() {
+    unique_lock<mutex> lock(pool_mutex);
+    pool_available.wait(lock, [this] { return !idle.empty() || open_connections < pool_size; });
+    if (!idle.empty()) {
+        LDAP* ld = idle.back();
+        idle.pop_back();
+        return ld;
+    }
+    open_connections++;
+    lock.unlock(); // connecting takes a network round trip, don't block the pool meanwhile
+
+    LDAP* ld = connect();
+    if (ld == nullptr) {
+        lock.lock();
+        open_connections--;
+        pool_available.notify_one();
+    }
+    return ld;
+}
+
+void LdapAuthBackend::release(LDAP* ld, bool broken) {
+    lock_guard<mutex> lock(pool_mutex);
+    if (ld == nullptr) {
+        return; // acquire() already gave the slot back
+    }
+    if (broken) {
+        ldap_unbind_ext_s(ld, NULL, NULL);
+        open_connections--; // the next acquire() reconnects
+    } else {
+        idle.push_back(ld);
+    }
+    pool_available.notify_one();
+}
+
+bool LdapAuthBackend::authenticate(const string& username, const string& password) {
+    string ldap_bind_dn = "uid=" + username + "," + base_dn; // user's DN
+
+    // Prepare credentials
+    struct berval cred;
+    cred.bv_val = (char*)password.c_str();  // set password
+    cred.bv_len = password.length();
+
+    // a pooled connection may have been closed by the server, then retry once on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++) {
+        LDAP* ld = acquire();
+        if (ld == nullptr) {
+            return false; // directory unreachable
+        }
+
+        // Attempt to bind using the user's DN and password, this replaces the connection's previous identity
+        auto start = chrono::steady_clock::now();
+        int rc = ldap_sasl_bind_s(ld, ldap_bind_dn.c_str(), LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        record_metric(METRIC_LDAP_BIND, elapsed.count(), rc != LDAP_SUCCESS);
+        bool broken = rc < 0; // client side errors, e.g. the connection is gone
+        release(ld, broken);
+
+        if (rc == LDAP_SUCCESS) {
+            return true; // authentication successful
+        }
+        if (!broken) {
+            log_event(LogLevel::INFO, "event=ldap user=%s error=\"bind failed: %s\"", username.c_str(), ldap_err2string(rc));
+            return false; // authentication failed
+        }
+    }
+    return false;
+}
+
+StubAuthBackend::StubAuthBackend(const string& users_file) : accept_all(users_file.empty()) {
+    if (accept_all) return;
+    ifstream file(users_file);
+    if (!file.is_open()) {
+        cerr << "Failed to open users file: " << users_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    string username, password;
+    while (file >> username >> password) {
+        users[username] = password;
+    }
+}
+
+bool StubAuthBackend::authenticate(const string& username, const string& password) {
+    if (accept_all) {
+        return !username.empty();
+    }
+    auto it = users.find(username);
+    return it != users.end() && it->second == password;
+}
+
+void process_send(Session& s) {
+    CommandTimer timer(s, METRIC_SEND);
+    const string& filename = s.filename;
+    string& subject = s.subject;
+
+    // truncate subject if necessary
+    if (subject.length() > 80) {
+        subject.resize(80); // limit to 80 chars
+    }
+
+    // every receiver becomes a directory name, the attachment must be completely on disk
+    thread_local vector<string> receivers; // like everything thread_local below, reused by the next SEND of this thread
+    split_receivers(s.receiver, receivers);
+    bool valid = !receivers.empty() && receivers.size() <= MAX_RECIPIENTS;
+    for (const auto& receiver : receivers) {
+        valid = valid && is_valid_mailbox(receiver);
+    }
+    if (!valid || !finish_upload(s)) {
+        send_status(s, "ERR"); // send error response
+        abort_upload(s);
+        s.message.clear();
+        return;
+    }
+
+    ArenaScope arena;
+    string& to = arena.take();
+    for (const auto& receiver : receivers) {
+        append_parts(to, to.empty() ? "" : ",", receiver);
+    }
+    string& header = arena.concat("From: ", s.username, "\n", // write sender
+                                  "To: ", to, "\n", // write receivers
+                                  "Subject: ", subject, "\n", // write subject
+                                  "Filename: ", filename, "\n");
+
+    // receivers that didn't get the message, "ERR <receivers>" tells the sender whom a retry has to be limited to
+    string& failed = arena.take();
+
+    // in a cluster every node stores the message for the receivers it owns, the SEND is forwarded once to every other
+    // node owning some of them; a node it was forwarded to leaves the remaining receivers to the node that forwarded it
+    if (!cluster_ring.nodes.empty()) {
+        vector<string> local;
+        set<string> nodes, failed_nodes;
+        for (const auto& receiver : receivers) {
+            const ClusterNode& node = cluster_ring.owner(receiver);
+            if (node.name == node_name) {
+                local.push_back(receiver);
+                continue;
+            }
+            if (s.proxied) continue;
+            if (nodes.insert(node.name).second) {
+                string status = forward_send(s, node, to, subject);
+                if (status.compare(0, 4, "ERR ") == 0) {
+                    append_parts(failed, failed.empty() ? "" : ",", string_view(status).substr(4)); // the node's own list
+                } else if (status != "OK") {
+                    failed_nodes.insert(node.name); // no answer or plain ERR: none of its receivers got it
+                }
+            }
+            if (failed_nodes.count(node.name)) append_parts(failed, failed.empty() ? "" : ",", receiver);
+        }
+        receivers.swap(local);
+    }
+    if (receivers.empty()) {
+        // forwarded here for nobody: the nodes disagree on the ring
+        send_status(s, s.proxied ? "ERR" : failed.empty() ? "OK" : arena.concat("ERR ", failed));
+        abort_upload(s);
+        s.message.clear();
+        return;
+    }
+    thread_local IndexEntry entry, delivered;
+    entry.timestamp = time(nullptr);
+    entry.sender = s.username;
+    entry.attachment = filename;
+    entry.subject = subject;
+
+    // the payload is stored once, the mailboxes only get links to it; the segment store
+    // writes the message itself into every segment, compressed once for all of them
+    thread_local BlobRef message, attachment;
+    message.clear();
+    attachment.clear();
+    string compressed;
+    bool saved = s.upload_path.empty() || store_attachment_blob(s.upload_path, attachment);
+    if (segment_store) {
+        if (!compress_message(header, s.message, compressed)) compressed.clear();
+    } else {
+        saved = saved && store_message_blob(header, s.message, message);
+    }
+    const BlobRef* linked = attachment.path.empty() ? nullptr : &attachment;
+
+    // the journal only names the attachment, its content has to be on disk before the record
+    if (saved && linked && journal_enabled) {
+        int fd = open(attachment.path.c_str(), O_RDONLY | O_CLOEXEC);
+        saved = fd >= 0 && fdatasync(fd) == 0;
+        if (fd >= 0) close(fd);
+    }
+
+    // tokenized once for all receivers, every mailbox with a search index gets the message's line
+    string& search_terms = arena.take();
+    format_search_terms(s.username, subject, s.message, search_terms);
+
+    // one mailbox lock at a time; receivers before a failed one keep the message, the answer lists the others.
+    // with the journal every lock is kept until the record is appended, so the records of a mailbox follow its ids
+    // and a DEL's record follows the SEND's; the locks are taken in name order, nobody else holds two of them
+    thread_local JournalMessage journaled;
+    thread_local deque<MailboxGuard> guards;
+    journaled.deliveries.clear();
+    if (journal_enabled) sort(receivers.begin(), receivers.end());
+    string& user_dir = arena.take();
+    size_t stored = 0; // receivers that got the message
+    for (size_t i = 0; saved && i < receivers.size(); i++) {
+        MailboxLock& mailbox = guards.emplace_back(receivers[i], true).mailbox();
+        mkdir(assign_parts(user_dir, mail_spool_dir, "/", receivers[i]).c_str(), 0777); // create user directory if not exists
+        delivered = entry;
+        if (segment_store) {
+            saved = append_segment_message(mailbox, receivers[i], delivered, header, s.message, compressed, linked);
+        } else {
+            saved = deliver_message(mailbox, receivers[i], delivered, message, linked);
+        }
+        if (saved) {
+            index_message(mailbox, receivers[i], delivered.id, search_terms);
+            if (journal_enabled) journaled.deliveries.emplace_back(receivers[i], delivered.id);
+            stored++;
+        }
+        if (!journal_enabled) guards.pop_back();
+    }
+
+    // one record for all receivers, the response goes out once it is durable
+    if (journal_enabled && !journaled.deliveries.empty()) {
+        journaled.entry = entry;
+        journaled.header = header;
+        journaled.body = s.message;
+        journaled.blob = linked ? string_view(attachment.blob) : string_view();
+        string& record = arena.take();
+        encode_journal_message(journaled, record);
+        s.commit_lsn = journal_append('S', record, linked != nullptr);
+    }
+    guards.clear();
+    for (size_t i = stored; i < receivers.size(); i++) {
+        append_parts(failed, failed.empty() ? "" : ",", receivers[i]);
+    }
+    send_status(s, failed.empty() ? "OK" : arena.concat("ERR ", failed));
+
+    // the mailboxes hold their own links now
+    for (const BlobRef* ref : {&message, &attachment}) {
+        if (!ref->path.empty()) unlink(ref->path.c_str());
+    }
+    abort_upload(s); // leftover temporary file if the attachment was already stored
+    s.message.clear(); // release the buffered payload
+}
+
+// links a stored message, and its attachment if it has one, into a mailbox of the files store;
+// the caller holds the mailbox lock exclusively
+bool deliver_message(MailboxLock& mailbox, const string& name, IndexEntry& entry, const BlobRef& message, const BlobRef* attachment) {
+    ArenaScope arena;
+    const string& user_dir = arena.concat(mail_spool_dir, "/", name);
+
+    // checked before any new file changes the directory
+    bool index_fresh = index_is_fresh(user_dir);
+
+    // ids only ever grow, a new message can never take the place of a deleted one
+    const char* suffix = message.deflated ? ".txt" COMPRESSED_SUFFIX : ".txt"; // READ finds out by the name
+    string& msg_filename = arena.take(); // message filename
+    unsigned long id;
+    int rc;
+    do {
+        id = allocate_message_id(mailbox, user_dir);
+        rc = link(message.path.c_str(), assign_parts(msg_filename, user_dir, "/", id, suffix).c_str());
+    } while (rc != 0 && errno == EEXIST); // skip ids taken by files the server doesn't know about
+
+    bool saved = rc == 0;
+    if (saved && attachment) {
+        const string& attachment_filename = arena.concat(user_dir, "/", id, attachment->deflated ? ".att" COMPRESSED_SUFFIX : ".att");
+        saved = link(attachment->path.c_str(), attachment_filename.c_str()) == 0;
+    }
+    if (!saved) {
+        log_errno(LogLevel::ERROR, "message file");
+        if (rc == 0) unlink(msg_filename.c_str()); // no message without its attachment
+        return false;
+    }
+
+    entry.id = id;
+    entry.size = message.size;
+    if (index_fresh) {
+        append_index_entry(user_dir, entry); // one write, no directory scan
+    } else {
+        vector<IndexEntry> entries;
+        rebuild_index(user_dir, entries); // missing or modified behind our back
+    }
+    return true;
+}
+
+// comma separated receivers without surrounding blanks, each named once; overwrites receivers, keeping its strings
+void split_receivers(const string& text, vector<string>& receivers) {
+    size_t count = 0;
+    size_t start = 0;
+    while (start <= text.length()) {
+        size_t end = text.find(',', start);
+        if (end == string::npos) end = text.length();
+        size_t first = text.find_first_not_of(' ', start);
+        size_t last = text.find_last_not_of(' ', end - 1);
+        string_view receiver = first < end && last != string::npos && last >= first ? string_view(text).substr(first, last - first + 1) : "";
+        if (find(receivers.begin(), receivers.begin() + count, receiver) == receivers.begin() + count) {
+            if (count == receivers.size()) receivers.emplace_back();
+            receivers[count++] = receiver; // an empty name fails validation
+        }
+        start = end + 1;
+    }
+    receivers.resize(count);
+}
+
+// receiver names are used as directory names below the spool
+bool is_valid_mailbox(const string& name) {
+    return !name.empty() && name[0] != '.' && name.find('/') == string::npos;
+}
+
+// unique name for a file in transfer
+void temp_path(string& path) {
+    static atomic<unsigned long> temp_counter{0};
+    assign_parts(path, mail_spool_dir, "/" UPLOAD_DIRNAME "/", getpid(), ".", temp_counter++);
+}
+
+// opens a temporary file for the attachment of the SEND in progress
+void start_upload(Session& s) {
+    s.upload_buffer.clear();
+    s.upload_midline = false;
+    s.upload_failed = false;
+    if (s.filename.empty()) return; // no attachment announced, its lines are dropped
+
+    temp_path(s.upload_path);
+    s.upload_fd = open(s.upload_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (s.upload_fd < 0) {
+        log_errno(LogLevel::ERROR, "upload");
+        s.upload_path.clear();
+        s.upload_failed = true;
+    }
+}
+
+// buffers attachment bytes and writes them in chunks of UPLOAD_CHUNK_SIZE, memory stays bounded
+void write_upload(Session& s, const char* data, size_t length) {
+    if (s.upload_fd < 0 || s.upload_failed) return;
+    if (s.upload_buffer.length() + length <= UPLOAD_CHUNK_SIZE) {
+        if (s.upload_buffer.capacity() < UPLOAD_CHUNK_SIZE) s.upload_buffer.reserve(UPLOAD_CHUNK_SIZE);
+        s.upload_buffer.append(data, length);
+        return;
+    }
+
+    // buffer full, pieces of at least a chunk go to disk without being copied
+    bool ok = write_all(s.upload_fd, s.upload_buffer);
+    s.upload_buffer.clear();
+    if (ok && length >= UPLOAD_CHUNK_SIZE) {
+        ok = write_all(s.upload_fd, data, length);
+    } else {
+        s.upload_buffer.append(data, length);
+    }
+    if (!ok) {
+        log_errno(LogLevel::ERROR, "upload");
+        s.upload_failed = true; // the rest is dropped, SEND answers ERR
+    }
+}
+
+// writes the remaining bytes and closes the temporary file, returns false if any write failed
+bool finish_upload(Session& s) {
+    if (s.upload_fd >= 0) {
+        if (!s.upload_failed && !write_all(s.upload_fd, s.upload_buffer)) {
+            log_errno(LogLevel::ERROR, "upload");
+            s.upload_failed = true;
+        }
+        close(s.upload_fd);
+        s.upload_fd = -1;
+    }
+    string().swap(s.upload_buffer); // idle sessions keep no upload buffer
+    return !s.upload_failed;
+}
+
+// drops an unfinished or unused upload
+void abort_upload(Session& s) {
+    if (s.upload_fd >= 0) {
+        close(s.upload_fd);
+        s.upload_fd = -1;
+    }
+    if (!s.upload_path.empty()) {
+        unlink(s.upload_path.c_str());
+        s.upload_path.clear();
+    }
+    string().swap(s.upload_buffer);
+}
+
+Session::~Session() {
+    abort_upload(*this); // connection closed in the middle of a SEND
+    for (auto& chunk : output) {
+        if (chunk.fd >= 0) close(chunk.fd); // files of responses that were never sent
+    }
+}
+
+// forwards a mailbox command to the node owning the session's mailbox and relays its answer in the session's protocol,
+// false if the mailbox is served here; items are collected completely first, a node failing before or while sending them
+// is a plain ERR; messages and attachments are passed on as they arrive, a node failing halfway through one of them
+// closes the client's connection
+bool proxy_command(Session& s, string_view command, const vector<string_view>& args, bool framed) {
+    if (cluster_ring.nodes.empty() || s.proxied) return false;
+    const ClusterNode& node = cluster_ring.owner(s.username);
+    if (node.name == node_name) return false;
+    add_metric(metrics().proxied, 1);
+
+    string request = make_frame(FRAME_COMMAND, string(command));
+    for (const auto& arg : args) {
+        request += make_frame(FRAME_ARG, string(arg));
+    }
+    bool items = command == "LIST" || command == "SEARCH"; // "OK <count> ..." and that many ITEM frames
+    bool list = command == "READ" && is_message_list(args[0]); // "OK <count>" and that many messages
+
+    string status;
+    vector<string> answer; // the items of LIST and SEARCH
+    int sock = node_request(node, s.username, request, "");
+    InputBuffer in(sock);
+    bool ok = sock >= 0 && read_node_status(in, status);
+    bool data = ok && status.compare(0, 3, "OK ") == 0 && command != "DEL" && !items; // messages or an attachment follow
+    if (ok && status.compare(0, 3, "OK ") == 0 && items) {
+        size_t count = strtoul(status.c_str() + 3, nullptr, 10);
+        for (size_t i = 0; ok && i < count; i++) {
+            string field;
+            ok = read_node_field(in, FRAME_ITEM, field);
+            answer.push_back(move(field));
+        }
+    }
+    if (!ok) {
+        if (sock >= 0) close(sock);
+        log_event(LogLevel::WARN, "event=proxy_failed node=%s command=%.*s user=%s", node.name.c_str(), (int)command.length(), command.data(),
+                  s.username.c_str());
+        send_status(s, "ERR");
+        return true;
+    }
+
+    if (items) {
+        if (s.v2) {
+            send_status(s, status);
+        } else {
+            send_item(s, status.substr(3)); // the line protocol sends the counts as the first line
+        }
+        for (const auto& item : answer) {
+            send_item(s, item);
+        }
+    } else if (!data) {
+        send_status(s, status); // ERR, or the answer of DEL
+    } else if (command == "GETFILE") {
+        send_status(s, status);
+        ok = relay_node_data(s, in, strtoul(status.c_str() + 3, nullptr, 10), false);
+    } else {
+        // every message as send_message() sends it, its length is in its status
+        ArenaScope arena;
+        size_t count = list ? strtoul(status.c_str() + 3, nullptr, 10) : 1;
+        if (list) send_status(s, status);
+        string& field = arena.take();
+        for (size_t i = 0; ok && i < count; i++) {
+            field = status;
+            ok = !list || (read_node_field(in, FRAME_STATUS, field) && field.compare(0, 3, "OK ") == 0);
+            if (!ok) break;
+            size_t space = field.find(' ', 3);
+            string_view tag = space == string::npos ? string_view() : string_view(field).substr(space); // " <id>" of a READ list
+            size_t length = strtoul(field.c_str() + 3, nullptr, 10);
+            bool dot_terminated = !framed && !s.v2;
+            send_status(s, dot_terminated ? arena.concat("OK", tag) : arena.concat("OK ", length, tag));
+            ok = relay_node_data(s, in, length, dot_terminated);
+        }
+    }
+    close(sock);
+    if (!ok) {
+        log_event(LogLevel::WARN, "event=proxy_failed node=%s command=%.*s user=%s", node.name.c_str(), (int)command.length(), command.data(),
+                  s.username.c_str());
+        close_session(s, "proxy failed"); // part of the answer is out, the client can't tell where it was cut
+    }
+    return true;
+}
+
+// the same for a command with one argument, checked before the argument list is built
+bool proxy_command(Session& s, string_view command, string_view arg, bool framed) {
+    return !cluster_ring.nodes.empty() && !s.proxied && proxy_command(s, command, vector<string_view>{arg}, framed);
+}
+
+// forwards a SEND with all its receivers to another node, which stores it for those it owns; returns the node's answer,
+// empty if there was none
+string forward_send(Session& s, const ClusterNode& node, const string& to, const string& subject) {
+    add_metric(metrics().proxied, 1);
+    string request = make_frame(FRAME_COMMAND, "SEND") + make_frame(FRAME_ARG, to) + make_frame(FRAME_ARG, subject)
+        + make_frame(FRAME_ARG, s.filename) + frame_header(FRAME_BODY, s.message.length()) + s.message;
+    string status;
+    int sock = node_request(node, s.username, request, s.upload_path); // the attachment streamed from its temporary file
+    InputBuffer in(sock);
+    bool ok = sock >= 0 && read_node_status(in, status);
+    if (sock >= 0) close(sock);
+    if (!ok) {
+        log_event(LogLevel::WARN, "event=proxy_failed node=%s command=SEND user=%s", node.name.c_str(), s.username.c_str());
+        status.clear();
+    }
+    return status;
+}
+
+// connects to another node and writes HELLO v2, a NODE login for username, the request without its END, the attachment
+// as FILE frames if there is one, END and QUIT; the node closes the connection after the answer. -1 if that failed
+int node_request(const ClusterNode& node, const string& username, const string& request, const string& attachment_path) {
+    struct sockaddr_in node_addr{};
+    node_addr.sin_family = AF_INET;
+    node_addr.sin_port = htons(node.port);
+    inet_pton(AF_INET, node.host.c_str(), &node_addr.sin_addr); // checked at startup
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    struct timeval timeout = {CLUSTER_TIMEOUT, 0}; // a node without a free worker fails the command instead of blocking this one
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    string head = PROTOCOL_V2_HELLO "\n" + make_frame(FRAME_COMMAND, "NODE") + make_frame(FRAME_ARG, cluster_secret)
+        + make_frame(FRAME_ARG, username) + frame_header(FRAME_END, 0) + request;
+    bool ok = connect(sock, (struct sockaddr *)&node_addr, sizeof(node_addr)) == 0 && send_to_node(sock, head.data(), head.length());
+    if (ok && !attachment_path.empty()) {
+        int fd = open(attachment_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        ok = fd >= 0 && fstat(fd, &st) == 0;
+        vector<char> buffer(UPLOAD_CHUNK_SIZE);
+        for (off_t done = 0; ok;) {
+            uint32_t part = (uint32_t)min<off_t>(st.st_size - done, MAX_DATA_FRAME);
+            string header = frame_header(FRAME_FILE, part);
+            ok = send_to_node(sock, header.data(), header.length());
+            for (off_t end = done + part; ok && done < end;) {
+                ssize_t n = pread(fd, buffer.data(), min<off_t>(end - done, buffer.size()), done);
+                ok = n > 0 && send_to_node(sock, buffer.data(), n);
+                done += max<ssize_t>(n, 0);
+            }
+            if (done >= st.st_size) break; // an empty attachment is one empty frame
+        }
+        if (fd >= 0) close(fd);
+    }
+    string tail = frame_header(FRAME_END, 0) + make_frame(FRAME_COMMAND, "QUIT") + frame_header(FRAME_END, 0);
+    if (!ok || !send_to_node(sock, tail.data(), tail.length())) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool send_to_node(int sock, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// the answer of a node_request() up to the status of the request, after "OK v2" and the "OK" of the NODE login
+bool read_node_status(InputBuffer& in, string& status) {
+    string_view line;
+    string login;
+    return in.read_line(line) && line == "OK v2" && read_node_field(in, FRAME_STATUS, login) && login == "OK"
+        && read_node_field(in, FRAME_STATUS, status);
+}
+
+bool read_node_field(InputBuffer& in, uint8_t type, string& payload) {
+    uint8_t frame_type;
+    uint32_t length;
+    payload.clear();
+    return in.read_frame_header(frame_type, length) && frame_type == type && length <= MAX_FIELD_FRAME && in.read_bytes(length, payload);
+}
+
+// passes the DATA frames of a message or attachment of length bytes on to the client as they arrive, never more than
+// OUTPUT_CHUNK_SIZE of it in memory; a dot-terminated READ gets its final dot. Threaded mode only, the blocking socket
+// takes every piece before the next one is read, and the answers before it go out once they are durable
+bool relay_node_data(Session& s, InputBuffer& in, size_t length, bool dot_terminated) {
+    ArenaScope arena;
+    string& piece = arena.take();
+    char last = '\n';
+    for (size_t done = 0; done < length;) {
+        uint8_t type;
+        uint32_t part;
+        if (!in.read_frame_header(type, part) || type != FRAME_DATA || part > length - done) return false;
+        for (size_t left = part; left > 0;) {
+            size_t n = min<size_t>(left, OUTPUT_CHUNK_SIZE);
+            piece.clear();
+            if (!in.read_bytes(n, piece)) return false;
+            send_data(s, piece); // a DATA frame of its own in v2
+            last = piece.back();
+            left -= n;
+            done += n;
+            if (!wait_for_commit(s.commit_lsn) || !flush_output(s) || s.output_pending > 0) return false;
+        }
+    }
+    if (dot_terminated) send_response(s, last == '\n' ? ".\n" : "\n.\n"); // indicate end of message
+    return true;
+}
+
+// LIST: the subjects of all messages; LIST <offset> <limit> [newest] [long]: a page of "<id> [<sender> <size>] <subject>"
+// items in id order, or newest first, after "<count> <total>"
+void process_list(Session& s, const vector<string_view>& args) {
+    CommandTimer timer(s, METRIC_LIST);
+    if (proxy_command(s, "LIST", args, false)) return; // the mailbox lives on another node
+    size_t offset = 0, limit = 0;
+    bool newest = false, detailed = false;
+    bool paged = !args.empty();
+    if (paged) {
+        bool valid = args.size() >= 2 && parse_count(args[0], offset) && parse_count(args[1], limit) && limit > 0;
+        for (size_t i = 2; valid && i < args.size(); i++) {
+            if (args[i] == "newest") newest = true;
+            else if (args[i] == "long") detailed = true;
+            else valid = false;
+        }
+        if (!valid) {
+            send_status(s, "ERR"); // unknown paging arguments
+            return;
+        }
+    }
+
+    // shared lock, other readers of this mailbox are not blocked
+    MailboxGuard guard(s.username, false);
+    thread_local vector<IndexEntry> entries; // its entries and their strings are reused by the next LIST of this thread
+    const vector<IndexEntry>& listed = mailbox_entries(guard.mailbox(), s.username, entries);
+    ArenaScope arena;
+
+    if (!paged) {
+        if (s.v2) {
+            send_status(s, arena.concat("OK ", listed.size())); // number of ITEM frames that follow
+        } else {
+            send_item(s, arena.concat(listed.size())); // send number of messages
+        }
+        for (const auto& entry : listed) {
+            send_item(s, entry.subject); // send each subject
+        }
+        return;
+    }
+
+    // the total lets the client page on, ids let it READ or DEL what it sees
+    size_t total = listed.size();
+    size_t count = offset < total ? min(limit, total - offset) : 0;
+    if (s.v2) {
+        send_status(s, arena.concat("OK ", count, " ", total));
+    } else {
+        send_item(s, arena.concat(count, " ", total));
+    }
+    string& item = arena.take();
+    for (size_t i = 0; i < count; i++) {
+        const IndexEntry& entry = newest ? listed[total - 1 - offset - i] : listed[offset + i];
+        assign_parts(item, entry.id, " ");
+        if (detailed) append_parts(item, entry.sender, " ", entry.size, " "); // stored bytes
+        send_item(s, append_parts(item, entry.subject));
+    }
+}
+
+// the index of a mailbox, from memory in the segment store, loaded into loaded otherwise; the caller holds the mailbox lock
+const vector<IndexEntry>& mailbox_entries(MailboxLock& mailbox, const string& name, vector<IndexEntry>& loaded) {
+    if (segment_store) {
+        return load_segment(mailbox, name).index.entries; // already in memory
+    }
+    // the index answers without opening any message file
+    ArenaScope arena;
+    const string& user_dir = arena.concat(mail_spool_dir, "/", name);
+    if (!load_index(user_dir, loaded)) {
+        rebuild_index(user_dir, loaded);
+    }
+    return loaded;
+}
+
+// ids of the stored messages inside the ranges, ascending and at most MAX_MESSAGE_LIST; the caller holds the mailbox lock
+vector<unsigned long> select_messages(MailboxLock& mailbox, const string& name, const vector<pair<unsigned long, unsigned long>>& ranges) {
+    thread_local vector<IndexEntry> entries; // reused like the one of LIST
+    vector<unsigned long> ids;
+    for (const auto& entry : mailbox_entries(mailbox, name, entries)) {
+        for (const auto& range : ranges) {
+            if (entry.id >= range.first && entry.id <= range.second) {
+                ids.push_back(entry.id);
+                break;
+            }
+        }
+        if (ids.size() == MAX_MESSAGE_LIST) break;
+    }
+    return ids;
+}
+
+// SEARCH <word>...: the messages containing every word, "from:", "subject:" or "body:" in front of a word limits it
+// to that field; answers "<count> <total>" and the newest MAX_SEARCH_RESULTS matches like a long LIST
+void process_search(Session& s, const vector<string_view>& args) {
+    CommandTimer timer(s, METRIC_SEARCH);
+    if (proxy_command(s, "SEARCH", args, false)) return;
+
+    // every word of the query becomes the terms it may match, one per field it is looked for in
+    vector<vector<string>> query;
+    for (const auto& arg : args) {
+        for (size_t start = 0; start < arg.length();) { // a v2 argument can hold several words
+            size_t end = min(arg.find(' ', start), arg.length());
+            string word(arg.substr(start, end - start));
+            start = end + 1;
+            string fields = {SEARCH_FIELD_SENDER, SEARCH_FIELD_SUBJECT, SEARCH_FIELD_BODY};
+            for (const auto& qualifier : {make_pair("from:", SEARCH_FIELD_SENDER), make_pair("subject:", SEARCH_FIELD_SUBJECT), make_pair("body:", SEARCH_FIELD_BODY)}) {
+                if (word.compare(0, strlen(qualifier.first), qualifier.first) == 0) {
+                    word = word.substr(strlen(qualifier.first));
+                    fields = string(1, qualifier.second);
+                    break;
+                }
+            }
+            set<string> terms;
+            add_search_terms(terms, ' ', word); // the words as the index has them, "a-b" is two of them
+            for (const auto& term : terms) {
+                vector<string> alternatives;
+                for (char field : fields) {
+                    alternatives.push_back(field + term.substr(1));
+                }
+                query.push_back(move(alternatives));
+            }
+        }
+    }
+    if (query.empty() || query.size() > MAX_SEARCH_WORDS) {
+        send_status(s, "ERR"); // nothing to look for, or too much
+        return;
+    }
+
+    // shared lock, SEND and DEL change the index only under the exclusive one
+    MailboxGuard guard(s.username, false);
+    SearchIndex& index = load_search_index(guard.mailbox(), s.username);
+    vector<unsigned long> matches; // ascending
+    for (size_t i = 0; i < query.size() && (i == 0 || !matches.empty()); i++) {
+        vector<unsigned long> word_matches, merged;
+        for (const auto& term : query[i]) {
+            auto postings = index.postings.find(term);
+            if (postings == index.postings.end()) continue;
+            merged.clear();
+            set_union(word_matches.begin(), word_matches.end(), postings->second.begin(), postings->second.end(), back_inserter(merged));
+            word_matches.swap(merged);
+        }
+        if (i == 0) {
+            matches.swap(word_matches);
+        } else {
+            merged.clear();
+            set_intersection(matches.begin(), matches.end(), word_matches.begin(), word_matches.end(), back_inserter(merged));
+            matches.swap(merged);
+        }
+    }
+
+    // the index entries give the newest matches their sender, size and subject
+    vector<IndexEntry> entries;
+    const vector<IndexEntry>& listed = mailbox_entries(guard.mailbox(), s.username, entries);
+    vector<const IndexEntry*> found;
+    size_t total = 0;
+    for (auto id = matches.rbegin(); id != matches.rend(); ++id) {
+        if (index.deleted.count(*id)) continue;
+        auto entry = lower_bound(listed.begin(), listed.end(), *id, [](const IndexEntry& e, unsigned long id) { return e.id < id; });
+        if (entry == listed.end() || entry->id != *id) continue; // deleted behind the index's back
+        if (found.size() < MAX_SEARCH_RESULTS) found.push_back(&*entry);
+        total++;
+    }
+    ArenaScope arena;
+    if (s.v2) {
+        send_status(s, arena.concat("OK ", found.size(), " ", total));
+    } else {
+        send_item(s, arena.concat(found.size(), " ", total));
+    }
+    string& item = arena.take();
+    for (const IndexEntry* entry : found) {
+        send_item(s, assign_parts(item, entry->id, " ", entry->sender, " ", entry->size, " ", entry->subject));
+    }
+}
+
+void process_read(Session& s, string_view msg_num, bool framed) {
+    CommandTimer timer(s, METRIC_READ);
+    if (is_message_list(msg_num)) {
+        read_messages(s, msg_num, framed);
+        return;
+    }
+    unsigned long id;
+    size_t first, last;
+    if (!parse_message_selector(msg_num, id, first, last) || (last != SIZE_MAX && !framed && !s.v2)) {
+        send_status(s, "ERR"); // not a message id, or a byte range of a dot-terminated READ
+        return;
+    }
+    if (proxy_command(s, "READ", msg_num, framed)) return;
+
+    int fd;
+    off_t offset;
+    size_t length;
+    string inflated; // the message if it is stored compressed, fd is -1 then
+    if (!open_message(s.username, id, false, fd, offset, length, inflated)) {
+        send_status(s, "ERR"); // send error response
+        return;
+    }
+    if (!select_bytes(fd, offset, length, inflated, first, last)) {
+        send_status(s, "ERR"); // the range starts behind the end
+        return;
+    }
+    send_message(s, fd, offset, length, inflated, framed, "");
+}
+
+// READ of a list or range: "OK <count>", then every stored message with its id appended to its status
+void read_messages(Session& s, string_view msg_list, bool framed) {
+    vector<pair<unsigned long, unsigned long>> ranges;
+    if (!parse_message_list(msg_list, ranges)) {
+        send_status(s, "ERR"); // not a list of ids and ranges
+        return;
+    }
+    if (proxy_command(s, "READ", msg_list, framed)) return;
+
+    // all opened under one lock before the count goes out, a message deleted meanwhile is left out
+    struct OpenedMessage {
+        unsigned long id;
+        int fd;
+        off_t offset;
+        size_t length;
+        bool deflated;
+        string inflated;
+    };
+    vector<OpenedMessage> opened;
+    {
+        MailboxGuard guard(s.username, false);
+        vector<unsigned long> ids = select_messages(guard.mailbox(), s.username, ranges);
+        if (segment_store) {
+            for (unsigned long id : ids) {
+                OpenedMessage message{id, -1, 0, 0, false, ""};
+                if (locate_message(guard.mailbox(), s.username, id, false, message.fd, message.offset, message.length, message.deflated)) {
+                    opened.push_back(move(message));
+                }
+            }
+        } else {
+            // one batch opens the message files, a second one those stored compressed
+            ArenaScope arena;
+            string& path = arena.take();
+            FileBatch batch, compressed;
+            for (unsigned long id : ids) {
+                batch.open(assign_parts(path, mail_spool_dir, "/", s.username, "/", id, ".txt"), O_RDONLY);
+            }
+            batch.run();
+            for (size_t i = 0; i < ids.size(); i++) {
+                if (batch.result(i) == -ENOENT) compressed.open(assign_parts(path, mail_spool_dir, "/", s.username, "/", ids[i], ".txt" COMPRESSED_SUFFIX), O_RDONLY);
+            }
+            compressed.run();
+            for (size_t i = 0, c = 0; i < ids.size(); i++) {
+                bool deflated = batch.result(i) == -ENOENT;
+                int fd = deflated ? compressed.result(c++) : batch.result(i);
+                struct stat st;
+                if (fd >= 0 && fstat(fd, &st) != 0) {
+                    close(fd);
+                    fd = -1;
+                }
+                if (fd >= 0) opened.push_back({ids[i], fd, 0, (size_t)st.st_size, deflated, ""});
+            }
+        }
+    }
+
+    // inflated without holding the lock, those sent from memory
+    for (auto message = opened.begin(); message != opened.end();) {
+        if (!message->deflated) {
+            ++message;
+            continue;
+        }
+        bool ok = inflate_range(message->fd, message->offset, message->length, message->inflated);
+        close(message->fd);
+        message->fd = -1;
+        message->length = message->inflated.length();
+        message = ok ? message + 1 : opened.erase(message);
+    }
+    ArenaScope arena;
+    send_status(s, arena.concat("OK ", opened.size()));
+    string& tag = arena.take();
+    for (const auto& message : opened) {
+        send_message(s, message.fd, message.offset, message.length, message.inflated, framed, assign_parts(tag, " ", message.id));
+    }
+}
+
+// one opened message: "OK <length>" and its bytes for FETCH and v2, "OK" and the dot-terminated lines for READ;
+// tag is appended to the status, the session takes ownership of fd
+void send_message(Session& s, int fd, off_t offset, size_t length, const string& inflated, bool framed, string_view tag) {
+    ArenaScope arena;
+    if (framed || s.v2) {
+        // FETCH and v2: byte length, then exactly that many bytes of the message
+        send_status(s, arena.concat("OK ", length, tag));
+        if (fd < 0) {
+            send_data(s, inflated);
+        } else {
+            send_data_file(s, fd, offset, length);
+        }
+        return;
+    }
+
+    // READ: the message lines followed by a single dot, the message already consists of lines
+    char last = '\n';
+    if (fd < 0) {
+        if (length > 0) last = inflated.back();
+    } else if (length > 0 && pread(fd, &last, 1, offset + length - 1) != 1) {
+        last = '\n';
+    }
+    send_status(s, arena.concat("OK", tag)); // send ok response
+    if (fd < 0) {
+        send_response(s, inflated);
+    } else {
+        send_file(s, fd, offset, length);
+    }
+    send_response(s, last == '\n' ? ".\n" : "\n.\n"); // indicate end of message
+}
+
+void process_getfile(Session& s, string_view msg_num) {
+    CommandTimer timer(s, METRIC_GETFILE);
+    unsigned long id;
+    size_t first, last;
+    if (!parse_message_selector(msg_num, id, first, last)) {
+        send_status(s, "ERR"); // not a message id
+        return;
+    }
+    if (proxy_command(s, "GETFILE", msg_num, false)) return;
+
+    int fd;
+    off_t offset;
+    size_t length;
+    string inflated; // the attachment if it is stored compressed, fd is -1 then
+    if (!open_message(s.username, id, true, fd, offset, length, inflated)) {
+        send_status(s, "ERR"); // no such message or no attachment
+        return;
+    }
+    if (!select_bytes(fd, offset, length, inflated, first, last)) {
+        send_status(s, "ERR"); // the range starts behind the end, nothing left to resume
+        return;
+    }
+
+    // byte length, then the stored attachment sent from the page cache
+    ArenaScope arena;
+    send_status(s, arena.concat("OK ", length));
+    if (fd < 0) {
+        send_data(s, inflated);
+    } else {
+        send_data_file(s, fd, offset, length);
+    }
+}
+
+// narrows an opened message or attachment to the bytes first to last, false (and fd closed) if first is behind its end
+bool select_bytes(int fd, off_t& offset, size_t& length, string& inflated, size_t first, size_t last) {
+    if (first > length) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t end = last < length ? last + 1 : length;
+    if (fd < 0) {
+        inflated = inflated.substr(first, end - first);
+    } else {
+        offset += first;
+    }
+    length = end - first;
+    return true;
+}
+
+// opens a message or its attachment for sending, fd is owned by the caller and the bytes are at [offset, offset + length);
+// content stored compressed is returned inflated instead, with fd -1
+bool open_message(const string& mailbox, unsigned long id, bool attachment, int& fd, off_t& offset, size_t& length, string& inflated) {
+    bool deflated; // stored as a gzip stream
+    {
+        // shared lock, only held while opening, a later DEL can't take the open file away
+        MailboxGuard guard(mailbox, false);
+        if (!locate_message(guard.mailbox(), mailbox, id, attachment, fd, offset, length, deflated)) return false;
+    }
+    if (!deflated) return true;
+
+    // inflated without holding the lock, the response is sent from memory
+    bool ok = inflate_range(fd, offset, length, inflated);
+    close(fd);
+    fd = -1;
+    length = inflated.length();
+    return ok;
+}
+
+// opens the stored bytes of a message or its attachment, as open_message() but without inflating them;
+// the caller holds the mailbox lock
+bool locate_message(MailboxLock& mailbox, const string& name, unsigned long id, bool attachment, int& fd, off_t& offset, size_t& length, bool& deflated) {
+    deflated = false;
+    fd = -1;
+    ArenaScope arena;
+    string& filepath = arena.take(); // the message or attachment is a file of its own
+    if (segment_store) {
+        SegmentMailbox& segment = load_segment(mailbox, name);
+        auto entry = find_segment_entry(segment.index, id);
+        if (entry == segment.index.entries.end() || (attachment && entry->attachment.empty())) {
+            return false;
+        }
+        deflated = entry->compression & (attachment ? RECORD_ATTACHMENT_GZIP : RECORD_MESSAGE_GZIP);
+        if (attachment && (entry->compression & RECORD_ATTACHMENT_LINKED)) {
+            append_parts(filepath, mail_spool_dir, "/", name, "/", id, deflated ? ".att" COMPRESSED_SUFFIX : ".att");
+        } else {
+            fd = dup(segment.fd); // a compaction may replace the segment, the duplicate keeps reading this one
+            offset = attachment ? entry->attachment_offset : entry->message_offset;
+            length = attachment ? entry->attachment_size : entry->size;
+        }
+    } else {
+        append_parts(filepath, mail_spool_dir, "/", name, "/", id, attachment ? ".att" : ".txt");
+    }
+    if (!filepath.empty()) {
+        fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0 && errno == ENOENT && !segment_store) {
+            fd = open((filepath += COMPRESSED_SUFFIX).c_str(), O_RDONLY);
+            deflated = true;
+        }
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        offset = 0;
+        length = fd >= 0 ? st.st_size : 0;
+    }
+    return fd >= 0;
+}
+
+// hex sha-256 of everything the context was fed appended to hex, names a blob; frees the context
+void content_hash(EVP_MD_CTX* context, string& hex) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_DigestFinal_ex(context, digest, &length);
+    EVP_MD_CTX_free(context);
+    static const char digits[] = "0123456789abcdef";
+    for (unsigned int i = 0; i < length; i++) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 0xF];
+    }
+}
+
+// links the blob <base> or <base>.gz to a private name if the store has it; if it is swept
+// right after, the SEND still has the content, only the deduplication is lost
+bool pin_blob(const string& base, BlobRef& ref) {
+    ArenaScope arena;
+    string& pin = arena.take();
+    string& blob = arena.take();
+    for (bool deflated : {false, true}) {
+        temp_path(pin);
+        struct stat st;
+        assign_parts(blob, base, deflated ? COMPRESSED_SUFFIX : "");
+        if (link(blob.c_str(), pin.c_str()) == 0) {
+            ref.path = pin;
+            ref.blob.assign(blob, blob.rfind('/') + 1);
+            ref.deflated = deflated;
+            ref.size = stat(pin.c_str(), &st) == 0 ? st.st_size : 0;
+            add_metric(metrics().blobs_reused, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// makes a finished file in transfer a blob, a concurrent SEND of the same content may have been first
+void publish_blob(BlobRef& ref, const string& base) {
+    ArenaScope arena;
+    const string& blob = arena.concat(base, ref.deflated ? COMPRESSED_SUFFIX : "");
+    ref.blob.assign(blob, blob.rfind('/') + 1);
+    if (link(ref.path.c_str(), blob.c_str()) != 0 && errno != EEXIST) {
+        log_errno(LogLevel::ERROR, "blob");
+    }
+    add_metric(metrics().blobs_stored, 1);
+}
+
+// the message file of a SEND, the same header and body are stored only once
+bool store_message_blob(const string& header, const string& body, BlobRef& ref) {
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    EVP_DigestUpdate(context, header.data(), header.length());
+    EVP_DigestUpdate(context, body.data(), body.length());
+    ArenaScope arena;
+    string& base = arena.concat(mail_spool_dir, "/" BLOB_DIRNAME "/");
+    content_hash(context, base);
+    base += ".txt";
+    if (pin_blob(base, ref)) return true;
+
+    string compressed;
+    ref.deflated = compress_message(header, body, compressed);
+    ref.size = ref.deflated ? compressed.length() : header.length() + body.length();
+    temp_path(ref.path);
+    int fd = open(ref.path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    bool saved = fd >= 0 && (ref.deflated ? write_all(fd, compressed) : write_all(fd, header) && write_all(fd, body));
+    if (fd >= 0) close(fd);
+    if (!saved) {
+        log_errno(LogLevel::ERROR, "message file");
+        unlink(ref.path.c_str());
+        ref.path.clear();
+        return false;
+    }
+    publish_blob(ref, base);
+    return true;
+}
+
+// the finished upload of a SEND becomes the blob, compressed if that pays off, or is dropped for an existing blob
+bool store_attachment_blob(string& upload_path, BlobRef& ref) {
+    int fd = open(upload_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        log_errno(LogLevel::ERROR, "upload");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    // read back from the page cache right after the upload wrote it
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+    thread_local vector<char> buffer(COMPRESS_CHUNK_SIZE);
+    ssize_t n;
+    for (off_t offset = 0; (n = pread(fd, buffer.data(), buffer.size(), offset)) > 0; offset += n) {
+        EVP_DigestUpdate(context, buffer.data(), n);
+    }
+    ArenaScope arena;
+    string& base = arena.concat(mail_spool_dir, "/" BLOB_DIRNAME "/");
+    content_hash(context, base);
+    base += ".att";
+    if (n < 0 || pin_blob(base, ref)) {
+        close(fd);
+        return n == 0; // the upload is dropped by the caller
+    }
+
+    ref.path = upload_path;
+    ref.size = st.st_size;
+    upload_path.clear(); // owned by ref now
+    if (compress_level > 0 && (size_t)st.st_size >= compress_min) {
+        string& compressed_path = arena.take();
+        temp_path(compressed_path);
+        int out_fd = open(compressed_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        size_t stored = 0;
+        bool deflated = out_fd >= 0 && compress_file(fd, st.st_size, out_fd, 0, stored) && saved_enough(st.st_size, stored);
+        if (out_fd >= 0) close(out_fd);
+        count_compression(st.st_size, deflated ? stored : st.st_size);
+        if (deflated) {
+            unlink(ref.path.c_str());
+            ref.path = compressed_path;
+            ref.deflated = true;
+            ref.size = stored;
+        } else {
+            unlink(compressed_path.c_str()); // incompressible, stored verbatim
+        }
+    }
+    close(fd);
+    publish_blob(ref, base);
+    return true;
+}
+
+// removes blobs no mailbox links to anymore; a SEND that pinned one meanwhile keeps its content
+void sweep_blobs() {
+    string blob_dir = mail_spool_dir + "/" BLOB_DIRNAME;
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(blob_dir.c_str())) == NULL) return;
+    while ((ent = readdir(dir)) != NULL) {
+        string path = blob_dir + "/" + ent->d_name;
+        struct stat st;
+        if (ent->d_name[0] != '.' && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+}
+
+// a gzip stream is only stored if it is clearly smaller than the verbatim bytes
+bool saved_enough(size_t raw, size_t stored) {
+    return stored * 100 <= raw * (100 - COMPRESS_MIN_SAVING);
+}
+
+void count_compression(size_t raw, size_t stored) {
+    ThreadMetrics& m = metrics();
+    add_metric(m.compress_in, raw);
+    add_metric(m.compress_out, stored);
+}
+
+// deflates header and body into one gzip stream, false if the message is stored verbatim:
+// compression is off, the message is too small or it doesn't shrink enough
+bool compress_message(const string& header, const string& body, string& out) {
+    size_t length = header.length() + body.length();
+    if (compress_level == 0 || length < compress_min) return false;
+
+    auto start = chrono::steady_clock::now();
+    z_stream stream{};
+    if (deflateInit2(&stream, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false; // 15 + 16: gzip
+    out.resize(deflateBound(&stream, length) + 64); // one buffer large enough for the whole stream
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = out.length();
+    int rc = Z_OK;
+    for (const string* part : {&header, &body}) {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(part->data()));
+        stream.avail_in = part->length();
+        rc = deflate(&stream, part == &body ? Z_FINISH : Z_NO_FLUSH);
+    }
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    add_metric(metrics().compress_us, elapsed.count());
+    bool deflated = rc == Z_STREAM_END && saved_enough(length, out.length());
+    count_compression(length, deflated ? out.length() : length);
+    return deflated;
+}
+
+// streams length bytes of in_fd through deflate into out_fd at out_offset, out_length is the size of the gzip stream
+bool compress_file(int in_fd, size_t length, int out_fd, off_t out_offset, size_t& out_length) {
+    auto start = chrono::steady_clock::now();
+    z_stream stream{};
+    if (deflateInit2(&stream, compress_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    vector<char> in(COMPRESS_CHUNK_SIZE), out(COMPRESS_CHUNK_SIZE);
+    off_t in_offset = 0;
+    out_length = 0;
+    int rc = Z_OK;
+    bool ok = true;
+    while (ok && rc != Z_STREAM_END) {
+        ssize_t n = 0;
+        if ((size_t)in_offset < length) {
+            n = pread(in_fd, in.data(), min<size_t>(in.size(), length - in_offset), in_offset);
+            if (n <= 0) break; // error, or the file is shorter than announced
+            in_offset += n;
+        }
+        stream.next_in = reinterpret_cast<Bytef*>(in.data());
+        stream.avail_in = n;
+        int flush = (size_t)in_offset == length ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = out.size();
+            rc = deflate(&stream, flush);
+            size_t produced = out.size() - stream.avail_out;
+            ok = pwrite_all(out_fd, out.data(), produced, out_offset + out_length);
+            out_length += produced;
+        } while (ok && stream.avail_out == 0);
+    }
+    deflateEnd(&stream);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    add_metric(metrics().compress_us, elapsed.count());
+    return ok && rc == Z_STREAM_END;
+}
+
+// inflates the gzip stream at [offset, offset + length) of fd
+bool inflate_range(int fd, off_t offset, size_t length, string& out) {
+    auto start = chrono::steady_clock::now();
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) return false;
+    vector<char> in(COMPRESS_CHUNK_SIZE), chunk(COMPRESS_CHUNK_SIZE);
+    size_t done = 0;
+    int rc = Z_OK;
+    while (rc == Z_OK && done < length) {
+        ssize_t n = pread(fd, in.data(), min<size_t>(in.size(), length - done), offset + done);
+        if (n <= 0) break;
+        done += n;
+        stream.next_in = reinterpret_cast<Bytef*>(in.data());
+        stream.avail_in = n;
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(chunk.data());
+            stream.avail_out = chunk.size();
+            rc = inflate(&stream, Z_NO_FLUSH);
+            out.append(chunk.data(), chunk.size() - stream.avail_out);
+        } while (rc == Z_OK && stream.avail_out == 0);
+    }
+    inflateEnd(&stream);
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    add_metric(metrics().decompress_us, elapsed.count());
+    return rc == Z_STREAM_END;
+}
+
+// inflates the start of a gzip stream, as far as the given bytes reach
+bool inflate_prefix(const char* data, size_t length, string& out) {
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) return false;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = length;
+    vector<char> chunk(COMPRESS_CHUNK_SIZE);
+    int rc;
+    do {
+        stream.next_out = reinterpret_cast<Bytef*>(chunk.data());
+        stream.avail_out = chunk.size();
+        rc = inflate(&stream, Z_NO_FLUSH);
+        out.append(chunk.data(), chunk.size() - stream.avail_out);
+    } while (rc == Z_OK);
+    inflateEnd(&stream);
+    return rc == Z_STREAM_END || rc == Z_BUF_ERROR; // complete, or cut off where the bytes ended
+}
+
+// DEL of one id answers OK or ERR, DEL of a list or range "OK <count>" with the number of deleted messages
+void process_del(Session& s, string_view msg_num) {
+    CommandTimer timer(s, METRIC_DEL);
+    vector<pair<unsigned long, unsigned long>> ranges;
+    if (!parse_message_list(msg_num, ranges)) {
+        send_status(s, "ERR"); // not a message id
+        return;
+    }
+    if (proxy_command(s, "DEL", msg_num, false)) return;
+    bool list = is_message_list(msg_num);
+    string user_dir = mail_spool_dir + "/" + s.username;
+
+    // exclusive lock, nobody may list or read the mailbox while messages disappear
+    MailboxGuard guard(s.username, true);
+    vector<unsigned long> ids;
+    if (list) {
+        ids = select_messages(guard.mailbox(), s.username, ranges);
+    } else {
+        ids.push_back(ranges[0].first);
+    }
+
+    // checked before the removal changes the directory
+    bool index_fresh = !segment_store && index_is_fresh(user_dir);
+
+    vector<unsigned long> deleted;
+    if (segment_store) {
+        for (unsigned long id : ids) {
+            if (append_segment_tombstone(guard.mailbox(), s.username, id)) deleted.push_back(id);
+        }
+    } else {
+        deleted = remove_message_files(user_dir, ids);
+    }
+    for (unsigned long id : deleted) {
+        unindex_message(guard.mailbox(), s.username, id);
+
+        // ids are never used twice, the record of a DEL doesn't have to be ordered against the SEND's
+        if (journal_enabled) {
+            ArenaScope arena;
+            string& record = arena.take();
+            put_journal_field(record, s.username);
+            put_journal_number(record, id);
+            s.commit_lsn = journal_append('D', record);
+        }
+    }
+
+    // one index update for all removed files
+    if (!segment_store && !deleted.empty()) {
+        blob_sweep_due = true; // the blobs may have lost their last mailbox
+        if (index_fresh) {
+            remove_index_entries(user_dir, deleted);
+        } else {
+            vector<IndexEntry> entries;
+            rebuild_index(user_dir, entries);
+        }
+    }
+
+    if (list) {
+        send_status(s, deleted.empty() ? "ERR" : "OK " + to_string(deleted.size()));
+    } else {
+        send_status(s, deleted.empty() ? "ERR" : "OK");
+    }
+}
+
+// files store: the message files and their attachments in one batch, returns the ids that had a message
+vector<unsigned long> remove_message_files(const string& user_dir, const vector<unsigned long>& ids) {
+    FileBatch batch;
+    for (unsigned long id : ids) {
+        string base = user_dir + "/" + to_string(id);
+        for (const char* suffix : {".txt", ".txt" COMPRESSED_SUFFIX, ".att", ".att" COMPRESSED_SUFFIX}) {
+            batch.unlink(base + suffix); // only one of each pair exists
+        }
+    }
+    batch.run();
+    vector<unsigned long> removed;
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (batch.result(4 * i) == 0 || batch.result(4 * i + 1) == 0) removed.push_back(ids[i]);
+    }
+    return removed;
+}
+
+// reads the persisted counter, falls back to the highest id on disk + 1 if it is missing
+unsigned long load_next_id(const string& user_dir) {
+    unsigned long next_id = 1;
+    char buffer[32] = {0};
+    int fd = open((user_dir + "/" NEXT_ID_FILENAME).c_str(), O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, buffer, sizeof(buffer) - 1) > 0) next_id = max(next_id, strtoul(buffer, nullptr, 10));
+        close(fd);
+    }
+
+    // one scan per mailbox and server run, protects against a lost or older counter file
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(user_dir.c_str())) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            char* end;
+            unsigned long id = strtoul(ent->d_name, &end, 10);
+            if (end != ent->d_name && (strcmp(end, ".txt") == 0 || strcmp(end, ".txt" COMPRESSED_SUFFIX) == 0)) next_id = max(next_id, id + 1);
+        }
+        closedir(dir);
+    }
+    return next_id;
+}
+
+// hands out the next id of a mailbox, the caller holds the mailbox lock exclusively
+unsigned long allocate_message_id(MailboxLock& mailbox, const string& user_dir) {
+    if (mailbox.next_id == 0) {
+        mailbox.next_id = load_next_id(user_dir);
+    }
+    unsigned long id = mailbox.next_id++;
+    persist_next_id(user_dir, mailbox.next_id); // before the id is used, so a restart never hands it out again
+    return id;
+}
+
+void persist_next_id(const string& user_dir, unsigned long next_id) {
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%020lu\n", next_id);
+    ArenaScope arena;
+    int fd = open(arena.concat(user_dir, "/" NEXT_ID_FILENAME).c_str(), O_WRONLY | O_CREAT, 0666);
+    if (fd < 0 || pwrite(fd, buffer, length, 0) != length) {
+        log_errno(LogLevel::ERROR, "id counter");
+    }
+    if (fd >= 0) close(fd);
+}
+
+bool parse_message_id(string_view text, unsigned long& id) {
+    if (text.empty() || text.length() > 19 || text.find_first_not_of("0123456789") != string_view::npos) {
+        return false; // also keeps paths like "../x" out of the spool lookups
+    }
+    from_chars(text.data(), text.data() + text.length(), id);
+    return id > 0;
+}
+
+// "<id>" or ids and ranges separated by commas like "1-5,9", at most MAX_MESSAGE_LIST parts
+bool parse_message_list(string_view text, vector<pair<unsigned long, unsigned long>>& ranges) {
+    for (size_t start = 0; start <= text.length();) {
+        size_t end = min(text.find(',', start), text.length());
+        string_view part = text.substr(start, end - start);
+        size_t dash = part.find('-');
+        unsigned long first, last;
+        if (!parse_message_id(part.substr(0, dash), first)) return false;
+        if (dash == string_view::npos) {
+            last = first;
+        } else if (!parse_message_id(part.substr(dash + 1), last) || last < first) {
+            return false;
+        }
+        ranges.emplace_back(first, last);
+        start = end + 1;
+    }
+    return ranges.size() <= MAX_MESSAGE_LIST;
+}
+
+// "<id>" or "<id>:<first>-[<last>]", byte offsets like an HTTP range with last included; last is SIZE_MAX without a range
+bool parse_message_selector(string_view text, unsigned long& id, size_t& first, size_t& last) {
+    size_t colon = text.find(':');
+    first = 0;
+    last = SIZE_MAX;
+    if (!parse_message_id(text.substr(0, colon), id)) return false;
+    if (colon == string_view::npos) return true;
+    string_view range = text.substr(colon + 1);
+    size_t dash = range.find('-');
+    if (dash == string_view::npos || !parse_count(range.substr(0, dash), first)) return false;
+    return dash + 1 == range.length() || (parse_count(range.substr(dash + 1), last) && last >= first);
+}
+
+// a non-negative decimal number, e.g. a LIST offset or a byte position
+bool parse_count(string_view text, size_t& count) {
+    if (text.empty() || text.length() > 18 || text.find_first_not_of("0123456789") != string_view::npos) return false;
+    from_chars(text.data(), text.data() + text.length(), count);
+    return true;
+}
+
+bool write_all(int fd, const char* data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const string& data) {
+    return write_all(fd, data.data(), data.length());
+}
+
+size_t FileBatch::add(FileOp op) {
+    ops.push_back(move(op));
+    return ops.size() - 1;
+}
+
+size_t FileBatch::open(const string& path, int flags, mode_t mode) {
+    FileOp op;
+    op.opcode = IORING_OP_OPENAT;
+    op.path = path;
+    op.flags = flags | O_CLOEXEC;
+    op.mode = mode;
+    return add(move(op));
+}
+
+size_t FileBatch::read(int fd, char* buffer, size_t length, off_t offset) {
+    FileOp op;
+    op.opcode = IORING_OP_READ;
+    op.fd = fd;
+    op.buffer = buffer;
+    op.length = length;
+    op.offset = offset;
+    return add(move(op));
+}
+
+size_t FileBatch::write(int fd, const char* data, size_t length, off_t offset) {
+    FileOp op;
+    op.opcode = IORING_OP_WRITE;
+    op.fd = fd;
+    op.buffer = const_cast<char*>(data); // only read
+    op.length = length;
+    op.offset = offset;
+    return add(move(op));
+}
+
+size_t FileBatch::fsync(int fd) {
+    FileOp op;
+    op.opcode = IORING_OP_FSYNC;
+    op.fd = fd;
+    return add(move(op));
+}
+
+size_t FileBatch::datasync(int fd) {
+    FileOp op;
+    op.opcode = IORING_OP_FSYNC;
+    op.fd = fd;
+    op.flags = IORING_FSYNC_DATASYNC;
+    return add(move(op));
+}
+
+size_t FileBatch::unlink(const string& path) {
+    FileOp op;
+    op.opcode = IORING_OP_UNLINKAT;
+    op.path = path;
+    return add(move(op));
+}
+
+size_t FileBatch::close(int fd) {
+    FileOp op;
+    op.opcode = IORING_OP_CLOSE;
+    op.fd = fd;
+    return add(move(op));
+}
+
+void FileBatch::then(bool on_success) {
+    ops.back().link = on_success ? IOSQE_IO_LINK : IOSQE_IO_HARDLINK;
+}
+
+void FileBatch::run() {
+    if (ops.empty()) return;
+    add_metric(metrics().file_batches, 1);
+    add_metric(metrics().file_ops, ops.size());
+    if (io_uring_enabled && !file_ring.tried) {
+        file_ring.tried = true;
+        if (!open_file_ring(file_ring)) log_event(LogLevel::WARN, "event=io_uring_unavailable fallback=blocking");
+    }
+
+    // submitted in parts that fit the ring, a part never ends inside a chain of linked operations
+    for (size_t first = 0; first < ops.size();) {
+        size_t last = first;
+        for (size_t i = first; i < ops.size() && i - first < FILE_RING_ENTRIES; i++) {
+            if (!ops[i].link) last = i + 1;
+        }
+        if (last == first) last = min(ops.size(), first + FILE_RING_ENTRIES); // a chain longer than the ring
+        if (file_ring.fd >= 0) {
+            submit(first, last);
+        } else {
+            run_blocking(first, last);
+        }
+        first = last;
+    }
+}
+
+void FileBatch::submit(size_t first, size_t last) {
+    FileRing& ring = file_ring;
+    unsigned tail = *ring.sq_tail; // only this thread adds to the queue
+    unsigned queued = tail; // where this part starts in the submission queue
+    for (size_t i = first; i < last; i++) {
+        const FileOp& op = ops[i];
+        io_uring_sqe& sqe = ring.sqes[tail & ring.sq_mask];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op.opcode;
+        sqe.fd = op.fd;
+        sqe.flags = op.link;
+        sqe.user_data = i;
+        switch (op.opcode) {
+            case IORING_OP_OPENAT:
+            case IORING_OP_UNLINKAT:
+                sqe.fd = AT_FDCWD;
+                sqe.addr = (uintptr_t)op.path.c_str();
+                sqe.len = op.mode;
+                sqe.open_flags = op.flags;
+                break;
+            case IORING_OP_READ:
+            case IORING_OP_WRITE:
+                sqe.addr = (uintptr_t)op.buffer;
+                sqe.len = op.length;
+                sqe.off = (uint64_t)op.offset; // -1 is the file position
+                if (op.opcode == IORING_OP_READ && ring.buffer_registered && op.buffer >= ring.buffer
+                    && op.buffer + op.length <= ring.buffer + FILE_RING_BUFFER_SIZE) {
+                    sqe.opcode = IORING_OP_READ_FIXED; // the buffer is pinned once, not for every read
+                    sqe.buf_index = 0;
+                }
+                break;
+            case IORING_OP_FSYNC:
+                sqe.fsync_flags = op.flags;
+                break;
+        }
+        ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+        tail++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    // submits and waits in one call, again if a signal interrupted it
+    size_t done = 0;
+    while (done < last - first) {
+        unsigned unsubmitted = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        bool failed = syscall(__NR_io_uring_enter, ring.fd, unsubmitted, last - first - done, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY;
+        int error = errno;
+        unsigned head = *ring.cq_head;
+        for (; head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE); head++) {
+            const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+            ops[cqe.user_data].result = cqe.res;
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        if (!failed) continue;
+
+        errno = error;
+        size_t consumed = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) - queued;
+        if (consumed > done) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE); // the kernel owns the operations in flight, they can't be run a second time
+        }
+        // nothing of this part is in flight: the rest runs blocking, and so does everything after it on this thread
+        log_errno(LogLevel::WARN, "io_uring_enter");
+        log_event(LogLevel::WARN, "event=io_uring_failed fallback=blocking");
+        close_file_ring(ring);
+        run_blocking(first + consumed, last);
+        return;
+    }
+}
+
+// the same operations one after the other, with the same results as the ring
+void FileBatch::run_blocking(size_t first, size_t last) {
+    bool cancelled = false; // an operation this one is linked to failed
+    for (size_t i = first; i < last; i++) {
+        FileOp& op = ops[i];
+        long rc = -1;
+        errno = ECANCELED;
+        if (!cancelled) {
+            switch (op.opcode) {
+                case IORING_OP_OPENAT:
+                    rc = ::open(op.path.c_str(), op.flags, op.mode);
+                    break;
+                case IORING_OP_READ:
+                    rc = pread(op.fd, op.buffer, op.length, op.offset);
+                    break;
+                case IORING_OP_WRITE:
+                    rc = op.offset < 0 ? ::write(op.fd, op.buffer, op.length) : pwrite(op.fd, op.buffer, op.length, op.offset);
+                    break;
+                case IORING_OP_FSYNC:
+                    rc = op.flags & IORING_FSYNC_DATASYNC ? fdatasync(op.fd) : ::fsync(op.fd);
+                    break;
+                case IORING_OP_UNLINKAT:
+                    rc = ::unlink(op.path.c_str());
+                    break;
+                case IORING_OP_CLOSE:
+                    rc = ::close(op.fd);
+                    break;
+            }
+        }
+        op.result = rc < 0 ? -errno : rc;
+
+        // like the ring, a short read or write counts as failed for the operations linked to it
+        bool failed = op.result < 0 || ((op.opcode == IORING_OP_READ || op.opcode == IORING_OP_WRITE) && (size_t)op.result < op.length);
+        if (!op.link) {
+            cancelled = false; // end of the chain
+        } else if (op.link == IOSQE_IO_LINK && failed) {
+            cancelled = true;
+        }
+    }
+}
+
+char* FileBatch::buffer() {
+    FileRing& ring = file_ring;
+    if (ring.buffer) return ring.buffer;
+    ring.buffer = (char*)mmap(nullptr, FILE_RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buffer == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (io_uring_enabled && !ring.tried) {
+        ring.tried = true;
+        open_file_ring(ring);
+    }
+    if (ring.fd >= 0) {
+        // counts against the locked memory limit, reads into an unregistered buffer work as well
+        iovec area = {ring.buffer, FILE_RING_BUFFER_SIZE};
+        ring.buffer_registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &area, 1) == 0;
+    }
+    return ring.buffer;
+}
+
+// sets up an io_uring for FileBatch, false if the kernel lacks it or one of the operations
+bool open_file_ring(FileRing& ring) {
+    io_uring_params params{};
+    ring.fd = syscall(__NR_io_uring_setup, FILE_RING_ENTRIES, &params);
+    if (ring.fd < 0) return false;
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+    vector<char> probe_buffer(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+    bool supported = (params.features & needed) == needed
+        && syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (int op : {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_UNLINKAT, IORING_OP_CLOSE}) {
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // one mapping holds both queue rings, the submission entries are a second one
+    if (supported) {
+        ring.rings_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring.rings = mmap(nullptr, ring.rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+        ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        ring.sqes = (io_uring_sqe*)mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+        supported = ring.rings != MAP_FAILED && ring.sqes != MAP_FAILED;
+    }
+    if (!supported) {
+        if (ring.rings != MAP_FAILED) munmap(ring.rings, ring.rings_size);
+        if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_size);
+        ring.rings = MAP_FAILED;
+        ring.sqes = (io_uring_sqe*)MAP_FAILED;
+        ::close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+    char* base = (char*)ring.rings;
+    ring.sq_head = (unsigned*)(base + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(base + params.sq_off.array);
+    ring.cq_head = (unsigned*)(base + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+    return true;
+}
+
+// sets a ring aside, FileBatch makes blocking calls from then on
+void close_file_ring(FileRing& ring) {
+    if (ring.fd < 0) return;
+    munmap(ring.rings, ring.rings_size);
+    munmap(ring.sqes, ring.sqes_size);
+    ::close(ring.fd);
+    ring.fd = -1;
+    ring.buffer_registered = false;
+}
+
+FileRing::~FileRing() {
+    close_file_ring(*this);
+    if (buffer) munmap(buffer, FILE_RING_BUFFER_SIZE);
+}
+
+// directory modification time in nanoseconds, any file created or removed in the mailbox changes it
+unsigned long long directory_stamp(const string& user_dir) {
+    struct stat st;
+    if (stat(user_dir.c_str(), &st) != 0) return 0;
+    return (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+// rewrites the fixed-size header in place, which doesn't touch the directory itself
+void stamp_index(int fd, const string& user_dir) {
+    char header[INDEX_HEADER_SIZE + 1];
+    snprintf(header, sizeof(header), INDEX_MAGIC "%020llu\n", directory_stamp(user_dir));
+    if (pwrite(fd, header, INDEX_HEADER_SIZE, 0) != INDEX_HEADER_SIZE) {
+        log_errno(LogLevel::ERROR, "index header");
+    }
+}
+
+// the index is fresh if its stamp matches the directory, i.e. nothing changed since the server last wrote it
+bool index_is_fresh(const string& user_dir) {
+    ArenaScope arena;
+    int fd = open(arena.concat(user_dir, "/" INDEX_FILENAME).c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    char header[INDEX_HEADER_SIZE];
+    bool fresh = pread(fd, header, INDEX_HEADER_SIZE, 0) == INDEX_HEADER_SIZE
+        && memcmp(header, INDEX_MAGIC, strlen(INDEX_MAGIC)) == 0
+        && strtoull(header + strlen(INDEX_MAGIC), nullptr, 10) == directory_stamp(user_dir);
+    close(fd);
+    return fresh;
+}
+
+// index line: id, size, timestamp, sender, attachment and subject separated by tabs, appended to out
+void format_index_entry(const IndexEntry& entry, string& out) {
+    auto append_clean = [&out](const string& field) {
+        size_t start = out.length();
+        out += field;
+        for (size_t i = start; i < out.length(); i++) {
+            if (out[i] == '\t' || out[i] == '\n') out[i] = ' '; // keep the separators unambiguous
+        }
+        out += '\t';
+    };
+    append_parts(out, entry.id, "\t", entry.size, "\t", entry.timestamp, "\t");
+    append_clean(entry.sender);
+    append_clean(entry.attachment);
+    append_clean(entry.subject);
+    out.back() = '\n';
+}
+
+bool parse_index_entry(const char* line, size_t length, IndexEntry& entry) {
+    const char* end = line + length;
+    const char* fields[6];
+    size_t lengths[6];
+    for (int i = 0; i < 6; i++) {
+        // the subject is the last field and may contain anything but a newline
+        const char* tab = i < 5 ? static_cast<const char*>(memchr(line, '\t', end - line)) : end;
+        if (tab == nullptr) return false;
+        fields[i] = line;
+        lengths[i] = tab - line;
+        line = tab + 1;
+    }
+    entry.id = strtoul(fields[0], nullptr, 10); // the numbers end at their tabs
+    entry.size = strtoull(fields[1], nullptr, 10);
+    entry.timestamp = strtoll(fields[2], nullptr, 10);
+    entry.sender.assign(fields[3], lengths[3]);
+    entry.attachment.assign(fields[4], lengths[4]);
+    entry.subject.assign(fields[5], lengths[5]);
+    return true;
+}
+
+// maps the index and parses it, returns false if it is missing, damaged or (when checked) stale
+bool load_index(const string& user_dir, vector<IndexEntry>& entries, bool check_stamp) {
+    ArenaScope arena;
+    int fd = open(arena.concat(user_dir, "/" INDEX_FILENAME).c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < INDEX_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (mapped == MAP_FAILED) return false;
+
+    const char* data = static_cast<const char*>(mapped);
+    const char* end = data + st.st_size;
+    bool valid = memcmp(data, INDEX_MAGIC, strlen(INDEX_MAGIC)) == 0
+        && (!check_stamp || strtoull(data + strlen(INDEX_MAGIC), nullptr, 10) == directory_stamp(user_dir));
+
+    // parsed over the entries already there, a reused vector keeps the buffers of their strings
+    size_t count = 0;
+    for (const char* line = data + INDEX_HEADER_SIZE; valid && line < end;) {
+        const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (count == entries.size()) entries.emplace_back();
+        if (newline == nullptr || !parse_index_entry(line, newline - line, entries[count])) {
+            valid = false; // torn write, rebuild
+            break;
+        }
+        count++;
+        line = newline + 1;
+    }
+    entries.resize(count);
+
+    munmap(mapped, st.st_size);
+    return valid;
+}
+
+// writes a complete index to a temporary file and renames it over the old one
+bool write_index(const string& user_dir, const vector<IndexEntry>& entries) {
+    static atomic<unsigned long> tmp_counter{0};
+    string tmp_path = user_dir + "/" INDEX_FILENAME "." + to_string(getpid()) + "." + to_string(tmp_counter++);
+    string content(INDEX_HEADER_SIZE, ' '); // header is stamped after the rename
+    for (const auto& entry : entries) {
+        format_index_entry(entry, content);
+    }
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        log_errno(LogLevel::ERROR, "index");
+        return false;
+    }
+    bool ok = write(fd, content.data(), content.length()) == (ssize_t)content.length();
+    if (!ok || rename(tmp_path.c_str(), (user_dir + "/" INDEX_FILENAME).c_str()) != 0) {
+        log_errno(LogLevel::ERROR, "index");
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    stamp_index(fd, user_dir); // the rename changed the directory, stamp its new state
+    close(fd);
+    return true;
+}
+
+// reads the headers of every message file once and writes a fresh index
+bool rebuild_index(const string& user_dir, vector<IndexEntry>& entries) {
+    entries.clear();
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(user_dir.c_str())) == NULL) {
+        return false; // no mailbox yet
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        // only message files <id>.txt or <id>.txt.gz, not attachments or the index
+        char* end;
+        unsigned long id = strtoul(ent->d_name, &end, 10);
+        if (ent->d_type != DT_REG || end == ent->d_name || (strcmp(end, ".txt") != 0 && strcmp(end, ".txt" COMPRESSED_SUFFIX) != 0)) continue;
+
+        string filepath = user_dir + "/" + ent->d_name;
+        struct stat st;
+        gzFile msg_file = gzopen(filepath.c_str(), "rb"); // reads uncompressed files as they are
+        if (msg_file == NULL) continue;
+        if (stat(filepath.c_str(), &st) != 0) {
+            gzclose(msg_file);
+            continue;
+        }
+
+        IndexEntry entry;
+        entry.id = id;
+        entry.size = st.st_size;
+        entry.timestamp = st.st_mtime;
+        char buffer[BUFFER_SIZE];
+        string line;
+        for (int i = 0; i < 4 && gzgets(msg_file, buffer, sizeof(buffer)) != NULL;) {
+            line += buffer;
+            if (line.back() != '\n') continue; // longer than the buffer
+            line.pop_back();
+            if (line.find("From: ") == 0) entry.sender = line.substr(6);
+            else if (line.find("Subject: ") == 0) entry.subject = line.substr(9);
+            else if (line.find("Filename: ") == 0) entry.attachment = line.substr(10);
+            line.clear();
+            i++;
+        }
+        gzclose(msg_file);
+        entries.push_back(move(entry));
+    }
+    closedir(dir);
+
+    sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.id < b.id; });
+    return write_index(user_dir, entries);
+}
+
+// appends one entry, only valid while the index is fresh
+void append_index_entry(const string& user_dir, const IndexEntry& entry) {
+    ArenaScope arena;
+    int fd = open(arena.concat(user_dir, "/" INDEX_FILENAME).c_str(), O_WRONLY);
+    if (fd < 0) return;
+    struct stat st;
+    string& line = arena.take();
+    format_index_entry(entry, line);
+    if (fstat(fd, &st) == 0 && pwrite(fd, line.data(), line.length(), st.st_size) == (ssize_t)line.length()) {
+        stamp_index(fd, user_dir); // only now the index covers the new message file
+    }
+    close(fd);
+}
+
+// drops the entries of ids (ascending) by rewriting the index, only valid if it was fresh before the message files were removed
+void remove_index_entries(const string& user_dir, const vector<unsigned long>& ids) {
+    vector<IndexEntry> entries;
+    if (!load_index(user_dir, entries, false)) {
+        rebuild_index(user_dir, entries);
+        return;
+    }
+    entries.erase(remove_if(entries.begin(), entries.end(), [&ids](const IndexEntry& e) {
+        return binary_search(ids.begin(), ids.end(), e.id);
+    }), entries.end());
+    write_index(user_dir, entries);
+}
+
+// loads the search index of a mailbox on first use and adds the messages it misses, e.g. those stored before the
+// mailbox was first searched or replayed from the journal; the caller holds the mailbox lock, shared or exclusive
+SearchIndex& load_search_index(MailboxLock& mailbox, const string& name) {
+    SearchIndex& index = mailbox.search;
+    if (index.loaded.load(memory_order_acquire)) return index;
+    lock_guard<mutex> lock(index.load_mutex);
+    if (index.loaded.load(memory_order_relaxed)) return index;
+
+    string path = mail_spool_dir + "/" + name + "/" SEARCH_FILENAME;
+    ifstream file(path, ios::binary);
+    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    file.close();
+
+    // "+<id> <term>..." and "-<id>" lines up to the first incomplete one, the rest of an interrupted append is cut off
+    bool complete = content.compare(0, strlen(SEARCH_MAGIC), SEARCH_MAGIC) == 0;
+    unordered_set<unsigned long> indexed;
+    size_t valid = strlen(SEARCH_MAGIC);
+    while (complete && valid < content.length()) {
+        size_t newline = content.find('\n', valid);
+        if (newline == string::npos) break;
+        size_t terms = min(content.find(' ', valid), newline);
+        unsigned long id;
+        char type = content[valid];
+        if ((type != '+' && type != '-') || !parse_message_id(content.substr(valid + 1, terms - valid - 1), id)) break;
+        if (type == '-') {
+            index.deleted.insert(id);
+        } else if (indexed.insert(id).second) {
+            add_search_entry(index, id, string_view(content).substr(terms, newline - terms));
+        }
+        valid = newline + 1;
+    }
+    if (complete && valid < content.length() && truncate(path.c_str(), valid) != 0) {
+        log_errno(LogLevel::ERROR, "search index");
+    }
+
+    // messages the index lacks are read once, messages gone without a DEL are marked deleted
+    vector<IndexEntry> entries;
+    vector<const IndexEntry*> unindexed;
+    unordered_set<unsigned long> live;
+    for (const auto& entry : mailbox_entries(mailbox, name, entries)) {
+        live.insert(entry.id);
+        if (!indexed.count(entry.id)) unindexed.push_back(&entry);
+    }
+    string missing;
+    for (const auto& message : message_search_terms(mailbox, name, unindexed)) {
+        add_search_entry(index, message.first, message.second);
+        missing += format_search_entry(message.first, message.second);
+    }
+    for (unsigned long id : indexed) {
+        if (!live.count(id) && index.deleted.insert(id).second) missing += "-" + to_string(id) + "\n";
+    }
+
+    if (!complete || search_compaction_due(index)) {
+        write_search_index(index, name); // new, or rewritten without the deleted messages
+    } else if (!missing.empty()) {
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0 || !write_all(fd, missing)) log_errno(LogLevel::ERROR, "search index");
+        if (fd >= 0) close(fd);
+    }
+    index.loaded.store(true, memory_order_release);
+    return index;
+}
+
+// ids and terms of stored messages, their senders and subjects from the index entries; the caller holds the mailbox lock.
+// The first SEARCH_READ_SIZE stored bytes of the messages are read in batches into the thread's FileBatch buffer,
+// a compressed message is inflated as far as they go
+vector<pair<unsigned long, string>> message_search_terms(MailboxLock& mailbox, const string& name, const vector<const IndexEntry*>& entries) {
+    vector<pair<unsigned long, string>> terms;
+    char* buffer = FileBatch::buffer();
+    const size_t slots = FILE_RING_BUFFER_SIZE / SEARCH_READ_SIZE;
+    for (size_t first = 0; first < entries.size(); first += slots) {
+        FileBatch batch;
+        vector<pair<const IndexEntry*, bool>> reads; // message and whether it is deflated, one per slot
+        for (size_t i = first; i < entries.size() && i < first + slots; i++) {
+            int fd;
+            off_t offset;
+            size_t length;
+            bool deflated;
+            if (!locate_message(mailbox, name, entries[i]->id, false, fd, offset, length, deflated)) continue;
+            batch.read(fd, buffer + reads.size() * SEARCH_READ_SIZE, min<size_t>(length, SEARCH_READ_SIZE), offset);
+            batch.then(false); // closed after the read, whether it worked or not
+            batch.close(fd);
+            reads.emplace_back(entries[i], deflated);
+        }
+        batch.run();
+
+        for (size_t r = 0; r < reads.size(); r++) {
+            int n = batch.result(2 * r);
+            string message;
+            if (n < 0 || (reads[r].second && !inflate_prefix(buffer + r * SEARCH_READ_SIZE, n, message))) continue;
+            if (!reads[r].second) message.assign(buffer + r * SEARCH_READ_SIZE, n);
+            const IndexEntry& entry = *reads[r].first;
+            terms.emplace_back(entry.id, format_search_terms(entry.sender, entry.subject, message.substr(message_body_offset(message))));
+        }
+    }
+    return terms;
+}
+
+// adds the space separated terms of one message to the postings
+void add_search_entry(SearchIndex& index, unsigned long id, string_view terms) {
+    for (size_t start = 0; start < terms.length();) {
+        size_t end = min(terms.find(' ', start), terms.length());
+        if (end > start) {
+            vector<unsigned long>& ids = index.postings[string(terms.substr(start, end - start))];
+            if (ids.empty() || ids.back() < id) {
+                ids.push_back(id); // new messages have the highest ids
+            } else {
+                auto position = lower_bound(ids.begin(), ids.end(), id);
+                if (*position != id) ids.insert(position, id);
+            }
+        }
+        start = end + 1;
+    }
+    index.messages++;
+}
+
+// SEND: appends the line of a new message to the index file and the postings, only if the mailbox has an index,
+// a mailbox without one gets it complete on its first SEARCH; the caller holds the mailbox lock exclusively
+void index_message(MailboxLock& mailbox, const string& name, unsigned long id, const string& terms) {
+    ArenaScope arena;
+    int fd = open(arena.concat(mail_spool_dir, "/", name, "/" SEARCH_FILENAME).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+        string& line = arena.take();
+        format_search_entry(id, terms, line);
+        if (!write_all(fd, line)) log_errno(LogLevel::ERROR, "search index");
+        close(fd);
+    }
+    if (mailbox.search.loaded.load(memory_order_acquire)) add_search_entry(mailbox.search, id, terms);
+}
+
+// DEL: records the deletion in the index file and the postings, which are rewritten once mostly deleted messages
+// remain; the caller holds the mailbox lock exclusively
+void unindex_message(MailboxLock& mailbox, const string& name, unsigned long id) {
+    int fd = open((mail_spool_dir + "/" + name + "/" SEARCH_FILENAME).c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+        if (!write_all(fd, "-" + to_string(id) + "\n")) log_errno(LogLevel::ERROR, "search index");
+        close(fd);
+    }
+    SearchIndex& index = mailbox.search;
+    if (!index.loaded.load(memory_order_acquire)) return;
+    index.deleted.insert(id);
+    if (search_compaction_due(index)) write_search_index(index, name);
+}
+
+// worth rewriting once most indexed messages are deleted
+bool search_compaction_due(const SearchIndex& index) {
+    return index.deleted.size() >= SEARCH_COMPACT_MIN && index.deleted.size() * 2 > index.messages;
+}
+
+// drops the deleted messages from the postings and replaces the index file with their state
+bool write_search_index(SearchIndex& index, const string& name) {
+    map<unsigned long, string> lines; // id -> terms
+    for (auto postings = index.postings.begin(); postings != index.postings.end();) {
+        vector<unsigned long>& ids = postings->second;
+        ids.erase(remove_if(ids.begin(), ids.end(), [&index](unsigned long id) { return index.deleted.count(id) > 0; }), ids.end());
+        if (ids.empty()) {
+            postings = index.postings.erase(postings);
+            continue;
+        }
+        for (unsigned long id : ids) {
+            lines[id] += " " + postings->first;
+        }
+        ++postings;
+    }
+    index.deleted.clear();
+    index.messages = lines.size();
+
+    string content = SEARCH_MAGIC;
+    for (const auto& line : lines) {
+        content += format_search_entry(line.first, line.second);
+    }
+
+    // the rename changes the directory, a fresh message index is stamped again
+    string user_dir = mail_spool_dir + "/" + name;
+    bool index_fresh = !segment_store && index_is_fresh(user_dir);
+    static atomic<unsigned long> tmp_counter{0};
+    string tmp_path = user_dir + "/" SEARCH_FILENAME "." + to_string(getpid()) + "." + to_string(tmp_counter++);
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool ok = fd >= 0 && write_all(fd, content);
+    if (fd < 0 && errno == ENOENT) return false; // the mailbox never got a message
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmp_path.c_str(), (user_dir + "/" SEARCH_FILENAME).c_str()) != 0) {
+        log_errno(LogLevel::ERROR, "search index");
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (index_fresh) {
+        fd = open((user_dir + "/" INDEX_FILENAME).c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            stamp_index(fd, user_dir);
+            close(fd);
+        }
+    }
+    return true;
+}
+
+// segment store: loads a mailbox file on first use, its offset index then stays in memory
+SegmentMailbox& load_segment(MailboxLock& mailbox, const string& name) {
+    SegmentMailbox& segment = mailbox.segment;
+    if (segment.loaded.load(memory_order_acquire)) return segment;
+    lock_guard<mutex> lock(segment.load_mutex);
+    if (segment.loaded.load(memory_order_relaxed)) return segment;
+
+    string path = mail_spool_dir + "/" + name + "/" SEGMENT_FILENAME;
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd >= 0) {
+        char header[SEGMENT_HEADER_SIZE];
+        uint64_t next_id;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && pread(fd, header, SEGMENT_HEADER_SIZE, 0) == SEGMENT_HEADER_SIZE
+            && parse_segment_header(header, next_id)) {
+            segment.fd = fd;
+            segment.index.next_id = max<unsigned long>(1, next_id);
+            segment.end = scan_segment(fd, SEGMENT_HEADER_SIZE, st.st_size, segment.index);
+            if (segment.end < st.st_size) {
+                // a SEND or DEL was interrupted by a crash, it was never answered with OK
+                log_event(LogLevel::WARN, "event=segment path=%s dropped_bytes=%lld", path.c_str(), (long long)(st.st_size - segment.end));
+                if (ftruncate(fd, segment.end) != 0) log_errno(LogLevel::ERROR, "segment");
+            }
+            if (compaction_due(segment.index)) {
+                lock_guard<mutex> lock(compaction_mutex);
+                compaction_queue.insert(name);
+            }
+        } else {
+            log_event(LogLevel::ERROR, "event=segment path=%s error=\"not a mailbox segment, the mailbox is left unchanged\"", path.c_str());
+            close(fd);
+            segment.damaged = true;
+        }
+    } else if (errno != ENOENT) {
+        log_errno(LogLevel::ERROR, "segment");
+        segment.damaged = true;
+    }
+    segment.loaded.store(true, memory_order_release);
+    return segment;
+}
+
+// bytes of a message's record, from its header to the end of the attachment
+uint64_t segment_record_length(const IndexEntry& entry) {
+    return entry.attachment_offset + entry.attachment_size - entry.record_offset;
+}
+
+bool compaction_due(const SegmentIndex& index) {
+    return index.dead_bytes >= SEGMENT_COMPACT_MIN_BYTES && index.dead_bytes >= index.live_bytes;
+}
+
+// applies the records in [from, size) to the index, returns the end of the last complete record
+off_t scan_segment(int fd, off_t from, off_t size, SegmentIndex& index) {
+    char buffer[RECORD_HEADER_SIZE + SEGMENT_SCAN_PREFETCH];
+    string meta;
+    off_t offset = from;
+    while (offset + RECORD_HEADER_SIZE <= size) {
+        // the header and usually the whole meta in one read, the payload is skipped
+        ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+        RecordHeader record;
+        if (n < RECORD_HEADER_SIZE || !parse_record_header(buffer, record)) break;
+        uint64_t length = record.record_length();
+        if (length > (uint64_t)(size - offset)) break; // torn write
+
+        if (record.type == RECORD_TOMBSTONE) {
+            auto entry = find_segment_entry(index, record.id);
+            if (entry != index.entries.end()) {
+                index.live_bytes -= segment_record_length(*entry);
+                index.dead_bytes += segment_record_length(*entry);
+                index.entries.erase(entry);
+            }
+            index.dead_bytes += length;
+        } else {
+            if (record.meta_length <= n - RECORD_HEADER_SIZE) {
+                meta.assign(buffer + RECORD_HEADER_SIZE, record.meta_length);
+            } else {
+                meta.resize(record.meta_length);
+                if (pread(fd, &meta[0], meta.length(), offset + RECORD_HEADER_SIZE) != (ssize_t)meta.length()) break;
+            }
+            IndexEntry entry;
+            size_t meta_length = meta.length();
+            if (record.type == RECORD_COMPRESSED) entry.compression = meta[--meta_length]; // flags after the fields
+            if (!parse_segment_meta(meta.data(), meta_length, entry.sender, entry.attachment, entry.subject)) break;
+            entry.id = record.id;
+            entry.size = record.message_length;
+            entry.timestamp = record.timestamp;
+            entry.record_offset = offset;
+            entry.message_offset = offset + RECORD_HEADER_SIZE + record.meta_length;
+            entry.attachment_offset = entry.message_offset + record.message_length;
+            entry.attachment_size = record.attachment_length;
+            auto position = index.entries.end(); // records are written in id order, usually this is an append
+            if (!index.entries.empty() && index.entries.back().id >= entry.id) {
+                position = lower_bound(index.entries.begin(), index.entries.end(), entry.id,
+                    [](const IndexEntry& e, unsigned long id) { return e.id < id; });
+            }
+            if (position != index.entries.end() && position->id == entry.id) {
+                index.dead_bytes += length; // duplicate id, the first record wins
+            } else {
+                index.entries.insert(position, move(entry));
+                index.live_bytes += length;
+            }
+        }
+        index.next_id = max<unsigned long>(index.next_id, record.id + 1);
+        offset += length;
+    }
+    return offset;
+}
+
+vector<IndexEntry>::iterator find_segment_entry(SegmentIndex& index, unsigned long id) {
+    auto entry = lower_bound(index.entries.begin(), index.entries.end(), id,
+        [](const IndexEntry& e, unsigned long id) { return e.id < id; });
+    return entry != index.entries.end() && entry->id == id ? entry : index.entries.end();
+}
+
+// creates an empty segment under a temporary name, a crash never leaves a segment without header
+bool create_segment(SegmentMailbox& segment, const string& name) {
+    string path = mail_spool_dir + "/" + name + "/" SEGMENT_FILENAME;
+    string tmp_path = path + ".new";
+    string header = format_segment_header(segment.index.next_id);
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 || !pwrite_all(fd, header.data(), header.length(), 0) || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_errno(LogLevel::ERROR, "segment");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path.c_str());
+        }
+        return false;
+    }
+    segment.fd = fd;
+    segment.end = SEGMENT_HEADER_SIZE;
+    return true;
+}
+
+// SEND in the segment store, the caller holds the mailbox lock exclusively; fills in id and offsets of entry
+bool append_segment_message(MailboxLock& mailbox, const string& name, IndexEntry& entry, const string& header, const string& message,
+                            const string& compressed, const BlobRef* attachment) {
+    SegmentMailbox& segment = load_segment(mailbox, name);
+    if (segment.damaged || (segment.fd < 0 && !create_segment(segment, name))) return false;
+
+    RecordHeader record;
+    record.id = segment.index.next_id;
+    uint8_t compression = compressed.empty() ? 0 : RECORD_MESSAGE_GZIP;
+
+    // the attachment is linked next to the segment under the id of the new record, a leftover of a failed SEND is replaced
+    ArenaScope arena;
+    string& attachment_path = arena.take();
+    if (attachment) {
+        const string& attachment_base = arena.concat(mail_spool_dir, "/", name, "/", record.id, ".att");
+        assign_parts(attachment_path, attachment_base, attachment->deflated ? COMPRESSED_SUFFIX : "");
+        unlink(attachment_base.c_str());
+        unlink(arena.concat(attachment_base, COMPRESSED_SUFFIX).c_str());
+        if (link(attachment->path.c_str(), attachment_path.c_str()) != 0) {
+            log_errno(LogLevel::ERROR, "attachment");
+            return false;
+        }
+        compression |= RECORD_ATTACHMENT_LINKED | (attachment->deflated ? RECORD_ATTACHMENT_GZIP : 0);
+    }
+
+    record.type = compression ? RECORD_COMPRESSED : RECORD_MESSAGE;
+    record.timestamp = entry.timestamp;
+    string& head = arena.take(); // the record header, encoded once the length of the meta behind it is known
+    head.resize(RECORD_HEADER_SIZE);
+    encode_segment_meta(entry.sender, entry.attachment, entry.subject, head);
+    if (compression) head.push_back((char)compression); // flags after the fields
+    record.meta_length = head.length() - RECORD_HEADER_SIZE;
+    record.message_length = compressed.empty() ? header.length() + message.length() : compressed.length();
+    encode_record_header(record, &head[0]);
+
+    // the payload first and the record header last, a crash in between leaves no valid record;
+    // the body is written from the session without another copy
+    off_t offset = segment.end;
+    off_t message_offset = offset + head.length();
+    off_t attachment_offset = message_offset + record.message_length;
+    bool ok = (compressed.empty() ? pwrite_all(segment.fd, header.data(), header.length(), message_offset)
+                   && pwrite_all(segment.fd, message.data(), message.length(), message_offset + header.length())
+               : pwrite_all(segment.fd, compressed.data(), compressed.length(), message_offset))
+        && pwrite_all(segment.fd, head.data(), head.length(), offset);
+    if (!ok) {
+        log_errno(LogLevel::ERROR, "segment");
+        if (ftruncate(segment.fd, offset) != 0) log_errno(LogLevel::ERROR, "segment"); // no partial record behind the last complete one
+        if (attachment) unlink(attachment_path.c_str());
+        return false;
+    }
+
+    entry.id = record.id;
+    entry.size = record.message_length;
+    entry.record_offset = offset;
+    entry.message_offset = message_offset;
+    entry.attachment_offset = attachment_offset;
+    entry.attachment_size = record.attachment_length;
+    entry.compression = compression;
+    segment.index.entries.push_back(entry);
+    segment.index.next_id++;
+    segment.index.live_bytes += record.record_length();
+    segment.end += record.record_length();
+    return true;
+}
+
+// DEL in the segment store, the caller holds the mailbox lock exclusively; the space is reclaimed by the compactor
+bool append_segment_tombstone(MailboxLock& mailbox, const string& name, unsigned long id) {
+    SegmentMailbox& segment = load_segment(mailbox, name);
+    auto entry = find_segment_entry(segment.index, id);
+    if (segment.damaged || entry == segment.index.entries.end()) return false;
+
+    RecordHeader record;
+    record.type = RECORD_TOMBSTONE;
+    record.id = id;
+    record.timestamp = time(nullptr);
+    string tombstone = encode_record_header(record);
+    if (!pwrite_all(segment.fd, tombstone.data(), tombstone.length(), segment.end)) {
+        log_errno(LogLevel::ERROR, "segment");
+        return false;
+    }
+
+    // a linked attachment goes right away, its blob may be unused now
+    if (entry->compression & RECORD_ATTACHMENT_LINKED) {
+        string attachment_base = mail_spool_dir + "/" + name + "/" + to_string(id) + ".att";
+        unlink(attachment_base.c_str());
+        unlink((attachment_base + COMPRESSED_SUFFIX).c_str());
+        blob_sweep_due = true;
+    }
+
+    uint64_t length = segment_record_length(*entry);
+    segment.index.live_bytes -= length;
+    segment.index.dead_bytes += length + tombstone.length();
+    segment.index.entries.erase(entry);
+    segment.end += tombstone.length();
+    if (compaction_due(segment.index)) {
+        lock_guard<mutex> lock(compaction_mutex);
+        compaction_queue.insert(name);
+    }
+    return true;
+}
+
+// rewrites a segment without its deleted records; readers are never blocked, SEND and DEL only while the tail is copied
+bool compact_segment(const string& name) {
+    string path = mail_spool_dir + "/" + name + "/" SEGMENT_FILENAME;
+    string tmp_path = path + ".compact";
+    SegmentMailbox& segment = get_mailbox_lock(name).segment;
+
+    // records before the end of the snapshot never change, they are copied without holding the lock
+    int old_fd;
+    off_t snapshot_end;
+    SegmentIndex compacted;
+    {
+        MailboxGuard guard(name, false);
+        if (segment.fd < 0 || !compaction_due(segment.index)) return false;
+        old_fd = dup(segment.fd);
+        snapshot_end = segment.end;
+        compacted.entries = segment.index.entries;
+        compacted.next_id = segment.index.next_id;
+    }
+
+    string header = format_segment_header(compacted.next_id);
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool ok = old_fd >= 0 && fd >= 0 && pwrite_all(fd, header.data(), header.length(), 0);
+    off_t offset = SEGMENT_HEADER_SIZE;
+    for (auto& entry : compacted.entries) {
+        if (!ok) break;
+        uint64_t length = segment_record_length(entry);
+        ok = copy_range(old_fd, entry.record_offset, fd, offset, length);
+        off_t shift = offset - entry.record_offset;
+        entry.record_offset += shift;
+        entry.message_offset += shift;
+        entry.attachment_offset += shift;
+        compacted.live_bytes += length;
+        offset += length;
+    }
+    ok = ok && fdatasync(fd) == 0; // the bulk is on disk before any lock is taken
+
+    // records appended since the snapshot are copied as they are and applied to the new index
+    {
+        MailboxGuard guard(name, true);
+        off_t tail = segment.end - snapshot_end;
+        ok = ok && copy_range(old_fd, snapshot_end, fd, offset, tail)
+            && scan_segment(fd, offset, offset + tail, compacted) == offset + tail
+            && fdatasync(fd) == 0 && rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (ok) {
+            segment_reclaimed_bytes += segment.end - (offset + tail);
+            segment_compactions++;
+            close(segment.fd); // responses in flight hold their own duplicates of the old file
+            segment.fd = fd;
+            segment.end = offset + tail;
+            segment.index = move(compacted);
+        }
+    }
+
+    if (!ok) {
+        log_errno(LogLevel::ERROR, "compaction");
+        if (fd >= 0) close(fd);
+        unlink(tmp_path.c_str());
+    }
+    if (old_fd >= 0) close(old_fd);
+    return ok;
+}
+
+void put_journal_field(string& out, const string& field) {
+    char length[4];
+    put_be(length, field.length(), 4);
+    out.append(length, 4);
+    out += field;
+}
+
+void put_journal_number(string& out, uint64_t number) {
+    char bytes[8];
+    put_be(bytes, number, 8);
+    out.append(bytes, 8);
+}
+
+// reads the fields of a journal record in order, ok turns false at the first one that doesn't fit
+struct JournalReader {
+    const char* data;
+    size_t left;
+    bool ok = true;
+
+    uint64_t number() {
+        if (left < 8) ok = false;
+        if (!ok) return 0;
+        uint64_t value = get_be(data, 8);
+        data += 8;
+        left -= 8;
+        return value;
+    }
+
+    string field() {
+        size_t length = left >= 4 ? get_be(data, 4) : 0;
+        if (left < 4 || left - 4 < length) ok = false;
+        if (!ok) return "";
+        string value(data + 4, length);
+        data += 4 + length;
+        left -= 4 + length;
+        return value;
+    }
+};
+
+void encode_journal_message(const JournalMessage& message, string& out) {
+    put_journal_number(out, message.entry.timestamp);
+    put_journal_field(out, message.entry.sender);
+    put_journal_field(out, message.entry.attachment);
+    put_journal_field(out, message.entry.subject);
+    put_journal_field(out, message.header);
+    put_journal_field(out, message.body);
+    put_journal_field(out, message.blob);
+    put_journal_number(out, message.deliveries.size());
+    for (const auto& delivery : message.deliveries) {
+        put_journal_field(out, delivery.first);
+        put_journal_number(out, delivery.second);
+    }
+}
+
+bool parse_journal_message(const char* data, size_t length, JournalMessage& message) {
+    JournalReader reader{data, length};
+    message.entry.timestamp = reader.number();
+    message.entry.sender = reader.field();
+    message.entry.attachment = reader.field();
+    message.entry.subject = reader.field();
+    message.header = reader.field();
+    message.body = reader.field();
+    message.blob = reader.field();
+    uint64_t count = reader.number();
+    for (uint64_t i = 0; reader.ok && i < count; i++) {
+        string mailbox = reader.field();
+        unsigned long id = reader.number();
+        message.deliveries.emplace_back(mailbox, id);
+    }
+    return reader.ok && reader.left == 0;
+}
+
+// queues a record for the next commit, returns its lsn for wait_for_commit()
+uint64_t journal_append(char type, const string& payload, bool names_blob) {
+    lock_guard<mutex> lock(journal.journal_mutex);
+    uint64_t lsn = ++journal.appended_lsn;
+    char header[JOURNAL_HEADER_SIZE];
+    memcpy(header, JOURNAL_MAGIC, 3);
+    header[3] = type;
+    put_be(header + 4, lsn, 8);
+    put_be(header + 12, payload.length(), 4);
+    uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(header + 3), 9); // type and lsn
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(payload.data()), payload.length());
+    put_be(header + 16, crc, 4);
+    journal.pending.append(header, JOURNAL_HEADER_SIZE);
+    journal.pending += payload;
+    journal.pending_records++;
+    journal.blobs_dirty = journal.blobs_dirty || names_blob;
+    journal.pending_changed.notify_one();
+    return lsn;
+}
+
+// threaded mode: blocks until the record is durable, lsn 0 (nothing journaled) returns at once
+bool wait_for_commit(uint64_t lsn) {
+    if (journal.durable_lsn.load(memory_order_acquire) >= lsn) return true;
+    unique_lock<mutex> lock(journal.journal_mutex);
+    journal.committed.wait(lock, [lsn] { return journal.durable_lsn.load(memory_order_relaxed) >= lsn; });
+    return true;
+}
+
+// reactor: parks a session whose output has to wait for a commit, false if it may be flushed
+bool hold_for_commit(Session& s) {
+    if (journal.durable_lsn.load(memory_order_acquire) >= s.commit_lsn) return false;
+    lock_guard<mutex> lock(journal.journal_mutex);
+    if (journal.durable_lsn.load(memory_order_relaxed) >= s.commit_lsn) return false; // committed meanwhile
+    journal.wake_fds.insert(loop_wake_fd);
+    if (!s.commit_waiting) {
+        s.commit_waiting = true;
+        commit_waiters.push_back(&s);
+    }
+    return true;
+}
+
+// reactor: the committer advanced, every parked session of this loop gets another turn
+void resume_committed(int epfd) {
+    vector<Session*> waiting;
+    waiting.swap(commit_waiters);
+    for (Session* s : waiting) {
+        s->commit_waiting = false;
+        handle_session_event(epfd, s, 0); // parks it again if its commit is still to come
+    }
+}
+
+// writes the records of all waiting requests with one fdatasync(); a failed write or sync stops the server,
+// requests may already have been applied and nothing can be acknowledged anymore, the restart replays the journal
+void run_committer() {
+    string batch; // swapped with journal.pending, the requests append to the buffer of the batch before the last
+    while (true) {
+        size_t records;
+        uint64_t lsn;
+        bool sync_blobs;
+        {
+            unique_lock<mutex> lock(journal.journal_mutex);
+            journal.pending_changed.wait(lock, [] { return journal.pending_records > 0; });
+            if (commit_interval_us > 0 && journal.pending_records < commit_batch) {
+                // trades latency for larger groups
+                journal.pending_changed.wait_for(lock, chrono::microseconds(commit_interval_us),
+                                                 [] { return journal.pending_records >= commit_batch; });
+            }
+            batch.clear();
+            batch.swap(journal.pending);
+            records = journal.pending_records;
+            journal.pending_records = 0;
+            lsn = journal.appended_lsn;
+            sync_blobs = journal.blobs_dirty;
+            journal.blobs_dirty = false;
+        }
+
+        // one submission writes and syncs, a sync is only started once what it covers succeeded
+        auto start = chrono::steady_clock::now();
+        FileBatch commit;
+        if (sync_blobs) {
+            commit.fsync(journal.blob_dir_fd);
+            commit.then(true);
+        }
+        size_t write_op = commit.write(journal.fd, batch.data(), batch.length(), -1);
+        commit.then(true);
+        size_t sync_op = commit.datasync(journal.fd);
+        commit.run();
+        int rc = commit.result(sync_op);
+        int written = commit.result(write_op) == -EINTR ? 0 : commit.result(write_op);
+        if (rc == -ECANCELED && written >= 0 && (!sync_blobs || commit.result(0) == 0)) {
+            // a short write, the rest is written the blocking way
+            rc = write_all(journal.fd, batch.data() + written, batch.length() - written) && fdatasync(journal.fd) == 0 ? 0 : -errno;
+        } else if (rc == -ECANCELED) {
+            rc = sync_blobs && commit.result(0) != 0 ? commit.result(0) : written;
+        }
+        if (rc != 0) {
+            errno = -rc;
+            perror("journal");
+            exit(EXIT_FAILURE);
+        }
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        journal.commits.fetch_add(1, memory_order_relaxed);
+        journal.records.fetch_add(records, memory_order_relaxed);
+        journal.sync_us.fetch_add(elapsed.count(), memory_order_relaxed);
+
+        set<int> wake_fds;
+        {
+            lock_guard<mutex> lock(journal.journal_mutex);
+            journal.durable_lsn.store(lsn, memory_order_release);
+            wake_fds.swap(journal.wake_fds);
+        }
+        journal.committed.notify_all();
+        for (int fd : wake_fds) {
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0) log_errno(LogLevel::ERROR, "eventfd");
+        }
+
+        journal.size += batch.length();
+        if (journal.size >= JOURNAL_CHECKPOINT_SIZE) {
+            checkpoint_journal();
+        }
+    }
+}
+
+string journal_path(uint64_t generation) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.wal", (unsigned long long)generation);
+    return mail_spool_dir + "/" JOURNAL_DIRNAME "/" + name;
+}
+
+// every record was applied before it was appended, once the spool is synced the file is no longer needed
+void checkpoint_journal() {
+    string old_path = journal_path(journal.generation);
+    int old_fd = journal.fd;
+    int fd = open(journal_path(journal.generation + 1).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        log_errno(LogLevel::ERROR, "journal");
+        return; // keeps writing the old file and tries again after the next commit
+    }
+    int dir_fd = open((mail_spool_dir + "/" JOURNAL_DIRNAME).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    journal.fd = fd;
+    journal.generation++;
+    journal.size = 0;
+    if (syncfs(old_fd) != 0 || dir_fd < 0 || fsync(dir_fd) != 0) {
+        perror("journal checkpoint");
+        exit(EXIT_FAILURE);
+    }
+    close(old_fd);
+    unlink(old_path.c_str());
+    close(dir_fd);
+}
+
+// journal replay: a SEND whose receiver lost the message gets it again
+void redo_delivery(const JournalMessage& message, const string& mailbox, unsigned long id) {
+    string user_dir = mail_spool_dir + "/" + mailbox;
+    mkdir(user_dir.c_str(), 0777);
+    MailboxGuard guard(mailbox, true);
+    BlobRef attachment;
+    if (!message.blob.empty()) {
+        attachment.path = mail_spool_dir + "/" BLOB_DIRNAME "/" + message.blob; // synced before the record
+        attachment.deflated = message.blob.size() > 3 && message.blob.compare(message.blob.size() - 3, 3, COMPRESSED_SUFFIX) == 0;
+    }
+    string compressed;
+    if (!compress_message(message.header, message.body, compressed)) compressed.clear();
+
+    if (segment_store) {
+        // a missing id below the next one was deleted: SEND appends its record before it releases the mailbox, so the
+        // records of a mailbox are in id order and a torn tail cuts all behind it
+        SegmentMailbox& segment = load_segment(guard.mailbox(), mailbox);
+        if (find_segment_entry(segment.index, id) != segment.index.entries.end() || id < segment.index.next_id) return;
+        segment.index.next_id = id;
+        IndexEntry entry = message.entry;
+        append_segment_message(guard.mailbox(), mailbox, entry, message.header, message.body, compressed, attachment.path.empty() ? nullptr : &attachment);
+        return;
+    }
+
+    // the message file is written again in any case, an unsynced one may exist but be empty
+    string base = user_dir + "/" + to_string(id);
+    for (const char* suffix : {".txt", ".txt" COMPRESSED_SUFFIX, ".att", ".att" COMPRESSED_SUFFIX}) {
+        unlink((base + suffix).c_str());
+    }
+    int fd = open((base + (compressed.empty() ? ".txt" : ".txt" COMPRESSED_SUFFIX)).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool saved = fd >= 0 && (compressed.empty() ? write_all(fd, message.header) && write_all(fd, message.body) : write_all(fd, compressed));
+    if (fd >= 0) close(fd);
+    if (saved && !attachment.path.empty()) {
+        saved = link(attachment.path.c_str(), (base + (attachment.deflated ? ".att" COMPRESSED_SUFFIX : ".att")).c_str()) == 0;
+    }
+    if (!saved) log_errno(LogLevel::ERROR, "journal replay");
+    unlink((user_dir + "/" INDEX_FILENAME).c_str()); // rebuilt by the next LIST
+}
+
+// journal replay: a DEL whose removal the spool lost
+void redo_delete(const string& mailbox, unsigned long id) {
+    MailboxGuard guard(mailbox, true);
+    if (segment_store) {
+        SegmentMailbox& segment = load_segment(guard.mailbox(), mailbox);
+        if (find_segment_entry(segment.index, id) != segment.index.entries.end()) {
+            append_segment_tombstone(guard.mailbox(), mailbox, id);
+        }
+        return;
+    }
+    remove_message_files(mail_spool_dir + "/" + mailbox, {id});
+    unlink((mail_spool_dir + "/" + mailbox + "/" INDEX_FILENAME).c_str());
+}
+
+// replays the journal files of an unclean shutdown, syncs the spool and starts a new journal and its committer
+void open_journal() {
+    string journal_dir = mail_spool_dir + "/" JOURNAL_DIRNAME;
+    mkdir(journal_dir.c_str(), 0777);
+    vector<uint64_t> generations;
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(journal_dir.c_str())) != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            char* end;
+            uint64_t generation = strtoull(ent->d_name, &end, 10);
+            if (end != ent->d_name && strcmp(end, ".wal") == 0) generations.push_back(generation);
+        }
+        closedir(dir);
+    }
+    sort(generations.begin(), generations.end());
+
+    // the records in order, up to the first torn one
+    vector<JournalMessage> messages;
+    vector<pair<string, unsigned long>> deletions;
+    set<pair<string, unsigned long>> deleted;
+    for (uint64_t generation : generations) {
+        ifstream file(journal_path(generation), ios::binary);
+        string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        size_t offset = 0;
+        while (content.length() - offset >= JOURNAL_HEADER_SIZE) {
+            const char* header = content.data() + offset;
+            size_t length = get_be(header + 12, 4);
+            if (memcmp(header, JOURNAL_MAGIC, 3) != 0 || content.length() - offset - JOURNAL_HEADER_SIZE < length) break;
+            const char* payload = header + JOURNAL_HEADER_SIZE;
+            uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(header + 3), 9);
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(payload), length);
+            if (crc != get_be(header + 16, 4)) break;
+
+            JournalMessage message;
+            JournalReader reader{payload, length};
+            if (header[3] == 'S' && parse_journal_message(payload, length, message)) {
+                messages.push_back(move(message));
+            } else if (header[3] == 'D') {
+                string mailbox = reader.field();
+                unsigned long id = reader.number();
+                if (!reader.ok) break;
+                deletions.emplace_back(mailbox, id);
+                deleted.emplace(mailbox, id);
+            } else {
+                break;
+            }
+            offset += JOURNAL_HEADER_SIZE + length;
+        }
+        if (offset < content.length()) {
+            log_event(LogLevel::WARN, "event=journal path=%s ignored_bytes=%zu", journal_path(generation).c_str(), content.length() - offset);
+        }
+    }
+
+    // ids are never reused: a message deleted anywhere in the journal stays deleted, whatever the order of the records
+    size_t redone = 0;
+    for (const auto& message : messages) {
+        for (const auto& delivery : message.deliveries) {
+            if (!is_valid_mailbox(delivery.first)) continue;
+            if (!segment_store) {
+                // the id is never handed out again, even if the counter file didn't survive
+                MailboxGuard guard(delivery.first, true);
+                string user_dir = mail_spool_dir + "/" + delivery.first;
+                mkdir(user_dir.c_str(), 0777);
+                if (guard.mailbox().next_id == 0) guard.mailbox().next_id = load_next_id(user_dir);
+                if (delivery.second >= guard.mailbox().next_id) {
+                    guard.mailbox().next_id = delivery.second + 1;
+                    persist_next_id(user_dir, guard.mailbox().next_id);
+                }
+            }
+            if (deleted.count(delivery)) continue;
+            redo_delivery(message, delivery.first, delivery.second);
+            redone++;
+        }
+    }
+    for (const auto& deletion : deletions) {
+        if (is_valid_mailbox(deletion.first)) redo_delete(deletion.first, deletion.second);
+    }
+
+    // the spool now holds everything the old files describe
+    journal.generation = generations.empty() ? 1 : generations.back() + 1;
+    journal.fd = open(journal_path(journal.generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+    journal.blob_dir_fd = open((mail_spool_dir + "/" BLOB_DIRNAME).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int dir_fd = open(journal_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (journal.fd < 0 || journal.blob_dir_fd < 0 || dir_fd < 0 || syncfs(journal.fd) != 0) {
+        perror("journal");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t generation : generations) {
+        unlink(journal_path(generation).c_str());
+    }
+    fsync(dir_fd);
+    close(dir_fd);
+    if (!generations.empty()) {
+        log_event(LogLevel::INFO, "event=journal replayed_sends=%zu deliveries=%zu dels=%zu", messages.size(), redone, deletions.size());
+    }
+    thread(run_committer).detach();
+}
+
+// rewrites the segments that DEL queued, a mailbox that failed is queued again by its next DEL;
+// also drops blobs that DEL left without mailbox links
+void run_compactor() {
+    while (true) {
+        if (blob_sweep_due.exchange(false)) {
+            sweep_blobs();
+        }
+        this_thread::sleep_for(chrono::seconds(SEGMENT_COMPACT_INTERVAL));
+        set<string> due;
+        {
+            lock_guard<mutex> lock(compaction_mutex);
+            due.swap(compaction_queue);
+        }
+        for (const auto& name : due) {
+            compact_segment(name);
+        }
+    }
+}
+
+MailboxLock& get_mailbox_lock(const string& mailbox) {
+    MailboxLockShard& shard = mailbox_locks[hash<string>()(mailbox) % MAILBOX_LOCK_SHARDS];
+    lock_guard<mutex> lock(shard.table_mutex); // only held for the lookup
+    unique_ptr<MailboxLock>& entry = shard.locks[mailbox];
+    if (!entry) {
+        entry.reset(new MailboxLock());
+    }
+    return *entry; // entries are never erased, the reference stays valid
+}
+
+MailboxGuard::MailboxGuard(const string& mailbox, bool exclusive)
+    : mailbox_lock(get_mailbox_lock(mailbox)), exclusive(exclusive) {
+    bool acquired = exclusive ? mailbox_lock.lock.try_lock() : mailbox_lock.lock.try_lock_shared();
+    if (!acquired) {
+        // contended, measure how long this request has to wait
+        auto start = chrono::steady_clock::now();
+        if (exclusive) {
+            mailbox_lock.lock.lock();
+        } else {
+            mailbox_lock.lock.lock_shared();
+        }
+        auto waited = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        mailbox_lock.contended.fetch_add(1, memory_order_relaxed);
+        mailbox_lock.wait_ns.fetch_add(waited.count(), memory_order_relaxed);
+    }
+    mailbox_lock.acquisitions.fetch_add(1, memory_order_relaxed);
+}
+
+MailboxGuard::~MailboxGuard() {
+    if (exclusive) {
+        mailbox_lock.lock.unlock();
+    } else {
+        mailbox_lock.lock.unlock_shared();
+    }
+}
+
+void print_lock_stats(ostream& out) {
+    out << "mailbox acquisitions contended wait_ms" << "\n";
+    for (auto& shard : mailbox_locks) {
+        lock_guard<mutex> lock(shard.table_mutex);
+        for (const auto& entry : shard.locks) {
+            const MailboxLock& l = *entry.second;
+            out << entry.first << " " << l.acquisitions.load() << " " << l.contended.load() << " "
+                << l.wait_ns.load() / 1000000.0 << "\n";
+        }
+    }
+    out.flush();
+}
+
+void record_latency(LatencySamples& latency, double ms) {
+    lock_guard<mutex> lock(latency.samples_mutex);
+    if (latency.samples.size() < LATENCY_SAMPLES) {
+        latency.samples.push_back(ms);
+    } else {
+        latency.samples[latency.next] = ms; // overwrite the oldest sample
+        latency.next = (latency.next + 1) % LATENCY_SAMPLES;
+    }
+    latency.count++;
+}
+
+void print_latency(ostream& out, const string& name, LatencySamples& latency) {
+    vector<double> samples;
+    uint64_t count;
+    {
+        lock_guard<mutex> lock(latency.samples_mutex);
+        samples = latency.samples;
+        count = latency.count;
+    }
+    if (samples.empty()) {
+        out << name << " count=0" << "\n";
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    out << name << " count=" << count
+        << " p50_ms=" << samples[samples.size() / 2]
+        << " p99_ms=" << samples[min(samples.size() - 1, samples.size() * 99 / 100)] << "\n";
+}
+
+void run_signal_thread() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int sig;
+    while (sigwait(&signals, &sig) == 0) {
+        print_lock_stats(cout); // kill -USR1 <pid> dumps the lock contention per mailbox
+        print_latency(cout, "login", login_latency); // and the login latency over the last LATENCY_SAMPLES logins
+        {
+            lock_guard<mutex> lock(connection_limits.limits_mutex);
+            cout << "connections open=" << connection_limits.total << " rejected=" << connection_limits.rejected.load() << "\n";
+        }
+        login_limiter.print_stats(cout);
+        uint64_t writes = 0, compress_in = 0, compress_out = 0;
+        {
+            lock_guard<mutex> lock(metrics_mutex);
+            for (const auto& m : all_metrics) {
+                writes += m->output_writes.load(memory_order_relaxed);
+                compress_in += m->compress_in.load(memory_order_relaxed);
+                compress_out += m->compress_out.load(memory_order_relaxed);
+            }
+        }
+        cout << "output writes=" << writes << "\n";
+        cout << "log dropped=" << log_dropped() << "\n";
+        cout << "compression in=" << compress_in << " stored=" << compress_out
+             << " ratio=" << (compress_out > 0 ? (double)compress_in / compress_out : 1.0) << "\n";
+        uint64_t commits = journal.commits.load(memory_order_relaxed), records = journal.records.load(memory_order_relaxed);
+        cout << "journal commits=" << commits << " records=" << records
+             << " records/commit=" << (commits > 0 ? (double)records / commits : 0.0) << "\n";
+        cout.flush();
+    }
+}
+
+// metrics of the calling thread, registered on first use
+ThreadMetrics& metrics() {
+    thread_local ThreadMetrics* local = nullptr;
+    if (local == nullptr) {
+        lock_guard<mutex> lock(metrics_mutex);
+        all_metrics.emplace_back(new ThreadMetrics());
+        local = all_metrics.back().get();
+    }
+    return *local;
+}
+
+// queues a record for the log thread, never waits: the ring of the calling thread is registered on first use,
+// afterwards a record costs a clock read and the formatting, and is dropped if the log thread fell behind
+void log_event(LogLevel level, const char* format, ...) {
+    if (level < log_level) return;
+    thread_local LogRing* ring = nullptr;
+    if (ring == nullptr) {
+        lock_guard<mutex> lock(log_rings_mutex);
+        log_rings.emplace_back(new LogRing());
+        ring = log_rings.back().get();
+        ring->thread = log_rings.size();
+    }
+
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) >= LOG_RING_SIZE) {
+        ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed); // only this thread writes it
+        return;
+    }
+    LogRecord& record = ring->records[head % LOG_RING_SIZE];
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.time_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    record.level = level;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record.text, LOG_RECORD_SIZE, format, args);
+    va_end(args);
+    record.length = length < 0 ? 0 : min(length, LOG_RECORD_SIZE - 1);
+    ring->head.store(head + 1, memory_order_release); // publishes the record
+}
+
+// perror() for the log: what failed and the description of errno
+void log_errno(LogLevel level, const char* what) {
+    char buffer[128];
+    const char* description = strerror_r(errno, buffer, sizeof(buffer));
+    log_event(level, "error=\"%s: %s\"", what, description);
+}
+
+// writes the records of all rings in time order, INFO and below to stdout, WARN and above to stderr
+void drain_log() {
+    vector<LogRecord> records;
+    vector<pair<unsigned, uint64_t>> drops; // thread and records it lost since the last report
+    {
+        lock_guard<mutex> lock(log_rings_mutex);
+        for (auto& ring : log_rings) {
+            uint64_t tail = ring->tail.load(memory_order_relaxed);
+            uint64_t head = ring->head.load(memory_order_acquire);
+            for (; tail < head; tail++) {
+                records.push_back(ring->records[tail % LOG_RING_SIZE]);
+            }
+            ring->tail.store(tail, memory_order_release); // the slots can be written again
+            uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+            if (dropped > ring->reported) {
+                drops.emplace_back(ring->thread, dropped - ring->reported);
+                ring->reported = dropped;
+            }
+        }
+    }
+    if (records.empty() && drops.empty()) return;
+    stable_sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) { return a.time_us < b.time_us; });
+
+    string out, err;
+    auto format_time = [](int64_t time_us) {
+        time_t seconds = time_us / 1000000;
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+        char buffer[40];
+        size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(buffer + length, sizeof(buffer) - length, ".%06lldZ", (long long)(time_us % 1000000));
+        return string(buffer);
+    };
+    for (const auto& record : records) {
+        string& target = record.level >= LogLevel::WARN ? err : out;
+        target += format_time(record.time_us);
+        target += ' ';
+        target += log_level_names[(int)record.level];
+        target += ' ';
+        target.append(record.text, record.length);
+        target += '\n';
+    }
+    for (const auto& drop : drops) {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        err += format_time((int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000) + " WARN event=log_dropped thread="
+            + to_string(drop.first) + " records=" + to_string(drop.second) + "\n";
+    }
+    if (!out.empty()) write_all(STDOUT_FILENO, out);
+    if (!err.empty()) write_all(STDERR_FILENO, err);
+}
+
+// the only writer of the log, a slow terminal or pipe stalls this thread and no request handler
+void run_log_writer() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_MS));
+        drain_log();
+    }
+}
+
+// records lost to full rings so far
+uint64_t log_dropped() {
+    lock_guard<mutex> lock(log_rings_mutex);
+    uint64_t dropped = 0;
+    for (const auto& ring : log_rings) {
+        dropped += ring->dropped.load(memory_order_relaxed);
+    }
+    return dropped;
+}
+
+// increments a counter of the calling thread, a plain load and store since no other thread writes it
+void add_metric(atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void record_metric(MetricId id, uint64_t us, bool failed) {
+    ThreadMetrics& m = metrics();
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKETS && us > latency_bounds_us[bucket]) bucket++;
+    add_metric(m.count[id], 1);
+    if (failed) add_metric(m.errors[id], 1);
+    add_metric(m.latency_sum_us[id], us);
+    add_metric(m.latency_buckets[id][bucket], 1);
+}
+
+CommandTimer::CommandTimer(Session& s, MetricId id, chrono::steady_clock::time_point start) : session(s), id(id), start(start) {
+    s.command_failed = false;
+}
+
+CommandTimer::~CommandTimer() {
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    record_metric(id, elapsed.count(), session.command_failed);
+#ifdef COUNT_ALLOCATIONS
+    add_metric(metrics().allocations[id], thread_allocations - session.request_allocations);
+#endif
+    log_event(LogLevel::DEBUG, "event=command ip=%s user=%s command=%s result=%s duration_us=%lld", session.client_ip.c_str(),
+              session.username.c_str(), metric_names[id], session.command_failed ? "err" : "ok", (long long)elapsed.count());
+}
+
+ArenaScope::ArenaScope() : mark(request_arena.used) {}
+
+ArenaScope::~ArenaScope() {
+    request_arena.used = mark;
+}
+
+string& ArenaScope::take() {
+    if (request_arena.used == request_arena.strings.size()) request_arena.strings.emplace_back();
+    string& taken = request_arena.strings[request_arena.used++];
+    if (taken.capacity() > ARENA_STRING_MAX) string().swap(taken); // one huge request doesn't pin memory for good
+    taken.clear();
+    return taken;
+}
+
+// all metrics in the Prometheus text exposition format
+string format_metrics() {
+    // sum the per-thread counters
+    uint64_t count[METRIC_COUNT] = {}, errors[METRIC_COUNT] = {}, sum_us[METRIC_COUNT] = {};
+    uint64_t buckets[METRIC_COUNT][LATENCY_BUCKETS + 1] = {};
+    uint64_t bytes_in = 0, bytes_out = 0, writes = 0, compress_in = 0, compress_out = 0, compress_us = 0, decompress_us = 0, blobs_stored = 0, blobs_reused = 0;
+    uint64_t file_batches = 0, file_ops = 0, proxied = 0, allocations[METRIC_COUNT] = {};
+    {
+        lock_guard<mutex> lock(metrics_mutex);
+        for (const auto& m : all_metrics) {
+            for (int id = 0; id < METRIC_COUNT; id++) {
+                count[id] += m->count[id].load(memory_order_relaxed);
+                errors[id] += m->errors[id].load(memory_order_relaxed);
+                sum_us[id] += m->latency_sum_us[id].load(memory_order_relaxed);
+                for (size_t b = 0; b <= LATENCY_BUCKETS; b++) buckets[id][b] += m->latency_buckets[id][b].load(memory_order_relaxed);
+                allocations[id] += m->allocations[id].load(memory_order_relaxed);
+            }
+            bytes_in += m->bytes_in.load(memory_order_relaxed);
+            bytes_out += m->bytes_out.load(memory_order_relaxed);
+            writes += m->output_writes.load(memory_order_relaxed);
+            compress_in += m->compress_in.load(memory_order_relaxed);
+            compress_out += m->compress_out.load(memory_order_relaxed);
+            compress_us += m->compress_us.load(memory_order_relaxed);
+            decompress_us += m->decompress_us.load(memory_order_relaxed);
+            blobs_stored += m->blobs_stored.load(memory_order_relaxed);
+            blobs_reused += m->blobs_reused.load(memory_order_relaxed);
+            file_batches += m->file_batches.load(memory_order_relaxed);
+            file_ops += m->file_ops.load(memory_order_relaxed);
+            proxied += m->proxied.load(memory_order_relaxed);
+        }
+    }
+    uint64_t lock_acquisitions = 0, lock_contended = 0, lock_wait_ns = 0;
+    for (auto& shard : mailbox_locks) {
+        lock_guard<mutex> lock(shard.table_mutex);
+        for (const auto& entry : shard.locks) {
+            lock_acquisitions += entry.second->acquisitions.load();
+            lock_contended += entry.second->contended.load();
+            lock_wait_ns += entry.second->wait_ns.load();
+        }
+    }
+    int connections;
+    {
+        lock_guard<mutex> lock(connection_limits.limits_mutex);
+        connections = connection_limits.total;
+    }
+
+    ostringstream out;
+    auto header = [&](const string& name, const string& type, const string& help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+    auto histogram = [&](const string& name, const string& labels, int id) {
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b <= LATENCY_BUCKETS; b++) {
+            cumulative += buckets[id][b];
+            out << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"";
+            if (b < LATENCY_BUCKETS) {
+                out << latency_bounds_us[b] / 1e6;
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        string braces = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_sum" << braces << " " << sum_us[id] / 1e6 << "\n";
+        out << name << "_count" << braces << " " << count[id] << "\n";
+    };
+
+    header("twmailer_commands_total", "counter", "Commands handled, by command and result.");
+    for (int id = 0; id < METRIC_LDAP_BIND; id++) {
+        out << "twmailer_commands_total{command=\"" << metric_names[id] << "\",result=\"ok\"} " << count[id] - errors[id] << "\n";
+        out << "twmailer_commands_total{command=\"" << metric_names[id] << "\",result=\"err\"} " << errors[id] << "\n";
+    }
+    header("twmailer_command_duration_seconds", "histogram", "Time from dispatching a command until its response is queued.");
+    for (int id = 0; id < METRIC_LDAP_BIND; id++) {
+        histogram("twmailer_command_duration_seconds", "command=\"" + string(metric_names[id]) + "\"", id);
+    }
+#ifdef COUNT_ALLOCATIONS
+    header("twmailer_command_allocations_total", "counter", "Heap allocations from the first line or frame of a command until it was answered.");
+    for (int id = 0; id < METRIC_LDAP_BIND; id++) {
+        out << "twmailer_command_allocations_total{command=\"" << metric_names[id] << "\"} " << allocations[id] << "\n";
+    }
+#endif
+    header("twmailer_ldap_bind_duration_seconds", "histogram", "Round trip of one LDAP bind.");
+    histogram("twmailer_ldap_bind_duration_seconds", "", METRIC_LDAP_BIND);
+    header("twmailer_ldap_bind_failures_total", "counter", "LDAP binds that did not succeed.");
+    out << "twmailer_ldap_bind_failures_total " << errors[METRIC_LDAP_BIND] << "\n";
+    header("twmailer_received_bytes_total", "counter", "Bytes received from clients.");
+    out << "twmailer_received_bytes_total " << bytes_in << "\n";
+    header("twmailer_sent_bytes_total", "counter", "Bytes sent to clients.");
+    out << "twmailer_sent_bytes_total " << bytes_out << "\n";
+    header("twmailer_output_writes_total", "counter", "Socket write calls.");
+    out << "twmailer_output_writes_total " << writes << "\n";
+    header("twmailer_connections_active", "gauge", "Open client connections.");
+    out << "twmailer_connections_active " << connections << "\n";
+    header("twmailer_connections_rejected_total", "counter", "Connections turned away with ERR busy.");
+    out << "twmailer_connections_rejected_total " << connection_limits.rejected.load() << "\n";
+    header("twmailer_mailbox_lock_acquisitions_total", "counter", "Mailbox locks taken.");
+    out << "twmailer_mailbox_lock_acquisitions_total " << lock_acquisitions << "\n";
+    header("twmailer_mailbox_lock_contended_total", "counter", "Mailbox locks that were not immediately available.");
+    out << "twmailer_mailbox_lock_contended_total " << lock_contended << "\n";
+    header("twmailer_mailbox_lock_wait_seconds_total", "counter", "Time spent waiting for mailbox locks.");
+    out << "twmailer_mailbox_lock_wait_seconds_total " << lock_wait_ns / 1e9 << "\n";
+    header("twmailer_compression_input_bytes_total", "counter", "Bytes of messages and attachments offered to compression.");
+    out << "twmailer_compression_input_bytes_total " << compress_in << "\n";
+    header("twmailer_compression_output_bytes_total", "counter", "Bytes stored for them, compressed or verbatim.");
+    out << "twmailer_compression_output_bytes_total " << compress_out << "\n";
+    header("twmailer_compression_seconds_total", "counter", "Time spent compressing.");
+    out << "twmailer_compression_seconds_total " << compress_us / 1e6 << "\n";
+    header("twmailer_decompression_seconds_total", "counter", "Time spent decompressing for READ and GETFILE.");
+    out << "twmailer_decompression_seconds_total " << decompress_us / 1e6 << "\n";
+    header("twmailer_blobs_stored_total", "counter", "Messages and attachments written to the blob store.");
+    out << "twmailer_blobs_stored_total " << blobs_stored << "\n";
+    header("twmailer_blobs_reused_total", "counter", "Messages and attachments found in the blob store and linked again.");
+    out << "twmailer_blobs_reused_total " << blobs_reused << "\n";
+    header("twmailer_file_batches_total", "counter", "Batches of spool file operations, one io_uring submission each with --io-uring.");
+    out << "twmailer_file_batches_total " << file_batches << "\n";
+    header("twmailer_file_operations_total", "counter", "Spool file operations run in those batches.");
+    out << "twmailer_file_operations_total " << file_ops << "\n";
+    header("twmailer_proxied_commands_total", "counter", "Commands forwarded to the cluster node owning the mailbox.");
+    out << "twmailer_proxied_commands_total " << proxied << "\n";
+    header("twmailer_log_dropped_total", "counter", "Log records dropped because the log thread fell behind.");
+    out << "twmailer_log_dropped_total " << log_dropped() << "\n";
+    header("twmailer_journal_commits_total", "counter", "Journal commits, one fdatasync() each.");
+    out << "twmailer_journal_commits_total " << journal.commits.load(memory_order_relaxed) << "\n";
+    header("twmailer_journal_records_total", "counter", "SEND and DEL records made durable by them.");
+    out << "twmailer_journal_records_total " << journal.records.load(memory_order_relaxed) << "\n";
+    header("twmailer_journal_sync_seconds_total", "counter", "Time spent writing and syncing the journal.");
+    out << "twmailer_journal_sync_seconds_total " << journal.sync_us.load(memory_order_relaxed) / 1e6 << "\n";
+    header("twmailer_segment_compactions_total", "counter", "Mailbox segments rewritten without their deleted messages.");
+    out << "twmailer_segment_compactions_total " << segment_compactions.load() << "\n";
+    header("twmailer_segment_reclaimed_bytes_total", "counter", "Bytes freed by segment compactions.");
+    out << "twmailer_segment_reclaimed_bytes_total " << segment_reclaimed_bytes.load() << "\n";
+    return out.str();
+}
+
+// rewrites the metrics file every interval seconds, readers never see a partial file
+void run_metrics_dump(const string& path, int interval) {
+    string tmp_path = path + ".tmp";
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(interval));
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || !write_all(fd, format_metrics()) || rename(tmp_path.c_str(), path.c_str()) < 0) {
+            log_errno(LogLevel::ERROR, "Failed to write metrics file");
+        }
+        if (fd >= 0) close(fd);
+    }
+}
+
+// STATS: "OK <length>" followed by the metrics, admins only
+void process_stats(Session& s) {
+    CommandTimer timer(s, METRIC_STATS);
+    if (admin_users.count(s.username) == 0) {
+        send_status(s, "ERR"); // not an admin
+        return;
+    }
+    string text = format_metrics();
+    send_status(s, "OK " + to_string(text.length()));
+    send_data(s, text);
+}
+
+LimiterShard& LoginLimiter::shard(const string& ip) {
+    return shards[hash<string>()(ip) % LIMITER_SHARDS];
+}
+
+bool LoginLimiter::is_blocked(const string& ip) {
+    LimiterShard& sh = shard(ip);
+    lock_guard<mutex> lock(sh.shard_mutex);
+    auto it = sh.entries.find(ip);
+    // the wheel may not have dropped an expired block yet
+    return it != sh.entries.end() && it->second.blocked_since != 0 && it->second.expires > time(nullptr);
+}
+
+bool LoginLimiter::record_failure(const string& ip) {
+    time_t now = time(nullptr);
+    LimiterShard& sh = shard(ip);
+    lock_guard<mutex> lock(sh.shard_mutex);
+    auto result = sh.entries.try_emplace(ip);
+    LimiterEntry& entry = result.first->second;
+    if (!result.second && entry.expires <= now) {
+        entry = LimiterEntry(); // expired but not yet dropped by the wheel
+    }
+    entry.failures++;
+    entry.expires = now + BLACKLIST_SECONDS; // failures are forgotten BLACKLIST_SECONDS after the last one
+    if (result.second) {
+        schedule(ip, entry.expires); // one pending wheel slot per entry, expire() reschedules it if extended
+    }
+    if (entry.failures < MAX_LOGIN_FAILURES || entry.blocked_since != 0) {
+        return entry.blocked_since != 0;
+    }
+
+    entry.blocked_since = now;
+    {
+        lock_guard<mutex> log_lock(log_mutex);
+        pending_log += ip + " " + to_string(now) + "\n"; // same line format as the old rewritten file
+    }
+    log_ready.notify_one();
+    return true;
+}
+
+void LoginLimiter::record_success(const string& ip) {
+    LimiterShard& sh = shard(ip);
+    lock_guard<mutex> lock(sh.shard_mutex);
+    auto it = sh.entries.find(ip);
+    if (it != sh.entries.end() && it->second.blocked_since == 0) {
+        it->second.failures = 0; // the entry itself is dropped by the wheel
+    }
+}
+
+void LoginLimiter::schedule(const string& ip, time_t when) {
+    lock_guard<mutex> lock(wheel_mutex);
+    wheel[when % TIMER_WHEEL_SLOTS].push_back(ip);
+}
+
+// drops the entries whose time has come, walking every slot passed since the last call
+void LoginLimiter::expire(time_t now) {
+    if (wheel_time == 0 || now - wheel_time > TIMER_WHEEL_SLOTS) {
+        wheel_time = now - TIMER_WHEEL_SLOTS; // first call, or the clock jumped: look at every slot once
+    }
+    while (wheel_time < now) {
+        wheel_time++;
+        vector<string> due;
+        {
+            lock_guard<mutex> lock(wheel_mutex);
+            due.swap(wheel[wheel_time % TIMER_WHEEL_SLOTS]);
+        }
+        for (const string& ip : due) {
+            LimiterShard& sh = shard(ip);
+            lock_guard<mutex> lock(sh.shard_mutex);
+            auto it = sh.entries.find(ip);
+            if (it == sh.entries.end()) continue;
+            if (it->second.expires <= now) {
+                sh.entries.erase(it);
+            } else {
+                schedule(ip, it->second.expires); // extended by later failures, or a later round of the wheel
+            }
+        }
+    }
+}
+
+// appends the pending blocks to the log, or rewrites it with only the live blocks once it grew too long
+void LoginLimiter::flush() {
+    string lines;
+    {
+        lock_guard<mutex> lock(log_mutex);
+        lines.swap(pending_log);
+    }
+    if (lines.empty()) return;
+    log_lines += count(lines.begin(), lines.end(), '\n');
+
+    if (log_lines < BLACKLIST_COMPACT_LINES) {
+        int fd = open(BLACKLIST_FILENAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0 || !write_all(fd, lines)) {
+            log_errno(LogLevel::ERROR, "Failed to write blacklist");
+        }
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    // the table already holds every block that was queued, so the pending lines are not needed
+    string live;
+    size_t live_lines = 0;
+    time_t now = time(nullptr);
+    for (auto& sh : shards) {
+        lock_guard<mutex> lock(sh.shard_mutex);
+        for (const auto& entry : sh.entries) {
+            if (entry.second.blocked_since != 0 && entry.second.expires > now) {
+                live += entry.first + " " + to_string(entry.second.blocked_since) + "\n";
+                live_lines++;
+            }
+        }
+    }
+    string tmp_path = BLACKLIST_FILENAME ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || !write_all(fd, live) || rename(tmp_path.c_str(), BLACKLIST_FILENAME) < 0) {
+        log_errno(LogLevel::ERROR, "Failed to compact blacklist");
+        if (fd >= 0) close(fd);
+        unlink(tmp_path.c_str());
+        return;
+    }
+    close(fd);
+    log_lines = live_lines;
+}
+
+void LoginLimiter::run() {
+    while (true) {
+        {
+            unique_lock<mutex> lock(log_mutex);
+            log_ready.wait_for(lock, chrono::seconds(1)); // woken early by new blocks
+        }
+        expire(time(nullptr));
+        flush();
+    }
+}
+
+void LoginLimiter::start() {
+    thread(&LoginLimiter::run, this).detach();
+}
+
+void LoginLimiter::load() {
+    ifstream blacklist_file(BLACKLIST_FILENAME); // open blacklist file
+    if (!blacklist_file.is_open()) {
+        return; // file not found, return
+    }
+    string ip;
     time_t timestamp;
+    time_t now = time(nullptr);
     while (blacklist_file >> ip >> timestamp) {
-        blacklist[ip] = timestamp; // load each entry
+        log_lines++;
+        if (timestamp + BLACKLIST_SECONDS <= now) continue; // block is over
+        LimiterShard& sh = shard(ip);
+        lock_guard<mutex> lock(sh.shard_mutex);
+        auto result = sh.entries.try_emplace(ip);
+        LimiterEntry& entry = result.first->second;
+        entry.failures = MAX_LOGIN_FAILURES;
+        entry.blocked_since = max(entry.blocked_since, timestamp); // later lines of the same ip win
+        entry.expires = entry.blocked_since + BLACKLIST_SECONDS;
+        if (result.second) schedule(ip, entry.expires);
     }
     blacklist_file.close(); // close file
 }
 
+void LoginLimiter::print_stats(ostream& out) {
+    size_t tracked = 0, blocked = 0;
+    time_t now = time(nullptr);
+    for (auto& sh : shards) {
+        lock_guard<mutex> lock(sh.shard_mutex);
+        for (const auto& entry : sh.entries) {
+            tracked++;
+            if (entry.second.blocked_since != 0 && entry.second.expires > now) blocked++;
+        }
+    }
+    out << "blacklist tracked=" << tracked << " blocked=" << blocked << "\n";
+}